@@ -24,16 +24,86 @@
  * along with libprofit.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include "profit/profit.h"
 
+#include "pyprofit.h"
+
+/* POSIX shared memory available? */
+#if defined(__unix__) || defined(__APPLE__)
+#define PYPROFIT_HAS_SHM
+#else
+#undef PYPROFIT_HAS_SHM
+#endif
+
+/* Memory-mapped files available (for batch checkpoints)? */
+#if defined(__unix__) || defined(__APPLE__)
+#define PYPROFIT_HAS_MMAP
+#else
+#undef PYPROFIT_HAS_MMAP
+#endif
+
+/* pthread_atfork available (for fork safety)? */
+#if defined(__unix__) || defined(__APPLE__)
+#define PYPROFIT_HAS_ATFORK
+#else
+#undef PYPROFIT_HAS_ATFORK
+#endif
+
+/* Unix domain sockets available (for the evaluation server)? */
+#if defined(__unix__) || defined(__APPLE__)
+#define PYPROFIT_HAS_SERVE
+#else
+#undef PYPROFIT_HAS_SERVE
+#endif
+
+#ifdef PYPROFIT_HAS_SHM
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // PYPROFIT_HAS_SHM
+
+#ifdef PYPROFIT_HAS_ATFORK
+#include <pthread.h>
+#endif // PYPROFIT_HAS_ATFORK
+
+#ifdef PYPROFIT_HAS_SERVE
+#include <condition_variable>
+#include <deque>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif // PYPROFIT_HAS_SERVE
+
+/* Defined by setup.py when libprofit uses FFTW, and its headers are found */
+#ifdef PYPROFIT_HAS_FFTW
+#include <fftw3.h>
+#endif // PYPROFIT_HAS_FFTW
+
 using namespace profit;
 
 /* Python 2/3 compatibility */
@@ -134,6 +204,9 @@ static PyObject *pyprofit_opencl_info(PyObject *self, PyObject *args) {
 typedef struct {
     PyObject_HEAD
 	OpenCLEnvPtr env;
+	unsigned int plat_idx;
+	unsigned int dev_idx;
+	bool use_double;
 } PyOpenCLEnv;
 
 
@@ -165,6 +238,9 @@ static int openclenv_init(PyOpenCLEnv *self, PyObject *args, PyObject *kwargs) {
 		return -1;
 	}
 
+	self->plat_idx = plat_idx;
+	self->dev_idx = dev_idx;
+	self->use_double = static_cast<bool>(use_double);
 	return 0;
 }
 
@@ -173,6 +249,20 @@ static void openclenv_dealloc(PyOpenCLEnv *self) {
 	Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
+/*
+ * Pickling support: an environment is recreated from its platform/device
+ * indices in the unpickling process
+ */
+static PyObject *openclenv_reduce(PyOpenCLEnv *self, PyObject *args) {
+	return Py_BuildValue("(O(IIO))", (PyObject *)Py_TYPE(self),
+	                     self->plat_idx, self->dev_idx, self->use_double ? Py_True : Py_False);
+}
+
+static PyMethodDef PyOpenCLEnv_methods[] = {
+    {"__reduce__", (PyCFunction)openclenv_reduce, METH_NOARGS, "Helper for pickle."},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
 /*
  * openclenv object type
  */
@@ -188,46 +278,635 @@ static PyTypeObject PyOpenCLEnv_Type = {
 };
 
 
+#ifdef PYPROFIT_HAS_SHM
+
+/*
+ * sharedbuffer object structure
+ *
+ * A 2-D matrix of doubles living in a POSIX shared memory segment. The
+ * segment starts with a small header holding the matrix dimensions, so
+ * other processes can attach to it knowing only its name. Objects export
+ * the buffer protocol, and can be given anywhere a PSF, mask or data matrix
+ * is expected.
+ */
+struct sharedbuffer_header {
+	char magic[8];
+	unsigned int width;
+	unsigned int height;
+	char padding[48];
+};
+
+static const char PYPROFIT_SHM_MAGIC[8] = {'P', 'Y', 'P', 'R', 'O', 'F', 'S', 'B'};
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *name;
+	void *mem;
+	std::size_t size;
+	Py_ssize_t shape[2];
+	Py_ssize_t strides[2];
+} PySharedBuffer;
+
+static double *sharedbuffer_data(PySharedBuffer *self) {
+	return reinterpret_cast<double *>(static_cast<char *>(self->mem) + sizeof(sharedbuffer_header));
+}
+
+static bool _read_double_matrix(PyObject *matrix, std::vector<double> &values, unsigned int *width_out, unsigned int *height_out);
+
+/*
+ * __init__, destructor
+ */
+static int sharedbuffer_init(PySharedBuffer *self, PyObject *args, PyObject *kwargs) {
+
+	const char *name;
+	unsigned int width = 0, height = 0;
+	PyObject *create = Py_False;
+	PyObject *data = NULL;
+
+	const char *kwlist[] = {"name", "width", "height", "create", "data", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "s|IIOO:sharedbuffer", const_cast<char **>(kwlist),
+	                                 &name, &width, &height, &create, &data) ) {
+		return -1;
+	}
+
+	if( self->mem ) {
+		PyErr_SetString(profit_error, "sharedbuffer already initialized");
+		return -1;
+	}
+
+	int do_create = PyObject_IsTrue(create);
+	if( do_create < 0 ) {
+		return -1;
+	}
+	std::vector<double> values;
+	if( data && data != Py_None ) {
+		if( !do_create ) {
+			PyErr_SetString(profit_error, "data can only be given when creating a sharedbuffer");
+			return -1;
+		}
+		if( !_read_double_matrix(data, values, &width, &height) ) {
+			return -1;
+		}
+	}
+
+	int fd;
+	std::size_t size = 0;
+	if( do_create ) {
+		if( width == 0 || height == 0 ) {
+			PyErr_SetString(profit_error, "width and height must be given when creating a sharedbuffer");
+			return -1;
+		}
+		size = sizeof(sharedbuffer_header) + sizeof(double) * width * height;
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+		if( fd != -1 && ftruncate(fd, size) == -1 ) {
+			int err = errno;
+			close(fd);
+			shm_unlink(name);
+			errno = err;
+			fd = -1;
+		}
+	}
+	else {
+		fd = shm_open(name, O_RDWR, 0);
+		struct stat st;
+		if( fd != -1 ) {
+			if( fstat(fd, &st) == -1 ) {
+				int err = errno;
+				close(fd);
+				errno = err;
+				fd = -1;
+			}
+			else {
+				size = st.st_size;
+			}
+		}
+	}
+	if( fd == -1 ) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, const_cast<char *>(name));
+		return -1;
+	}
+
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int err = errno;
+	close(fd);
+	if( mem == MAP_FAILED ) {
+		if( do_create ) {
+			shm_unlink(name);
+		}
+		errno = err;
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, const_cast<char *>(name));
+		return -1;
+	}
+
+	auto header = static_cast<sharedbuffer_header *>(mem);
+	if( do_create ) {
+		std::memcpy(header->magic, PYPROFIT_SHM_MAGIC, sizeof(PYPROFIT_SHM_MAGIC));
+		header->width = width;
+		header->height = height;
+	}
+	else if( size < sizeof(sharedbuffer_header) ||
+	         std::memcmp(header->magic, PYPROFIT_SHM_MAGIC, sizeof(PYPROFIT_SHM_MAGIC)) != 0 ||
+	         size < sizeof(sharedbuffer_header) + sizeof(double) * header->width * header->height ) {
+		munmap(mem, size);
+		PyErr_Format(profit_error, "%s is not a pyprofit shared buffer", name);
+		return -1;
+	}
+
+	self->mem = mem;
+	self->size = size;
+	self->shape[0] = header->height;
+	self->shape[1] = header->width;
+	self->strides[0] = sizeof(double) * header->width;
+	self->strides[1] = sizeof(double);
+	self->name = STRING_FROM_UTF8(name, std::strlen(name));
+	if( !values.empty() ) {
+		std::memcpy(sharedbuffer_data(self), values.data(), sizeof(double) * values.size());
+	}
+	return 0;
+}
+
+static void sharedbuffer_dealloc(PySharedBuffer *self) {
+	if( self->mem ) {
+		munmap(self->mem, self->size);
+	}
+	Py_XDECREF(self->name);
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Buffer protocol */
+static int sharedbuffer_getbuffer(PySharedBuffer *self, Py_buffer *view, int flags) {
+
+	if( !self->mem ) {
+		PyErr_SetString(PyExc_BufferError, "sharedbuffer not initialized");
+		view->obj = NULL;
+		return -1;
+	}
+
+	view->buf = sharedbuffer_data(self);
+	view->obj = (PyObject *)self;
+	Py_INCREF(self);
+	view->len = self->shape[0] * self->strides[0];
+	view->readonly = 0;
+	view->itemsize = sizeof(double);
+	view->format = (flags & PyBUF_FORMAT) ? const_cast<char *>("d") : NULL;
+	view->ndim = 2;
+	view->shape = self->shape;
+	view->strides = self->strides;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static PyBufferProcs sharedbuffer_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+	NULL, NULL, NULL, NULL,
+#endif
+	(getbufferproc)sharedbuffer_getbuffer,
+	NULL,
+};
+
+static PyObject *sharedbuffer_get_name(PySharedBuffer *self, void *closure) {
+	if( !self->name ) {
+		Py_RETURN_NONE;
+	}
+	Py_INCREF(self->name);
+	return self->name;
+}
+
+static PyObject *sharedbuffer_get_width(PySharedBuffer *self, void *closure) {
+	return PyLong_FromSsize_t(self->shape[1]);
+}
+
+static PyObject *sharedbuffer_get_height(PySharedBuffer *self, void *closure) {
+	return PyLong_FromSsize_t(self->shape[0]);
+}
+
+static PyGetSetDef PySharedBuffer_getset[] = {
+    {const_cast<char *>("name"),   (getter)sharedbuffer_get_name,   NULL, const_cast<char *>("Name of the shared memory segment"), NULL},
+    {const_cast<char *>("width"),  (getter)sharedbuffer_get_width,  NULL, const_cast<char *>("Width of the matrix"), NULL},
+    {const_cast<char *>("height"), (getter)sharedbuffer_get_height, NULL, const_cast<char *>("Height of the matrix"), NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+/*
+ * Removes the name of the shared memory segment; processes that already
+ * attached to it can keep using it.
+ */
+static PyObject *sharedbuffer_unlink(PySharedBuffer *self, PyObject *args) {
+	if( !self->name ) {
+		PYPROFIT_RAISE("sharedbuffer not initialized");
+	}
+	PyObject *name = PyUnicode_Check(self->name) ? PyUnicode_AsUTF8String(self->name) : (Py_INCREF(self->name), self->name);
+	if( !name ) {
+		return NULL;
+	}
+	int res = shm_unlink(PyBytes_AsString(name));
+	Py_DECREF(name);
+	if( res == -1 ) {
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+	Py_RETURN_NONE;
+}
+
+/*
+ * Pickling support: unpickled objects attach to the same segment by name,
+ * so no data is copied.
+ */
+static PyObject *sharedbuffer_reduce(PySharedBuffer *self, PyObject *args) {
+	if( !self->name ) {
+		PYPROFIT_RAISE("sharedbuffer not initialized");
+	}
+	return Py_BuildValue("(O(O))", (PyObject *)Py_TYPE(self), self->name);
+}
+
+static PyMethodDef PySharedBuffer_methods[] = {
+    {"unlink",     (PyCFunction)sharedbuffer_unlink, METH_NOARGS, "Removes the name of the underlying shared memory segment."},
+    {"__reduce__", (PyCFunction)sharedbuffer_reduce, METH_NOARGS, "Helper for pickle."},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+/*
+ * sharedbuffer object type
+ */
+static PyTypeObject PySharedBuffer_Type = {
+#if PY_MAJOR_VERSION >= 3
+	PyVarObject_HEAD_INIT(NULL, 0)
+#else
+	PyObject_HEAD_INIT(NULL)
+	0,                             /*ob_size*/
+#endif
+	"pyprofit.sharedbuffer",       /*tp_name*/
+	sizeof(PySharedBuffer),        /*tp_basicsize*/
+};
+
+#endif // PYPROFIT_HAS_SHM
+
+/*
+ * Model specifications
+ *
+ * A model_spec is the parsed form of a model dictionary. Profile parameters
+ * are recorded in the order in which they are read, which is fixed for each
+ * profile type, so two dictionaries describing the same model always yield
+ * the same specification regardless of their key ordering. Specifications
+ * are turned into profit::Model objects only when they are about to be
+ * evaluated.
+ */
+struct profile_parameter {
+	enum kind_t {DOUBLE = 0, BOOL, UINT};
+	std::string name;
+	kind_t kind;
+	double value;
+};
+
+struct profile_spec {
+	std::string name;
+	std::vector<profile_parameter> parameters;
+	/* Target relative error, if subsampling settings should be chosen for it */
+	double accuracy = std::numeric_limits<double>::quiet_NaN();
+	/* Radial table of tabulated profiles */
+	std::vector<double> radii;
+	std::vector<double> values;
+};
+
+/* A convolver implemented by pyprofit (see _evaluate_with_native_convolver) */
+struct native_convolver;
+
+/* How a PSF was trimmed (see _trim_psf) */
+struct psf_trim_info {
+	/* Zero unless trimming was requested */
+	unsigned int original_width = 0;
+	unsigned int original_height = 0;
+	unsigned int width = 0;
+	unsigned int height = 0;
+	/* Fraction of the original flux left out of the box */
+	double discarded_flux = 0;
+};
+
+/* The subsampling settings chosen for a profile given with an accuracy */
+struct subsampling_choice {
+	std::size_t profile;
+	double accuracy;
+	double error;
+	std::vector<profile_parameter> settings;
+};
+
+struct model_spec {
+	unsigned int width = 0;
+	unsigned int height = 0;
+	double scale_x = 1;
+	double scale_y = 1;
+	std::vector<double> psf;
+	unsigned int psf_width = 0;
+	unsigned int psf_height = 0;
+	double psf_scale_x = 1;
+	double psf_scale_y = 1;
+	/* Not serialised, the PSF is kept trimmed */
+	psf_trim_info psf_trim;
+	std::vector<bool> calcmask;
+	double magzero = 0;
+	unsigned int omp_threads = 1;
+	unsigned int finesampling = 1;
+	bool return_finesampled = true;
+	std::shared_ptr<Convolver> convolver;
+	/* Not serialised, like the convolver */
+	std::shared_ptr<const native_convolver> native_conv;
+	OpenCLEnvPtr opencl_env;
+	std::vector<profile_spec> profiles;
+	/* Not serialised, only used by binned models (see compiled_model::set_level) */
+	double bg_scale = 1;
+	/* Not serialised either, the chosen settings are part of the profiles */
+	std::vector<subsampling_choice> subsampling;
+	/* Whether repeated profile shapes are rendered once (see _instance_stamps) */
+	bool instancing = false;
+};
+
 /* Utility methods */
-void read_double(std::shared_ptr<Profile> &p, PyObject *item, const char *key) {
+void read_double(profile_spec &p, PyObject *item, const char *key) {
 	PyObject *tmp = PyDict_GetItemString(item, key);
 	if( tmp != NULL ) {
-		p->parameter(key, PyFloat_AsDouble(tmp));
+		p.parameters.push_back({key, profile_parameter::DOUBLE, PyFloat_AsDouble(tmp)});
 	}
 }
 
-void read_bool(std::shared_ptr<Profile> &p, PyObject *item, const char *key) {
+void read_bool(profile_spec &p, PyObject *item, const char *key) {
 	PyObject *tmp = PyDict_GetItemString(item, key);
 	if( tmp != NULL ) {
-		p->parameter(key, (bool)PyObject_IsTrue(tmp));
+		p.parameters.push_back({key, profile_parameter::BOOL, (double)(bool)PyObject_IsTrue(tmp)});
 	}
 }
 
-void read_uint(std::shared_ptr<Profile> &p, PyObject *item, const char *key) {
+void read_uint(profile_spec &p, PyObject *item, const char *key) {
 	PyObject *tmp = PyDict_GetItemString(item, key);
 	if( tmp != NULL ) {
-		p->parameter(key, (unsigned int)PyInt_AsUnsignedLongMask(tmp));
+		p.parameters.push_back({key, profile_parameter::UINT, (double)(unsigned int)PyInt_AsUnsignedLongMask(tmp)});
+	}
+}
+
+/*
+ * DLPack
+ *
+ * The subset of the DLPack ABI (https://github.com/dmlc/dlpack) we need to
+ * exchange matrices with frameworks like PyTorch or JAX without copies
+ * through numpy. Only CPU tensors are supported, using the unversioned
+ * "dltensor" capsules every DLPack-capable framework understands.
+ */
+struct DLDevice {
+	std::int32_t device_type;
+	std::int32_t device_id;
+};
+
+struct DLDataType {
+	std::uint8_t code;
+	std::uint8_t bits;
+	std::uint16_t lanes;
+};
+
+struct DLTensor {
+	void *data;
+	DLDevice device;
+	std::int32_t ndim;
+	DLDataType dtype;
+	std::int64_t *shape;
+	std::int64_t *strides;
+	std::uint64_t byte_offset;
+};
+
+struct DLManagedTensor {
+	DLTensor dl_tensor;
+	void *manager_ctx;
+	void (*deleter)(DLManagedTensor *self);
+};
+
+static const std::int32_t DLPACK_CPU = 1;
+static const std::uint8_t DLPACK_INT = 0, DLPACK_UINT = 1, DLPACK_FLOAT = 2, DLPACK_BOOL = 6;
+
+template <typename T, typename Container>
+static void _copy_dlpack(const DLTensor &t, Container &values) {
+	auto data = reinterpret_cast<const T *>(static_cast<const char *>(t.data) + t.byte_offset);
+	std::int64_t row_stride = t.strides ? t.strides[0] : t.shape[1];
+	std::int64_t col_stride = t.strides ? t.strides[1] : 1;
+	for(std::int64_t j = 0; j != t.shape[0]; j++) {
+		for(std::int64_t i = 0; i != t.shape[1]; i++) {
+			values[i + j * t.shape[1]] = data[j * row_stride + i * col_stride];
+		}
+	}
+}
+
+/*
+ * Reads a 2-D matrix from an object implementing __dlpack__.
+ * Returns like _read_buffer_matrix.
+ */
+template <typename Container>
+static int _read_dlpack_matrix(PyObject *matrix, Container &values, unsigned int *matrix_width, unsigned int *matrix_height) {
+
+	if( !PyObject_HasAttrString(matrix, "__dlpack__") ) {
+		return 0;
+	}
+	PyObject *capsule = PyObject_CallMethod(matrix, const_cast<char *>("__dlpack__"), NULL);
+	if( !capsule ) {
+		return -1;
+	}
+	auto managed = static_cast<DLManagedTensor *>(PyCapsule_GetPointer(capsule, "dltensor"));
+	if( !managed ) {
+		Py_DECREF(capsule);
+		return -1;
+	}
+
+	/* We consume the tensor, and release it as soon as it's copied */
+	PyCapsule_SetName(capsule, "used_dltensor");
+	Py_DECREF(capsule);
+
+	const DLTensor &t = managed->dl_tensor;
+	const char *error = nullptr;
+	if( t.device.device_type != DLPACK_CPU ) {
+		error = "Only CPU DLPack tensors are supported";
+	}
+	else if( t.ndim != 2 ) {
+		error = "DLPack tensors must be 2-dimensional";
+	}
+	else if( t.dtype.lanes != 1 ) {
+		error = "Vector DLPack types are not supported";
+	}
+	else {
+		*matrix_height = (unsigned int)t.shape[0];
+		*matrix_width = (unsigned int)t.shape[1];
+		values.resize(std::size_t(t.shape[0] * t.shape[1]));
+		auto code = t.dtype.code, bits = t.dtype.bits;
+		if( code == DLPACK_FLOAT && bits == 64 ) {
+			_copy_dlpack<double>(t, values);
+		}
+		else if( code == DLPACK_FLOAT && bits == 32 ) {
+			_copy_dlpack<float>(t, values);
+		}
+		else if( (code == DLPACK_BOOL || code == DLPACK_UINT) && bits == 8 ) {
+			_copy_dlpack<std::uint8_t>(t, values);
+		}
+		else if( code == DLPACK_INT && bits == 8 ) {
+			_copy_dlpack<std::int8_t>(t, values);
+		}
+		else if( code == DLPACK_INT && bits == 16 ) {
+			_copy_dlpack<std::int16_t>(t, values);
+		}
+		else if( code == DLPACK_INT && bits == 32 ) {
+			_copy_dlpack<std::int32_t>(t, values);
+		}
+		else if( code == DLPACK_INT && bits == 64 ) {
+			_copy_dlpack<std::int64_t>(t, values);
+		}
+		else {
+			error = "Unsupported DLPack data type";
+		}
+	}
+
+	if( managed->deleter ) {
+		managed->deleter(managed);
+	}
+	if( error ) {
+		PyErr_SetString(profit_error, error);
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Reads a 2-D matrix from an object exporting a C-contiguous buffer, like
+ * a pyprofit.sharedbuffer or a numpy array, without creating a python
+ * object per cell. Objects not exporting a buffer but implementing
+ * __dlpack__ are read through DLPack.
+ * Returns 1 if the matrix was read, 0 if @matrix doesn't export a suitable
+ * buffer (and should be read as a sequence), and -1 on error.
+ */
+template <typename T, typename Container>
+static void _copy_buffer(const Py_buffer &view, Container &values) {
+	auto data = static_cast<const T *>(view.buf);
+	for(std::size_t i = 0; i != values.size(); i++) {
+		values[i] = data[i];
+	}
+}
+
+template <typename Container>
+static int _read_buffer_matrix(PyObject *matrix, Container &values, unsigned int *matrix_width, unsigned int *matrix_height) {
+
+	if( !PyObject_CheckBuffer(matrix) ) {
+		return _read_dlpack_matrix(matrix, values, matrix_width, matrix_height);
+	}
+
+	Py_buffer view;
+	if( PyObject_GetBuffer(matrix, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == -1 ) {
+		PyErr_Clear();
+		return 0;
+	}
+
+	/* Skip native byte order/alignment markers */
+	const char *format = view.format ? view.format : "B";
+	if( *format == '@' || *format == '=' ||
+	    (*format == '<' && PY_LITTLE_ENDIAN) || (*format == '>' && PY_BIG_ENDIAN) ) {
+		format++;
+	}
+
+	char type = format[0] && !format[1] ? format[0] : 0;
+	if( view.ndim != 2 || !type || !strchr("df?bBhHiIlLqQ", type) ) {
+		PyBuffer_Release(&view);
+		return 0;
+	}
+
+	/*
+	 * Explicit byte orders imply standard sizes, under which 'l' and 'L' are
+	 * 4 bytes wide even where longs are 8. Integers are therefore copied
+	 * according to the buffer's itemsize, and all other types must have the
+	 * size of the C type we read them as.
+	 */
+	bool is_integer = !strchr("df?", type);
+	bool is_signed = strchr("bhilq", type) != NULL;
+	std::size_t itemsize = std::size_t(view.itemsize);
+	bool valid_size;
+	switch(type) {
+	case 'd':
+		valid_size = itemsize == sizeof(double);
+		break;
+	case 'f':
+		valid_size = itemsize == sizeof(float);
+		break;
+	case '?':
+		valid_size = itemsize == sizeof(bool);
+		break;
+	default:
+		valid_size = itemsize == 1 || itemsize == 2 || itemsize == 4 || itemsize == 8;
+	}
+	if( !valid_size ) {
+		PyBuffer_Release(&view);
+		PyErr_SetString(profit_error, "Buffer item size doesn't match its format");
+		return -1;
+	}
+
+	*matrix_height = (unsigned int)view.shape[0];
+	*matrix_width = (unsigned int)view.shape[1];
+	values.resize(view.shape[0] * view.shape[1]);
+	if( type == 'd' ) {
+		_copy_buffer<double>(view, values);
+	}
+	else if( type == 'f' ) {
+		_copy_buffer<float>(view, values);
+	}
+	else if( type == '?' ) {
+		_copy_buffer<bool>(view, values);
+	}
+	else if( is_integer && is_signed ) {
+		switch(itemsize) {
+		case 1:
+			_copy_buffer<std::int8_t>(view, values);
+			break;
+		case 2:
+			_copy_buffer<std::int16_t>(view, values);
+			break;
+		case 4:
+			_copy_buffer<std::int32_t>(view, values);
+			break;
+		default:
+			_copy_buffer<std::int64_t>(view, values);
+		}
+	}
+	else {
+		switch(itemsize) {
+		case 1:
+			_copy_buffer<std::uint8_t>(view, values);
+			break;
+		case 2:
+			_copy_buffer<std::uint16_t>(view, values);
+			break;
+		case 4:
+			_copy_buffer<std::uint32_t>(view, values);
+			break;
+		default:
+			_copy_buffer<std::uint64_t>(view, values);
+		}
 	}
+
+	PyBuffer_Release(&view);
+	return 1;
 }
 
 /* Methods */
-static bool *_read_boolean_matrix(PyObject *matrix, unsigned int *matrix_width, unsigned int *matrix_height) {
+static bool _read_boolean_matrix(PyObject *matrix, std::vector<bool> &bools, unsigned int *matrix_width, unsigned int *matrix_height) {
 
-	bool *bools = NULL;
 	Py_ssize_t width = 0, height = 0;
 
+	*matrix_width = 0;
+	*matrix_height = 0;
 	if( matrix == NULL ) {
-		*matrix_width = 0;
-		*matrix_height = 0;
-		return NULL;
+		return true;
+	}
+
+	int read = _read_buffer_matrix(matrix, bools, matrix_width, matrix_height);
+	if( read != 0 ) {
+		return read == 1;
 	}
 
 	height = PySequence_Size(matrix);
 	for(Py_ssize_t j = 0; j!=height; j++) {
 		PyObject *row = PySequence_GetItem(matrix, j);
 		if( row == NULL ) {
-			free(bools);
-			return NULL;
+			return false;
 		}
 
 		/* All rows should have the same width */
@@ -235,13 +914,13 @@ static bool *_read_boolean_matrix(PyObject *matrix, unsigned int *matrix_width,
 			width = PySequence_Size(row);
 			*matrix_height = (unsigned int)height;
 			*matrix_width = (unsigned int)width;
-			bools = new bool[*matrix_width * *matrix_height];
+			bools.resize(width * height);
 		}
 		else {
 			if( PySequence_Size(row) != width ) {
 				Py_DECREF(row);
-				free(bools);
-				return NULL;
+				PyErr_SetString(profit_error, "All matrix rows must have the same width");
+				return false;
 			}
 		}
 
@@ -250,8 +929,7 @@ static bool *_read_boolean_matrix(PyObject *matrix, unsigned int *matrix_width,
 			PyObject *cell = PySequence_GetItem(row, i);
 			if( cell == NULL ) {
 				Py_DECREF(row);
-				free(bools);
-				return NULL;
+				return false;
 			}
 			bools[i + j*width] = (bool)PyObject_IsTrue(cell);
 			Py_DECREF(cell);
@@ -259,10 +937,10 @@ static bool *_read_boolean_matrix(PyObject *matrix, unsigned int *matrix_width,
 		Py_DECREF(row);
 	}
 
-	return bools;
+	return true;
 }
 
-static void _item_to_radial_profile(std::shared_ptr<Profile> &profile, PyObject *item) {
+static void _item_to_radial_profile(profile_spec &profile, PyObject *item) {
 	read_double(profile, item, "xcen");
 	read_double(profile, item, "ycen");
 	read_double(profile, item, "mag");
@@ -277,29 +955,34 @@ static void _item_to_radial_profile(std::shared_ptr<Profile> &profile, PyObject
 	read_double(profile, item, "rscale_switch");
 
 	read_bool(profile, item, "adjust");
+
+	PyObject *accuracy = PyDict_GetItemString(item, "accuracy");
+	if( accuracy && accuracy != Py_None ) {
+		profile.accuracy = PyFloat_AsDouble(accuracy);
+	}
 }
 
-static void _item_to_sersic_profile(std::shared_ptr<Profile> &profile, PyObject *item) {
+static void _item_to_sersic_profile(profile_spec &profile, PyObject *item) {
 	_item_to_radial_profile(profile, item);
 	read_double(profile, item, "re");
 	read_double(profile, item, "nser");
 	read_bool(profile, item, "rescale_flux");
 }
 
-static void _item_to_moffat_profile(std::shared_ptr<Profile> &profile, PyObject *item) {
+static void _item_to_moffat_profile(profile_spec &profile, PyObject *item) {
 	_item_to_radial_profile(profile, item);
 	read_double(profile, item, "fwhm");
 	read_double(profile, item, "con");
 }
 
-static void _item_to_ferrer_profile(std::shared_ptr<Profile> &profile, PyObject *item) {
+static void _item_to_ferrer_profile(profile_spec &profile, PyObject *item) {
 	_item_to_radial_profile(profile, item);
 	read_double(profile, item, "rout");
 	read_double(profile, item, "a");
 	read_double(profile, item, "b");
 }
 
-static void _item_to_coresersic_profile(std::shared_ptr<Profile> &profile, PyObject *item) {
+static void _item_to_coresersic_profile(profile_spec &profile, PyObject *item) {
 	_item_to_radial_profile(profile, item);
 	read_double(profile, item, "re");
 	read_double(profile, item, "rb");
@@ -308,7 +991,7 @@ static void _item_to_coresersic_profile(std::shared_ptr<Profile> &profile, PyObj
 	read_double(profile, item, "b");
 }
 
-static void _item_to_brokenexp_profile(std::shared_ptr<Profile> &profile, PyObject *item) {
+static void _item_to_brokenexp_profile(profile_spec &profile, PyObject *item) {
 	_item_to_radial_profile(profile, item);
 	read_double(profile, item, "h1");
 	read_double(profile, item, "h2");
@@ -316,27 +999,67 @@ static void _item_to_brokenexp_profile(std::shared_ptr<Profile> &profile, PyObje
 	read_double(profile, item, "a");
 }
 
-static void _item_to_king_profile(std::shared_ptr<Profile> &profile, PyObject *item) {
+static void _item_to_king_profile(profile_spec &profile, PyObject *item) {
 	_item_to_radial_profile(profile, item);
 	read_double(profile, item, "rc");
 	read_double(profile, item, "rt");
 	read_double(profile, item, "a");
 }
 
-static void _item_to_sky_profile(std::shared_ptr<Profile> &profile, PyObject *item) {
+/* Reads a sequence of numbers from @item[@key] */
+static void _read_table(PyObject *item, const char *key, std::vector<double> &table) {
+	PyObject *sequence = PyDict_GetItemString(item, key);
+	if( sequence == NULL ) {
+		PyErr_Format(profit_error, "tabulated profiles need a '%s' item", key);
+		return;
+	}
+	PyObject *seq = PySequence_Fast(sequence, "tabulated profile tables must be sequences of numbers");
+	if( seq == NULL ) {
+		return;
+	}
+	for(Py_ssize_t i = 0; i != PySequence_Fast_GET_SIZE(seq); i++) {
+		table.push_back(PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i)));
+	}
+	Py_DECREF(seq);
+}
+
+static void _item_to_tabulated_profile(profile_spec &profile, PyObject *item) {
+	_item_to_radial_profile(profile, item);
+	_read_table(item, "radii", profile.radii);
+	_read_table(item, "values", profile.values);
+	if( PyErr_Occurred() ) {
+		return;
+	}
+	if( profile.radii.size() < 2 || profile.radii.size() != profile.values.size() ) {
+		PyErr_SetString(profit_error, "tabulated profiles need at least two radii, and as many values");
+		return;
+	}
+	if( !(profile.radii.front() >= 0) ) {
+		PyErr_SetString(profit_error, "tabulated profile radii can't be negative");
+		return;
+	}
+	for(std::size_t i = 1; i != profile.radii.size(); i++) {
+		if( !(profile.radii[i] > profile.radii[i - 1]) ) {
+			PyErr_SetString(profit_error, "tabulated profile radii must be in increasing order");
+			return;
+		}
+	}
+}
+
+static void _item_to_sky_profile(profile_spec &profile, PyObject *item) {
 	read_double(profile, item, "bg");
 }
 
-static void _item_to_null_profile(std::shared_ptr<Profile> &profile, PyObject *item) {
+static void _item_to_null_profile(profile_spec &profile, PyObject *item) {
 }
 
-static void _item_to_psf_profile(std::shared_ptr<Profile> &profile, PyObject *item) {
+static void _item_to_psf_profile(profile_spec &profile, PyObject *item) {
 	read_double(profile, item, "xcen");
 	read_double(profile, item, "ycen");
 	read_double(profile, item, "mag");
 }
 
-void _read_profiles(Model &model, PyObject *profiles_dict, const char *name, void (item_to_profile)(std::shared_ptr<Profile> &p, PyObject *item)) {
+void _read_profiles(model_spec &spec, PyObject *profiles_dict, const char *name, void (item_to_profile)(profile_spec &p, PyObject *item)) {
 
 	PyObject *profile_sequence = PyDict_GetItemString(profiles_dict, name);
 	if( profile_sequence == NULL ) {
@@ -346,82 +1069,90 @@ void _read_profiles(Model &model, PyObject *profiles_dict, const char *name, voi
 	Py_ssize_t length = PySequence_Size(profile_sequence);
 	for(Py_ssize_t i = 0; i!= length; i++) {
 		PyObject *item = PySequence_GetItem(profile_sequence, i);
-		try {
-			auto p = model.add_profile(name);
-			read_bool(p, item, "convolve");
-			item_to_profile(p, item);
-		} catch(invalid_parameter &e) {
-			std::ostringstream os;
-			os << "warning: failed to create profile " << name << ": " << e.what();
-			PySys_WriteStderr("%s\n", os.str().c_str());
-			continue;
+		if( item == NULL ) {
+			return;
 		}
+		profile_spec p;
+		p.name = name;
+		read_bool(p, item, "convolve");
+		item_to_profile(p, item);
+		spec.profiles.push_back(std::move(p));
 		Py_DECREF(item);
 	}
 }
 
-static void _read_brokenexp_profiles(Model &model, PyObject *profiles_dict) {
-	_read_profiles(model, profiles_dict, "brokenexp", &_item_to_brokenexp_profile);
+static void _read_brokenexp_profiles(model_spec &spec, PyObject *profiles_dict) {
+	_read_profiles(spec, profiles_dict, "brokenexp", &_item_to_brokenexp_profile);
+}
+
+static void _read_coresersic_profiles(model_spec &spec, PyObject *profiles_dict) {
+	_read_profiles(spec, profiles_dict, "coresersic", &_item_to_coresersic_profile);
 }
 
-static void _read_coresersic_profiles(Model &model, PyObject *profiles_dict) {
-	_read_profiles(model, profiles_dict, "coresersic", &_item_to_coresersic_profile);
+static void _read_ferrer_profiles(model_spec &spec, PyObject *profiles_dict) {
+	_read_profiles(spec, profiles_dict, "ferrer", &_item_to_ferrer_profile);
+	_read_profiles(spec, profiles_dict, "ferrers", &_item_to_ferrer_profile);
 }
 
-static void _read_ferrer_profiles(Model &model, PyObject *profiles_dict) {
-	_read_profiles(model, profiles_dict, "ferrer", &_item_to_ferrer_profile);
-	_read_profiles(model, profiles_dict, "ferrers", &_item_to_ferrer_profile);
+static void _read_king_profiles(model_spec &spec, PyObject *profiles_dict) {
+	_read_profiles(spec, profiles_dict, "king", &_item_to_king_profile);
 }
 
-static void _read_king_profiles(Model &model, PyObject *profiles_dict) {
-	_read_profiles(model, profiles_dict, "king", &_item_to_king_profile);
+static void _read_moffat_profiles(model_spec &spec, PyObject *profiles_dict) {
+	_read_profiles(spec, profiles_dict, "moffat", &_item_to_moffat_profile);
 }
 
-static void _read_moffat_profiles(Model &model, PyObject *profiles_dict) {
-	_read_profiles(model, profiles_dict, "moffat", &_item_to_moffat_profile);
+static void _read_psf_profiles(model_spec &spec, PyObject *profiles_dict) {
+	_read_profiles(spec, profiles_dict, "psf", &_item_to_psf_profile);
 }
 
-static void _read_psf_profiles(Model &model, PyObject *profiles_dict) {
-	_read_profiles(model, profiles_dict, "psf", &_item_to_psf_profile);
+static void _read_sky_profiles(model_spec &spec, PyObject *profiles_dict) {
+	_read_profiles(spec, profiles_dict, "sky", &_item_to_sky_profile);
 }
 
-static void _read_sky_profiles(Model &model, PyObject *profiles_dict) {
-	_read_profiles(model, profiles_dict, "sky", &_item_to_sky_profile);
+static void _read_null_profiles(model_spec &spec, PyObject *profiles_dict) {
+	_read_profiles(spec, profiles_dict, "null", &_item_to_null_profile);
 }
 
-static void _read_null_profiles(Model &model, PyObject *profiles_dict) {
-	_read_profiles(model, profiles_dict, "null", &_item_to_null_profile);
+static void _read_sersic_profiles(model_spec &spec, PyObject *profiles_dict) {
+	_read_profiles(spec, profiles_dict, "sersic", &_item_to_sersic_profile);
 }
 
-static void _read_sersic_profiles(Model &model, PyObject *profiles_dict) {
-	_read_profiles(model, profiles_dict, "sersic", &_item_to_sersic_profile);
+static void _read_tabulated_profiles(model_spec &spec, PyObject *profiles_dict) {
+	_read_profiles(spec, profiles_dict, "tabulated", &_item_to_tabulated_profile);
 }
 
-static double *_read_psf(PyObject *matrix, unsigned int *psf_width, unsigned int *psf_height) {
+static bool _read_double_matrix(PyObject *matrix, std::vector<double> &values, unsigned int *width_out, unsigned int *height_out) {
 
-	double *psf = NULL;
 	Py_ssize_t width = 0, height = 0;
 
+	int read = _read_buffer_matrix(matrix, values, width_out, height_out);
+	if( read != 0 ) {
+		return read == 1;
+	}
+
 	height = PySequence_Size(matrix);
+	if( height == -1 ) {
+		return false;
+	}
 	for(Py_ssize_t j = 0; j!=height; j++) {
 		PyObject *row = PySequence_GetItem(matrix, j);
 		if( row == NULL ) {
-			free(psf);
-			return NULL;
+			return false;
 		}
 
 		/* All rows should have the same width */
 		if( j == 0 ) {
 			width = PySequence_Size(row);
-			*psf_height = (unsigned int)height;
-			*psf_width = (unsigned int)width;
-			psf = new double[width * height];
+			*height_out = (unsigned int)height;
+			*width_out = (unsigned int)width;
+			values.resize(width * height);
 		}
 		else {
 			if( PySequence_Size(row) != width ) {
 				Py_DECREF(row);
-				free(psf);
-				return NULL;
+				PyErr_SetString(profit_error, "All matrix rows must have the same width");
+				return false;
 			}
 		}
 
@@ -430,28 +1161,15 @@ static double *_read_psf(PyObject *matrix, unsigned int *psf_width, unsigned int
 			PyObject *cell = PySequence_GetItem(row, i);
 			if( cell == NULL ) {
 				Py_DECREF(row);
-				free(psf);
-				return NULL;
+				return false;
 			}
-			psf[i + j*width] = PyFloat_AsDouble(cell);
+			values[i + j*width] = PyFloat_AsDouble(cell);
 			Py_DECREF(cell);
 		}
 		Py_DECREF(row);
 	}
 
-	return psf;
-}
-
-static double *_read_psf_from_model(PyObject *model_dict, unsigned int *psf_width, unsigned int *psf_height) {
-
-	PyObject *matrix = PyDict_GetItemString(model_dict, "psf");
-	if( matrix == NULL ) {
-		*psf_width = 0;
-		*psf_height = 0;
-		return NULL;
-	}
-
-	return _read_psf(matrix, psf_width, psf_height);
+	return !PyErr_Occurred();
 }
 
 #define READ_DOUBLE(from, name, to) \
@@ -460,18 +1178,367 @@ static double *_read_psf_from_model(PyObject *model_dict, unsigned int *psf_widt
 		if( _val != NULL ) { \
 			to = PyFloat_AsDouble(_val); \
 			if( PyErr_Occurred() ) { \
-				PYPROFIT_RAISE("Error reading '"#name"' argument, not a floating point number"); \
+				PyErr_SetString(profit_error, "Error reading '"#name"' argument, not a floating point number"); \
+				return false; \
 			} \
 		} \
 	} while(0);
 
 
+/*
+ * PSF trimming
+ *
+ * PSFs are often given on stamps much larger than needed, while the cost
+ * of convolving them directly grows with their area. Given a flux
+ * fraction, PSFs are trimmed to the smallest centred box enclosing that
+ * fraction of their flux, and renormalised to their original flux. Boxes
+ * are square (unless clipped by the stamp) and keep the PSF's centre.
+ * Trims @psf in place, recording how in @info. On error a python exception
+ * is set and false is returned.
+ */
+static bool _trim_psf(std::vector<double> &psf, unsigned int &width, unsigned int &height, double flux_fraction, psf_trim_info &info) {
+
+	if( !(flux_fraction > 0 && flux_fraction <= 1) ) {
+		PyErr_SetString(profit_error, "psf_flux_fraction must be within (0, 1]");
+		return false;
+	}
+
+	/* Summed-area table, with a leading row and column of zeros */
+	std::vector<double> table(std::size_t(width + 1) * (height + 1));
+	for(unsigned int j = 0; j != height; j++) {
+		for(unsigned int i = 0; i != width; i++) {
+			table[(i + 1) + (j + 1) * (width + 1)] = psf[i + j * width] + table[i + (j + 1) * (width + 1)]
+			                                        + table[(i + 1) + j * (width + 1)] - table[i + j * (width + 1)];
+		}
+	}
+	auto box_sum = [&](unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1) {
+		return table[x1 + y1 * (width + 1)] - table[x0 + y1 * (width + 1)] - table[x1 + y0 * (width + 1)] + table[x0 + y0 * (width + 1)];
+	};
+	double total = box_sum(0, 0, width, height);
+	if( !(total > 0) ) {
+		PyErr_SetString(profit_error, "Only PSFs with positive total flux can be trimmed");
+		return false;
+	}
+
+	info.original_width = info.width = width;
+	info.original_height = info.height = height;
+	info.discarded_flux = 0;
+
+	/*
+	 * Boxes grow around the centre pixel (width / 2, height / 2) and are
+	 * clipped by the stamp, which for even sizes leaves one more row or
+	 * column on one side once the box reaches the other edge.
+	 */
+	unsigned int cx = width / 2, cy = height / 2;
+	for(unsigned int half = 0; half <= std::max(cx, cy); half++) {
+		unsigned int x0 = cx - std::min(half, cx), x1 = std::min(cx + half + 1, width);
+		unsigned int y0 = cy - std::min(half, cy), y1 = std::min(cy + half + 1, height);
+		unsigned int box_w = x1 - x0, box_h = y1 - y0;
+		if( box_w == width && box_h == height ) {
+			break;
+		}
+		double enclosed = box_sum(x0, y0, x1, y1);
+		if( enclosed < flux_fraction * total ) {
+			continue;
+		}
+		std::vector<double> trimmed(std::size_t(box_w) * box_h);
+		for(unsigned int j = 0; j != box_h; j++) {
+			for(unsigned int i = 0; i != box_w; i++) {
+				trimmed[i + j * box_w] = psf[(x0 + i) + (y0 + j) * width] * total / enclosed;
+			}
+		}
+		psf = std::move(trimmed);
+		width = info.width = box_w;
+		height = info.height = box_h;
+		info.discarded_flux = (total - enclosed) / total;
+		break;
+	}
+	return true;
+}
+
+/* The trimming of a PSF as a dictionary, or None if it wasn't requested */
+static PyObject *_psf_trim_to_dict(const psf_trim_info &info) {
+	if( info.original_width == 0 ) {
+		Py_RETURN_NONE;
+	}
+	return Py_BuildValue("{s:I,s:I,s:I,s:I,s:d}",
+	                     "width", info.width, "height", info.height,
+	                     "original_width", info.original_width, "original_height", info.original_height,
+	                     "discarded_flux", info.discarded_flux);
+}
+
+/*
+ * Convolvers implemented by pyprofit
+ *
+ * libprofit's convolvers can only be given a PSF in real space, and
+ * convolve it whole. pyprofit convolves images itself with PSFs given in
+ * Fourier space and with hybrid convolvers (see below). Profiles to be
+ * convolved are then rendered on a padded grid, with the image at its
+ * centre so flux from just outside the image is convolved into it, which
+ * is convolved in place and cropped (see _evaluate_with_native_convolver).
+ * These are used by make_model and make_models only.
+ */
+struct native_convolver {
+	virtual ~native_convolver() {}
+
+	/* Size of the padded grid on which width x height images are convolved */
+	virtual void padded_size(unsigned int width, unsigned int height, unsigned int &padded_width, unsigned int &padded_height) const = 0;
+
+	/* Convolves a padded image in place */
+	virtual void convolve(std::vector<double> &image, unsigned int width, unsigned int height) const = 0;
+
+	/* Identifies the PSF and settings of the convolver, as used in checkpoints */
+	virtual std::string key() const = 0;
+};
+
+/*
+ * PSFs given in Fourier space
+ *
+ * Users holding the optical transfer function (OTF) of their PSF can give
+ * it instead of the PSF itself, skipping both the parsing of the PSF and
+ * its forward transform. The OTF is the half-spectrum of the PSF's
+ * real-to-complex FFT (as numpy.fft.rfft2 returns it), of
+ * padded_height rows of padded_width / 2 + 1 values, for the PSF centred
+ * on pixel (0, 0) and wrapped around the edges of a padded_width x
+ * padded_height grid (i.e., after numpy.fft.ifftshift). The padded grid
+ * must be at least as large as the image plus the PSF, or the convolution
+ * wraps around. Convolving with OTFs needs pyprofit to be built against
+ * FFTW (which libprofit normally uses already).
+ */
+struct otf_psf : native_convolver {
+	unsigned int width = 0;
+	unsigned int height = 0;
+	std::vector<std::complex<double>> values;
+#ifdef PYPROFIT_HAS_FFTW
+	fftw_plan forward = nullptr;
+	fftw_plan backward = nullptr;
+	~otf_psf();
+#endif // PYPROFIT_HAS_FFTW
+
+	void padded_size(unsigned int image_width, unsigned int image_height, unsigned int &padded_width, unsigned int &padded_height) const {
+		if( image_width > width || image_height > height ) {
+			throw invalid_parameter("The OTF's padded grid must be at least as large as the image");
+		}
+		padded_width = width;
+		padded_height = height;
+	}
+
+	void convolve(std::vector<double> &image, unsigned int width, unsigned int height) const;
+
+	std::string key() const {
+		std::string key("otf");
+		key.append(reinterpret_cast<const char *>(&width), sizeof(width));
+		key.append(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(values[0]));
+		return key;
+	}
+};
+
+#ifdef PYPROFIT_HAS_FFTW
+
+/* FFTW's planner is not thread-safe, its execution functions are */
+static std::mutex fftw_planner_lock;
+
+otf_psf::~otf_psf() {
+	std::lock_guard<std::mutex> guard(fftw_planner_lock);
+	if( forward ) {
+		fftw_destroy_plan(forward);
+	}
+	if( backward ) {
+		fftw_destroy_plan(backward);
+	}
+}
+
+static bool _plan_otf(otf_psf &otf) {
+	std::size_t n = std::size_t(otf.width) * otf.height;
+	double *real = fftw_alloc_real(n);
+	fftw_complex *spectrum = fftw_alloc_complex(std::size_t(otf.width / 2 + 1) * otf.height);
+	{
+		std::lock_guard<std::mutex> guard(fftw_planner_lock);
+		otf.forward = fftw_plan_dft_r2c_2d(int(otf.height), int(otf.width), real, spectrum, FFTW_ESTIMATE);
+		otf.backward = fftw_plan_dft_c2r_2d(int(otf.height), int(otf.width), spectrum, real, FFTW_ESTIMATE);
+	}
+	fftw_free(spectrum);
+	fftw_free(real);
+	return otf.forward && otf.backward;
+}
+
+void otf_psf::convolve(std::vector<double> &image, unsigned int, unsigned int) const {
+
+	/* Plans are executed on new arrays, which fftw_alloc_* aligns like the planned ones */
+	std::size_t n = std::size_t(width) * height;
+	std::size_t n_spectrum = values.size();
+	double *real = fftw_alloc_real(n);
+	fftw_complex *spectrum = fftw_alloc_complex(n_spectrum);
+	std::copy(image.begin(), image.end(), real);
+	fftw_execute_dft_r2c(forward, real, spectrum);
+
+	/* Like libprofit, normalise the PSF to unit flux; FFTW doesn't normalise either */
+	double norm = 1 / (double(n) * values[0].real());
+	auto product = reinterpret_cast<std::complex<double> *>(spectrum);
+	for(std::size_t i = 0; i != n_spectrum; i++) {
+		product[i] *= values[i] * norm;
+	}
+	fftw_execute_dft_c2r(backward, spectrum, real);
+	std::copy(real, real + n, image.begin());
+	fftw_free(spectrum);
+	fftw_free(real);
+}
+
+/*
+ * The OTF of a @kernel_width x @kernel_height kernel on a @width x @height
+ * grid, or null if its FFTs can't be planned
+ */
+static std::shared_ptr<const otf_psf> _kernel_otf(const std::vector<double> &kernel, unsigned int kernel_width, unsigned int kernel_height,
+                                                  unsigned int width, unsigned int height) {
+
+	auto otf = std::make_shared<otf_psf>();
+	otf->width = width;
+	otf->height = height;
+	if( !_plan_otf(*otf) ) {
+		return nullptr;
+	}
+
+	/* The kernel's centre goes to (0, 0) */
+	std::size_t n_spectrum = std::size_t(width / 2 + 1) * height;
+	double *real = fftw_alloc_real(std::size_t(width) * height);
+	fftw_complex *spectrum = fftw_alloc_complex(n_spectrum);
+	std::fill(real, real + std::size_t(width) * height, 0.);
+	for(unsigned int j = 0; j != kernel_height; j++) {
+		for(unsigned int i = 0; i != kernel_width; i++) {
+			unsigned int x = (i + width - kernel_width / 2) % width;
+			unsigned int y = (j + height - kernel_height / 2) % height;
+			real[x + y * width] += kernel[i + j * kernel_width];
+		}
+	}
+	fftw_execute_dft_r2c(otf->forward, real, spectrum);
+	auto transformed = reinterpret_cast<std::complex<double> *>(spectrum);
+	otf->values.assign(transformed, transformed + n_spectrum);
+	fftw_free(spectrum);
+	fftw_free(real);
+	return otf;
+}
+
+#else
+
+void otf_psf::convolve(std::vector<double> &, unsigned int, unsigned int) const {
+	throw invalid_parameter("pyprofit was built without FFTW support, OTFs are not supported");
+}
+
+#endif // PYPROFIT_HAS_FFTW
+
+/*
+ * Reads a complex 2-D matrix, either from a C-contiguous buffer of complex
+ * numbers (like a numpy complex array) or from a sequence of rows.
+ */
+static bool _read_complex_matrix(PyObject *matrix, std::vector<std::complex<double>> &values, unsigned int *width_out, unsigned int *height_out) {
+
+	Py_buffer view;
+	if( PyObject_CheckBuffer(matrix) && PyObject_GetBuffer(matrix, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0 ) {
+		const char *format = view.format ? view.format : "B";
+		if( *format == '@' || *format == '=' ||
+		    (*format == '<' && PY_LITTLE_ENDIAN) || (*format == '>' && PY_BIG_ENDIAN) ) {
+			format++;
+		}
+		bool is_double = !strcmp(format, "Zd"), is_float = !strcmp(format, "Zf");
+		if( view.ndim != 2 || !(is_double || is_float) ) {
+			PyBuffer_Release(&view);
+			PyErr_SetString(profit_error, "OTF buffers must be 2-dimensional and of complex type");
+			return false;
+		}
+		*height_out = (unsigned int)view.shape[0];
+		*width_out = (unsigned int)view.shape[1];
+		values.resize(view.shape[0] * view.shape[1]);
+		if( is_double ) {
+			_copy_buffer<std::complex<double>>(view, values);
+		}
+		else {
+			_copy_buffer<std::complex<float>>(view, values);
+		}
+		PyBuffer_Release(&view);
+		return true;
+	}
+	PyErr_Clear();
+
+	Py_ssize_t height = PySequence_Size(matrix);
+	if( height == -1 ) {
+		return false;
+	}
+	Py_ssize_t width = 0;
+	for(Py_ssize_t j = 0; j != height; j++) {
+		PyObject *row = PySequence_GetItem(matrix, j);
+		if( row == NULL ) {
+			return false;
+		}
+		if( j == 0 ) {
+			width = PySequence_Size(row);
+			values.resize(width * height);
+		}
+		if( PySequence_Size(row) != width ) {
+			Py_DECREF(row);
+			PyErr_SetString(profit_error, "All matrix rows must have the same width");
+			return false;
+		}
+		for(Py_ssize_t i = 0; i != width; i++) {
+			PyObject *cell = PySequence_GetItem(row, i);
+			if( cell == NULL ) {
+				Py_DECREF(row);
+				return false;
+			}
+			Py_complex c = PyComplex_AsCComplex(cell);
+			Py_DECREF(cell);
+			values[i + j * width] = {c.real, c.imag};
+		}
+		Py_DECREF(row);
+	}
+	*height_out = (unsigned int)height;
+	*width_out = (unsigned int)width;
+	return !PyErr_Occurred();
+}
+
+/*
+ * Reads the OTF of a PSF for a padded grid @padded_width pixels wide (see
+ * otf_psf). On error a python exception is set and null is returned.
+ */
+static std::shared_ptr<const otf_psf> _read_otf(PyObject *matrix, unsigned int padded_width) {
+
+	auto otf = std::make_shared<otf_psf>();
+	unsigned int columns = 0, rows = 0;
+	if( !_read_complex_matrix(matrix, otf->values, &columns, &rows) ) {
+		return nullptr;
+	}
+	if( padded_width == 0 || rows == 0 || columns != padded_width / 2 + 1 ) {
+		PyErr_SetString(profit_error, "OTFs must have padded_width / 2 + 1 columns for a non-zero padded_width, and at least one row");
+		return nullptr;
+	}
+	if( otf->values[0].real() == 0 ) {
+		PyErr_SetString(profit_error, "The zero-frequency term of the OTF (the total flux of the PSF) must not be 0");
+		return nullptr;
+	}
+	otf->width = padded_width;
+	otf->height = rows;
+
+#ifdef PYPROFIT_HAS_FFTW
+	if( !_plan_otf(*otf) ) {
+		PyErr_SetString(profit_error, "Couldn't plan the FFTs for the OTF");
+		return nullptr;
+	}
+	return otf;
+#else
+	PyErr_SetString(profit_error, "pyprofit was built without FFTW support, OTFs are not supported");
+	return nullptr;
+#endif // PYPROFIT_HAS_FFTW
+}
+
 /*
  * Convolver object structure
  */
 typedef struct {
     PyObject_HEAD
     std::shared_ptr<Convolver> convolver;
+    /* Set instead of convolver for convolvers implemented by pyprofit */
+    std::shared_ptr<const native_convolver> native;
+    psf_trim_info psf_trim;
+    PyObject *args;
 } PyConvolver;
 
 
@@ -480,9 +1547,45 @@ typedef struct {
  */
 static void convolverptr_dealloc(PyConvolver *self) {
 	self->convolver.reset();
+	self->native.reset();
+	Py_XDECREF(self->args);
 	Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
+/*
+ * Pickling support: convolvers are recreated by calling make_convolver
+ * again with the same (positional) arguments, which include the PSF.
+ */
+static PyObject *convolver_reduce(PyConvolver *self, PyObject *args) {
+	if( !self->args ) {
+		PYPROFIT_RAISE("This convolver cannot be pickled");
+	}
+	PyObject *module = PyImport_ImportModule("pyprofit");
+	if( !module ) {
+		return NULL;
+	}
+	PyObject *make_convolver = PyObject_GetAttrString(module, "make_convolver");
+	Py_DECREF(module);
+	if( !make_convolver ) {
+		return NULL;
+	}
+	return Py_BuildValue("(NO)", make_convolver, self->args);
+}
+
+static PyObject *convolver_get_psf_trim(PyConvolver *self, void *closure) {
+	return _psf_trim_to_dict(self->psf_trim);
+}
+
+static PyGetSetDef PyConvolver_getset[] = {
+    {const_cast<char *>("psf_trim"), (getter)convolver_get_psf_trim, NULL, const_cast<char *>("How the PSF was trimmed, if requested"), NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+static PyMethodDef PyConvolver_methods[] = {
+    {"__reduce__", (PyCFunction)convolver_reduce, METH_NOARGS, "Helper for pickle."},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
 /*
  * PyConvolver object type
  */
@@ -497,6 +1600,10 @@ static PyTypeObject PyConvolver_Type = {
 	sizeof(PyConvolver),          /*tp_basicsize*/
 };
 
+static std::shared_ptr<const native_convolver> _make_hybrid_convolver(const std::vector<double> &psf, unsigned int psf_width, unsigned int psf_height,
+                                                                      unsigned int width, unsigned int height, double error_budget);
+template <typename Values>
+static PyObject *_values_to_tuple(const Values &values, unsigned int width, unsigned int height);
 
 static PyObject *pyprofit_make_convolver(PyObject *self, PyObject *args, PyObject *kwargs) {
 
@@ -511,12 +1618,15 @@ static PyObject *pyprofit_make_convolver(PyObject *self, PyObject *args, PyObjec
 #ifdef PROFIT_HAS_INSTRUCTION_SET_PREFERENCE
 	unsigned int instruction_set = int(simd_instruction_set::AUTO);
 #endif // PROFIT_HAS_INSTRUCTION_SET_PREFERENCE
+	unsigned int otf_width = 0;
+	double error_budget = 1e-3;
+	PyObject *psf_flux_fraction = Py_None;
 
 	const char * fmt = "IIO|zIOIO"
 #ifdef PROFIT_HAS_INSTRUCTION_SET_PREFERENCE
 	    "I"
 #endif // PROFIT_HAS_INSTRUCTION_SET_PREFERENCE
-	    ":make_convolver";
+	    "IdO:make_convolver";
 
 	const char *kwlist[] = {
 	    "width", "height", "psf", "convolver_type",
@@ -524,6 +1634,7 @@ static PyObject *pyprofit_make_convolver(PyObject *self, PyObject *args, PyObjec
 #ifdef PROFIT_HAS_INSTRUCTION_SET_PREFERENCE
 	    "instruction_set",
 #endif
+	    "otf_width", "error_budget", "psf_flux_fraction",
 	    NULL};
 
 	int res = PyArg_ParseTupleAndKeywords(args, kwargs, fmt, const_cast<char **>(kwlist),
@@ -533,18 +1644,70 @@ static PyObject *pyprofit_make_convolver(PyObject *self, PyObject *args, PyObjec
 #ifdef PROFIT_HAS_INSTRUCTION_SET_PREFERENCE
 	                                      , &instruction_set
 #endif // PROFIT_HAS_INSTRUCTION_SET_PREFERENCE
-	                                      );
+	                                      , &otf_width, &error_budget, &psf_flux_fraction);
 
 	if (!res) {
 		return NULL;
 	}
 
-	/* The width, height and profiles are mandatory */
-	_read_psf(psf_p, &psf_width, &psf_height);
-	if( PyErr_Occurred() ) {
+	/*
+	 * "otf" convolvers take the PSF's OTF for a padded grid otf_width pixels
+	 * wide instead of the PSF, and "hybrid" ones convolve the PSF's core and
+	 * wings separately within error_budget. Both are implemented by pyprofit
+	 * and used by make_model and make_models.
+	 */
+	bool is_otf = convolver_type && !strcmp(convolver_type, "otf");
+	bool is_hybrid = convolver_type && !strcmp(convolver_type, "hybrid");
+	std::shared_ptr<const native_convolver> native;
+	if( is_otf ) {
+		auto otf = _read_otf(psf_p, otf_width);
+		if( !otf ) {
+			return NULL;
+		}
+		if( width > otf->width || height > otf->height ) {
+			PYPROFIT_RAISE("The OTF's padded grid must be at least as large as the image");
+		}
+		native = otf;
+	}
+	if( is_hybrid && !(error_budget >= 0) ) {
+		PYPROFIT_RAISE("error_budget must be non-negative");
+	}
+
+	std::vector<double> psf;
+	if( !is_otf && !_read_double_matrix(psf_p, psf, &psf_width, &psf_height) ) {
+		return NULL;
+	}
+
+	/*
+	 * Pickles carry a copy of the PSF (or OTF) as it was read here, untrimmed,
+	 * rather than the caller's object, which might change or not be picklable
+	 */
+	PyObject *psf_snapshot;
+	if( is_otf ) {
+		auto otf = std::static_pointer_cast<const otf_psf>(native);
+		psf_snapshot = _values_to_tuple(otf->values, otf->width / 2 + 1, otf->height);
+	}
+	else {
+		psf_snapshot = _values_to_tuple(psf, psf_width, psf_height);
+	}
+	if( !psf_snapshot ) {
 		return NULL;
 	}
 
+	/* Convolution cost falls with the PSF's area, trim it if requested */
+	psf_trim_info psf_trim;
+	if( psf_flux_fraction != Py_None ) {
+		if( is_otf ) {
+			Py_DECREF(psf_snapshot);
+			PYPROFIT_RAISE("OTFs can't be trimmed");
+		}
+		double flux_fraction = PyFloat_AsDouble(psf_flux_fraction);
+		if( PyErr_Occurred() || !_trim_psf(psf, psf_width, psf_height, flux_fraction, psf_trim) ) {
+			Py_DECREF(psf_snapshot);
+			return NULL;
+		}
+	}
+
 	ConvolverCreationPreferences conv_prefs;
 	conv_prefs.src_dims = {width, height};
 	conv_prefs.krn_dims = {psf_width, psf_height};
@@ -555,8 +1718,12 @@ static PyObject *pyprofit_make_convolver(PyObject *self, PyObject *args, PyObjec
 
 	conv_prefs.reuse_krn_fft = static_cast<bool>(PyObject_IsTrue(reuse_psf_fft));
 	conv_prefs.effort = effort_t(fft_effort);
+	if( p_openclenv == Py_None ) {
+		p_openclenv = NULL;
+	}
 	if( p_openclenv != NULL ) {
 		if( !PyObject_TypeCheck(p_openclenv, &PyOpenCLEnv_Type) ) {
+			Py_DECREF(psf_snapshot);
 			PYPROFIT_RAISE("Given openclenv is not of type pyprofit.openclenv");
 		}
 		PyOpenCLEnv *openclenv = reinterpret_cast<PyOpenCLEnv *>(p_openclenv);
@@ -565,13 +1732,21 @@ static PyObject *pyprofit_make_convolver(PyObject *self, PyObject *args, PyObjec
 
 	PyObject *convolver_ptr = PyObject_CallObject((PyObject *)&PyConvolver_Type, NULL);
 	if (!convolver_ptr) {
+		Py_DECREF(psf_snapshot);
 		PYPROFIT_RAISE("Couldn't allocate memory for new convolver");
 	}
 
 	std::string error;
+	((PyConvolver *)convolver_ptr)->psf_trim = psf_trim;
 	Py_BEGIN_ALLOW_THREADS
 	try {
-		((PyConvolver *)convolver_ptr)->convolver = create_convolver(convolver_type, conv_prefs);
+		if( is_hybrid ) {
+			native = _make_hybrid_convolver(psf, psf_width, psf_height, width, height, error_budget);
+		}
+		else if( !is_otf ) {
+			((PyConvolver *)convolver_ptr)->convolver = create_convolver(convolver_type, conv_prefs);
+		}
+		((PyConvolver *)convolver_ptr)->native = native;
 	} catch (std::exception &e) {
 		// can't PyErr_SetString directly here because we don't have the GIL
 		error = e.what();
@@ -579,191 +1754,6288 @@ static PyObject *pyprofit_make_convolver(PyObject *self, PyObject *args, PyObjec
 	Py_END_ALLOW_THREADS
 
 	if (!error.empty()) {
+		Py_DECREF(psf_snapshot);
+		Py_DECREF(convolver_ptr);
 		PYPROFIT_RAISE(error.c_str());
 	}
 
+	/* Keep the full set of arguments, used when pickling */
+	((PyConvolver *)convolver_ptr)->args = Py_BuildValue("(IIOsIOIO"
+#ifdef PROFIT_HAS_INSTRUCTION_SET_PREFERENCE
+	    "I"
+#endif // PROFIT_HAS_INSTRUCTION_SET_PREFERENCE
+	    "IdO)", width, height, psf_snapshot, convolver_type, omp_threads,
+	    conv_prefs.reuse_krn_fft ? Py_True : Py_False, fft_effort,
+	    p_openclenv ? p_openclenv : Py_None
+#ifdef PROFIT_HAS_INSTRUCTION_SET_PREFERENCE
+	    , instruction_set
+#endif // PROFIT_HAS_INSTRUCTION_SET_PREFERENCE
+	    , otf_width, error_budget, psf_flux_fraction);
+	Py_DECREF(psf_snapshot);
+	if( !((PyConvolver *)convolver_ptr)->args ) {
+		Py_DECREF(convolver_ptr);
+		return NULL;
+	}
+
 	return convolver_ptr;
 }
 
-static PyObject *pyprofit_make_model(PyObject *self, PyObject *args) {
+/*
+ * Profile types registered by other extensions through pyprofit.h. They
+ * are evaluated natively, like tabulated profiles (see _add_native_profiles).
+ * The registry is only written while holding the GIL, but read during
+ * evaluations, which don't hold it.
+ */
+struct registered_profile_type {
+	pyprofit_profile_type type;
+	std::string name;
+	std::vector<std::string> parameters;
+	std::vector<double> defaults;
+};
+
+static std::mutex profile_types_lock;
+static std::map<std::string, std::shared_ptr<const registered_profile_type>> profile_types;
+
+static std::shared_ptr<const registered_profile_type> _registered_profile_type(const std::string &name) {
+	std::lock_guard<std::mutex> guard(profile_types_lock);
+	auto it = profile_types.find(name);
+	return it == profile_types.end() ? nullptr : it->second;
+}
+
+/* Whether profiles of this type are evaluated by pyprofit instead of libprofit */
+static bool _is_native_profile(const std::string &name) {
+	return name == "tabulated" || _registered_profile_type(name) != nullptr;
+}
 
-	unsigned int i, j, psf_width = 0, psf_height = 0;
-	unsigned int mask_w = 0, mask_h = 0;
-	double *psf;
-	bool *calcmask;
+static bool _has_native_profiles(const model_spec &spec) {
+	return std::any_of(spec.profiles.begin(), spec.profiles.end(), [](const profile_spec &p) {
+		return _is_native_profile(p.name);
+	});
+}
 
-	PyObject *model_dict;
-	if( !PyArg_ParseTuple(args, "O!", &PyDict_Type, &model_dict) ) {
+static void _item_to_registered_profile(profile_spec &profile, PyObject *item) {
+	auto type = _registered_profile_type(profile.name);
+	_item_to_radial_profile(profile, item);
+	for(auto &name: type->parameters) {
+		read_double(profile, item, name.c_str());
+	}
+}
+
+static void _read_registered_profiles(model_spec &spec, PyObject *profiles_dict) {
+	std::vector<std::string> names;
+	{
+		std::lock_guard<std::mutex> guard(profile_types_lock);
+		for(auto &type: profile_types) {
+			names.push_back(type.first);
+		}
+	}
+	for(auto &name: names) {
+		_read_profiles(spec, profiles_dict, name.c_str(), &_item_to_registered_profile);
+	}
+}
+
+static PyObject *pyprofit_register_profile(PyObject *self, PyObject *capsule) {
+
+	auto type = reinterpret_cast<pyprofit_profile_type *>(PyCapsule_GetPointer(capsule, PYPROFIT_PROFILE_TYPE_CAPSULE));
+	if( !type ) {
+		return NULL;
+	}
+	if( type->version != PYPROFIT_PROFILE_TYPE_VERSION ) {
+		PYPROFIT_RAISE("Unsupported profile type version");
+	}
+	if( !type->name || !type->evaluate || !type->flux || !type->extent ) {
+		PYPROFIT_RAISE("Profile types need a name, and evaluate, flux and extent functions");
+	}
+
+	auto registered = std::make_shared<registered_profile_type>();
+	registered->type = *type;
+	registered->name = type->name;
+	for(std::size_t i = 0; type->parameters && type->parameters[i]; i++) {
+		registered->parameters.push_back(type->parameters[i]);
+		registered->defaults.push_back(type->defaults ? type->defaults[i] : 0);
+	}
+
+	static const std::set<std::string> builtin {
+		"sersic", "moffat", "ferrer", "ferrers", "king", "coresersic", "brokenexp",
+		"sky", "null", "psf", "tabulated"
+	};
+	std::lock_guard<std::mutex> guard(profile_types_lock);
+	if( builtin.count(registered->name) || profile_types.count(registered->name) ) {
+		PyErr_Format(profit_error, "Profile type %s already exists", registered->name.c_str());
 		return NULL;
 	}
+	profile_types[registered->name] = std::move(registered);
+	Py_RETURN_NONE;
+}
+
+/* Whether profiles of this type use libprofit's adaptive subsampling */
+static bool _has_subsampling(const std::string &name) {
+	return name == "sersic" || name == "moffat" || name == "ferrer" || name == "ferrers" ||
+	       name == "coresersic" || name == "brokenexp" || name == "king";
+}
+
+/* Whether profiles of this type are placed through xcen and ycen */
+static bool _has_centre(const std::string &name) {
+	return name != "sky" && name != "null";
+}
+
+static void _choose_subsampling(model_spec &spec);
+
+/*
+ * Reads a model dictionary into a model_spec.
+ * On error a python exception is set and false is returned.
+ */
+static bool _read_model_spec(PyObject *model_dict, model_spec &spec) {
+
+	if( !PyDict_Check(model_dict) ) {
+		PyErr_SetString(PyExc_TypeError, "model must be a dictionary");
+		return false;
+	}
 
 	/* The width, height and profiles are mandatory */
 	PyObject *tmp = PyDict_GetItemString(model_dict, "width");
 	if( tmp == NULL ) {
-		PYPROFIT_RAISE("Missing mandatory 'width' item");
+		PyErr_SetString(profit_error, "Missing mandatory 'width' item");
+		return false;
 	}
 	long width = PyInt_AsLong(tmp);
 	if( PyErr_Occurred() ) {
-		return NULL;
+		return false;
 	}
 	tmp = PyDict_GetItemString(model_dict, "height");
 	if( tmp == NULL ) {
-		PYPROFIT_RAISE("Missing mandatory 'height' item");
+		PyErr_SetString(profit_error, "Missing mandatory 'height' item");
+		return false;
 	}
 	long height = PyInt_AsLong(tmp);
 	if( PyErr_Occurred() ) {
-		return NULL;
+		return false;
 	}
 	PyObject *profiles_dict = PyDict_GetItemString(model_dict, "profiles");
 	if( profiles_dict == NULL ) {
-		PYPROFIT_RAISE("Missing mandatory 'profiles' item");
+		PyErr_SetString(profit_error, "Missing mandatory 'profiles' item");
+		return false;
 	}
+	spec.width = static_cast<unsigned int>(width);
+	spec.height = static_cast<unsigned int>(height);
 
-	/* Read the psf if present */
-	psf = _read_psf_from_model(model_dict, &psf_width, &psf_height);
-	if( PyErr_Occurred() ) {
-		return NULL;
+	/* Read the psf and calcmask if present */
+	PyObject *psf = PyDict_GetItemString(model_dict, "psf");
+	if( psf && !_read_double_matrix(psf, spec.psf, &spec.psf_width, &spec.psf_height) ) {
+		return false;
 	}
-	calcmask = _read_boolean_matrix(PyDict_GetItemString(model_dict, "calcmask"), &mask_w, &mask_h);
-	if( PyErr_Occurred() ) {
-		return NULL;
+	tmp = PyDict_GetItemString(model_dict, "psf_flux_fraction");
+	if( psf && tmp != NULL && tmp != Py_None ) {
+		double flux_fraction = PyFloat_AsDouble(tmp);
+		if( PyErr_Occurred() || !_trim_psf(spec.psf, spec.psf_width, spec.psf_height, flux_fraction, spec.psf_trim) ) {
+			return false;
+		}
 	}
-	if( calcmask && (mask_w != width || mask_h != height) ) {
-		PYPROFIT_RAISE("calcmask must have same dimensions of image");
+	unsigned int mask_w = 0, mask_h = 0;
+	if( !_read_boolean_matrix(PyDict_GetItemString(model_dict, "calcmask"), spec.calcmask, &mask_w, &mask_h) ) {
+		return false;
 	}
-
-	/* Create and initialize the model */
-	Model m;
-	m.set_dimensions({static_cast<unsigned int>(width), static_cast<unsigned int>(height)});
-	double scale_x = 1, scale_y = 1;
-	READ_DOUBLE(model_dict, "scale_x", scale_x);
-	READ_DOUBLE(model_dict, "scale_y", scale_y);
-	m.set_image_pixel_scale({scale_x, scale_y});
-	if( psf ) {
-		auto psf_im = Image(std::vector<double>(psf, psf + (psf_width * psf_height)), psf_width, psf_height);
-		m.set_psf(std::move(psf_im));
-		double psf_scale_x = 1, psf_scale_y = 1;
-		READ_DOUBLE(model_dict, "psf_scale_x", psf_scale_x);
-		READ_DOUBLE(model_dict, "psf_scale_y", psf_scale_y);
-		m.set_psf_pixel_scale({psf_scale_x, psf_scale_y});
-		delete [] psf;
-	}
-	if( calcmask ) {
-		auto mask = Mask(std::vector<bool>(calcmask, calcmask + (width * height)), width, height);
-		m.set_mask(std::move(mask));
-		delete [] calcmask;
+	if( !spec.calcmask.empty() && (mask_w != width || mask_h != height) ) {
+		PyErr_SetString(profit_error, "calcmask must have same dimensions of image");
+		return false;
 	}
-	double magzero = 0;
-	READ_DOUBLE(model_dict, "magzero", magzero);
-	m.set_magzero(magzero);
 
-	/* Assign the OpenCL environment to the model */
+	READ_DOUBLE(model_dict, "scale_x", spec.scale_x);
+	READ_DOUBLE(model_dict, "scale_y", spec.scale_y);
+	READ_DOUBLE(model_dict, "psf_scale_x", spec.psf_scale_x);
+	READ_DOUBLE(model_dict, "psf_scale_y", spec.psf_scale_y);
+	READ_DOUBLE(model_dict, "magzero", spec.magzero);
+
+	/* The OpenCL environment */
 	PyObject *p_openclenv = PyDict_GetItemString(model_dict, "openclenv");
 	if( p_openclenv != NULL and p_openclenv != Py_None ) {
 		if( !PyObject_TypeCheck(p_openclenv, &PyOpenCLEnv_Type) ) {
-			PYPROFIT_RAISE("Given openclenv is not of type pyprofit.openclenv");
+			PyErr_SetString(profit_error, "Given openclenv is not of type pyprofit.openclenv");
+			return false;
 		}
-		PyOpenCLEnv *openclenv = reinterpret_cast<PyOpenCLEnv *>(p_openclenv);
-		m.set_opencl_env(openclenv->env);
+		spec.opencl_env = reinterpret_cast<PyOpenCLEnv *>(p_openclenv)->env;
 	}
 
-	/* Assign requested number of OpenMP threads */
+	/* Requested number of OpenMP threads */
 	PyObject *p_omp_threads = PyDict_GetItemString(model_dict, "omp_threads");
 	if( p_omp_threads != NULL ) {
-		m.set_omp_threads((unsigned int)PyInt_AsUnsignedLongMask(p_omp_threads));
+		spec.omp_threads = (unsigned int)PyInt_AsUnsignedLongMask(p_omp_threads);
 	}
 
 	PyObject *convolver = PyDict_GetItemString(model_dict, "convolver");
-	if (convolver) {
-		m.set_convolver(((PyConvolver *)convolver)->convolver);
+	if( convolver != NULL && convolver != Py_None ) {
+		if( !PyObject_TypeCheck(convolver, &PyConvolver_Type) ) {
+			PyErr_SetString(profit_error, "Given convolver is not of type pyprofit.convolver");
+			return false;
+		}
+		spec.convolver = ((PyConvolver *)convolver)->convolver;
+		spec.native_conv = ((PyConvolver *)convolver)->native;
+	}
+
+	/* The PSF can also be given as its OTF, for a padded grid psf_otf_width pixels wide */
+	PyObject *psf_otf = PyDict_GetItemString(model_dict, "psf_otf");
+	if( psf_otf != NULL && psf_otf != Py_None ) {
+		tmp = PyDict_GetItemString(model_dict, "psf_otf_width");
+		if( tmp == NULL ) {
+			PyErr_SetString(profit_error, "psf_otf needs a psf_otf_width item");
+			return false;
+		}
+		unsigned int otf_width = (unsigned int)PyInt_AsUnsignedLongMask(tmp);
+		if( PyErr_Occurred() ) {
+			return false;
+		}
+		spec.native_conv = _read_otf(psf_otf, otf_width);
+		if( !spec.native_conv ) {
+			return false;
+		}
+	}
+	if( spec.native_conv && !spec.psf.empty() ) {
+		PyErr_SetString(profit_error, "psf can't be given together with an OTF or hybrid convolver");
+		return false;
 	}
 
 	/* Read finesampling information */
 	tmp = PyDict_GetItemString(model_dict, "finesampling");
 	if (tmp != NULL) {
-		m.set_finesampling(PyInt_AsLong(tmp));
-#ifdef PROFIT_HAS_RETURN_FINESAMPLED
+		spec.finesampling = (unsigned int)PyInt_AsLong(tmp);
 		tmp = PyDict_GetItemString(model_dict, "return_finesampled");
 		if (tmp != NULL) {
-			m.set_return_finesampled(PyObject_IsTrue(tmp));
+			spec.return_finesampled = PyObject_IsTrue(tmp);
 		}
-#endif
+	}
+
+	tmp = PyDict_GetItemString(model_dict, "instancing");
+	if( tmp != NULL ) {
+		spec.instancing = PyObject_IsTrue(tmp);
 	}
 
 	/* Read the profiles */
-	_read_sersic_profiles(m, profiles_dict);
-	_read_moffat_profiles(m, profiles_dict);
-	_read_ferrer_profiles(m, profiles_dict);
-	_read_king_profiles(m, profiles_dict);
-	_read_coresersic_profiles(m, profiles_dict);
-	_read_brokenexp_profiles(m, profiles_dict);
-	_read_sky_profiles(m, profiles_dict);
-	_read_null_profiles(m, profiles_dict);
-	_read_psf_profiles(m, profiles_dict);
+	_read_sersic_profiles(spec, profiles_dict);
+	_read_moffat_profiles(spec, profiles_dict);
+	_read_ferrer_profiles(spec, profiles_dict);
+	_read_king_profiles(spec, profiles_dict);
+	_read_coresersic_profiles(spec, profiles_dict);
+	_read_brokenexp_profiles(spec, profiles_dict);
+	_read_sky_profiles(spec, profiles_dict);
+	_read_null_profiles(spec, profiles_dict);
+	_read_psf_profiles(spec, profiles_dict);
+	_read_tabulated_profiles(spec, profiles_dict);
+	_read_registered_profiles(spec, profiles_dict);
+	if( PyErr_Occurred() ) {
+		return false;
+	}
 
-	/*
-	 * Go, Go, Go!
-	 * This might take a few [ms], so we release the GIL
-	 */
-	Image image;
-	Point offset;
+	/* A model-wide accuracy applies to profiles without their own */
+	double accuracy = std::numeric_limits<double>::quiet_NaN();
+	READ_DOUBLE(model_dict, "accuracy", accuracy);
+	for(auto &profile: spec.profiles) {
+		if( std::isnan(profile.accuracy) && _has_subsampling(profile.name) ) {
+			profile.accuracy = accuracy;
+		}
+	}
+	for(auto &profile: spec.profiles) {
+		if( !std::isnan(profile.accuracy) && !(profile.accuracy > 0) ) {
+			PyErr_SetString(profit_error, "accuracy must be positive");
+			return false;
+		}
+	}
+
+	/* Calibration renders models, which doesn't need the GIL */
 	std::string error;
 	Py_BEGIN_ALLOW_THREADS
 	try {
-		image = m.evaluate(offset);
+		_choose_subsampling(spec);
 	} catch (std::exception &e) {
-		// can't PyErr_SetString directly here because we don't have the GIL
 		error = e.what();
 	}
 	Py_END_ALLOW_THREADS
-
 	if( !error.empty() ) {
 		PyErr_SetString(profit_error, error.c_str());
-		return NULL;
+		return false;
 	}
 
-	/*
-	 * We return a 2-element tuple.
-	 * Element 0 is a 2-D tuple with the image values
-	 * Element 1 is a 2-element tuple with the offset
-	 */
-	auto im_dims = image.getDimensions();
-	PyObject *image_tuple = PyTuple_New(im_dims.y);
-	PyObject *offset_tuple = PyTuple_New(2);
-	PyObject *return_tuple = PyTuple_New(2);
-	if (image_tuple == NULL || offset_tuple == NULL || return_tuple == NULL) {
-		PYPROFIT_RAISE("Couldn't create return tuples");
-	}
+	return true;
+}
 
-	/* Copy resulting image into a 2-D tuple */
-	for(i=0; i!=im_dims.y; i++) {
-		PyObject *row_tuple = PyTuple_New(im_dims.x);
+/*
+ * Binary writer for model specifications.
+ *
+ * All values are written in native byte order, which is all we need for
+ * in-process keys, pickles and clients of the evaluation server, which
+ * always run on the same host. A specification is written as:
+ *
+ *   uint32 width, uint32 height, double scale_x, double scale_y,
+ *   uint32 psf_width, uint32 psf_height, double psf[psf_width * psf_height],
+ *   double psf_scale_x, double psf_scale_y,
+ *   uint32 calcmask_size, char calcmask[calcmask_size],
+ *   double magzero, uint32 omp_threads, uint32 finesampling,
+ *   char return_finesampled, char instancing, uint32 n_profiles,
+ *   and for each profile:
+ *     string name, uint32 n_parameters,
+ *     and for each parameter: string name, char kind, double value,
+ *     then uint32 n_table, double radii[n_table], double values[n_table]
+ *
+ * where strings are a uint32 length followed by the string bytes, and kind
+ * is 0 for double, 1 for bool and 2 for unsigned int parameters.
+ */
+class spec_writer {
+public:
+	template <typename T>
+	void put(const T &val) {
+		buffer.append(reinterpret_cast<const char *>(&val), sizeof(T));
+	}
+
+	void put_string(const std::string &s) {
+		put((unsigned int)s.size());
+		buffer.append(s);
+	}
+
+	std::string buffer;
+};
+
+static void _write_model_spec(spec_writer &w, const model_spec &spec) {
+	w.put(spec.width);
+	w.put(spec.height);
+	w.put(spec.scale_x);
+	w.put(spec.scale_y);
+	w.put(spec.psf_width);
+	w.put(spec.psf_height);
+	for(auto v: spec.psf) {
+		w.put(v);
+	}
+	w.put(spec.psf_scale_x);
+	w.put(spec.psf_scale_y);
+	w.put((unsigned int)spec.calcmask.size());
+	for(bool v: spec.calcmask) {
+		w.put((char)v);
+	}
+	w.put(spec.magzero);
+	w.put(spec.omp_threads);
+	w.put(spec.finesampling);
+	w.put((char)spec.return_finesampled);
+	w.put((char)spec.instancing);
+	w.put((unsigned int)spec.profiles.size());
+	for(auto &profile: spec.profiles) {
+		w.put_string(profile.name);
+		w.put((unsigned int)profile.parameters.size());
+		for(auto &param: profile.parameters) {
+			w.put_string(param.name);
+			w.put((char)param.kind);
+			w.put(param.value);
+		}
+		w.put((unsigned int)profile.radii.size());
+		for(auto table: {&profile.radii, &profile.values}) {
+			for(auto v: *table) {
+				w.put(v);
+			}
+		}
+	}
+}
+
+/*
+ * Binary reader for model specifications written by spec_writer
+ */
+class spec_reader {
+public:
+	spec_reader(const char *data, std::size_t size) :
+		pos(data), end(data + size) {}
+
+	template <typename T>
+	T get() {
+		check(sizeof(T));
+		T val;
+		std::memcpy(&val, pos, sizeof(T));
+		pos += sizeof(T);
+		return val;
+	}
+
+	std::string get_string() {
+		auto size = get<unsigned int>();
+		check(size);
+		std::string s(pos, size);
+		pos += size;
+		return s;
+	}
+
+	/*
+	 * Reads a count of elements taking at least @element_size bytes each,
+	 * checking they can be there before anything is allocated for them
+	 */
+	std::size_t get_count(std::size_t element_size) {
+		std::size_t count = get<unsigned int>();
+		check_count(count, element_size);
+		return count;
+	}
+
+	void check_count(std::size_t count, std::size_t element_size) {
+		if( count > std::size_t(end - pos) / element_size ) {
+			throw std::invalid_argument("Truncated model specification");
+		}
+	}
+
+	bool at_end() const {
+		return pos == end;
+	}
+
+private:
+	const char *pos;
+	const char *end;
+
+	void check(std::size_t size) {
+		if( std::size_t(end - pos) < size ) {
+			throw std::invalid_argument("Truncated model specification");
+		}
+	}
+};
+
+static void _read_model_spec(spec_reader &r, model_spec &spec) {
+	spec.width = r.get<unsigned int>();
+	spec.height = r.get<unsigned int>();
+	spec.scale_x = r.get<double>();
+	spec.scale_y = r.get<double>();
+	spec.psf_width = r.get<unsigned int>();
+	spec.psf_height = r.get<unsigned int>();
+	r.check_count(std::size_t(spec.psf_width) * spec.psf_height, sizeof(double));
+	spec.psf.resize(std::size_t(spec.psf_width) * spec.psf_height);
+	for(auto &v: spec.psf) {
+		v = r.get<double>();
+	}
+	spec.psf_scale_x = r.get<double>();
+	spec.psf_scale_y = r.get<double>();
+	spec.calcmask.resize(r.get_count(sizeof(char)));
+	for(std::size_t i = 0; i != spec.calcmask.size(); i++) {
+		spec.calcmask[i] = r.get<char>() != 0;
+	}
+	spec.magzero = r.get<double>();
+	spec.omp_threads = r.get<unsigned int>();
+	spec.finesampling = r.get<unsigned int>();
+	spec.return_finesampled = r.get<char>() != 0;
+	spec.instancing = r.get<char>() != 0;
+	/* Profiles take at least a name, n_parameters and n_table; parameters a name, kind and value */
+	spec.profiles.resize(r.get_count(3 * sizeof(unsigned int)));
+	for(auto &profile: spec.profiles) {
+		profile.name = r.get_string();
+		profile.parameters.resize(r.get_count(sizeof(unsigned int) + sizeof(char) + sizeof(double)));
+		for(auto &param: profile.parameters) {
+			param.name = r.get_string();
+			char kind = r.get<char>();
+			if( kind != profile_parameter::DOUBLE && kind != profile_parameter::BOOL && kind != profile_parameter::UINT ) {
+				throw std::invalid_argument("Invalid parameter kind in model specification");
+			}
+			param.kind = profile_parameter::kind_t(kind);
+			param.value = r.get<double>();
+		}
+		auto n_table = r.get_count(2 * sizeof(double));
+		for(auto table: {&profile.radii, &profile.values}) {
+			table->resize(n_table);
+			for(auto &v: *table) {
+				v = r.get<double>();
+			}
+		}
+	}
+}
+
+/*
+ * A key uniquely identifying the model described by a specification,
+ * including the identity of the (shared) libprofit convolver and OpenCL
+ * environment. Convolvers implemented by pyprofit are keyed on their
+ * contents instead, as each model dictionary giving psf_otf gets its own.
+ */
+static std::string _model_spec_key(const model_spec &spec) {
+	spec_writer w;
+	_write_model_spec(w, spec);
+	w.put((const void *)spec.convolver.get());
+	w.put((const void *)spec.opencl_env.get());
+	if( spec.native_conv ) {
+		w.put_string(spec.native_conv->key());
+	}
+	return std::move(w.buffer);
+}
+
+/*
+ * Sets a parameter on a profile. Sky backgrounds are values per pixel, and
+ * are multiplied by @bg_scale for models with pixels larger than the ones
+ * they were given for.
+ */
+static void _apply_parameter(Profile &p, const profile_parameter &param, double bg_scale = 1) {
+	switch(param.kind) {
+	case profile_parameter::BOOL:
+		p.parameter(param.name, param.value != 0);
+		break;
+	case profile_parameter::UINT:
+		p.parameter(param.name, static_cast<unsigned int>(param.value));
+		break;
+	default:
+		p.parameter(param.name, param.name == "bg" ? param.value * bg_scale : param.value);
+	}
+}
+
+/* The kind of a parameter not present in a profile_spec yet */
+static profile_parameter::kind_t _parameter_kind(const std::string &name) {
+	if( name == "convolve" || name == "rough" || name == "adjust" || name == "rescale_flux" ) {
+		return profile_parameter::BOOL;
+	}
+	if( name == "resolution" || name == "max_recursions" ) {
+		return profile_parameter::UINT;
+	}
+	return profile_parameter::DOUBLE;
+}
+
+/*
+ * Turns a model specification into a profit::Model ready to be evaluated.
+ * Profiles that libprofit rejects are skipped, and the reason recorded in
+ * @warnings. Native profiles are skipped too, they are added separately
+ * (see _add_native_profiles). If given, @profiles receives the profit::Profile created for
+ * each profile in the specification (or null, if skipped). This doesn't
+ * touch any python object, and can therefore be called without holding
+ * the GIL.
+ */
+static void _build_model(const model_spec &spec, Model &m, std::vector<std::string> &warnings, std::vector<ProfilePtr> *profiles = nullptr) {
+
+	m.set_dimensions({spec.width, spec.height});
+	m.set_image_pixel_scale({spec.scale_x, spec.scale_y});
+	if( !spec.psf.empty() ) {
+		m.set_psf(Image(std::vector<double>(spec.psf), spec.psf_width, spec.psf_height));
+		m.set_psf_pixel_scale({spec.psf_scale_x, spec.psf_scale_y});
+	}
+	if( !spec.calcmask.empty() ) {
+		m.set_mask(Mask(std::vector<bool>(spec.calcmask), spec.width, spec.height));
+	}
+	m.set_magzero(spec.magzero);
+	if( spec.opencl_env ) {
+		m.set_opencl_env(spec.opencl_env);
+	}
+	m.set_omp_threads(spec.omp_threads);
+	if( spec.convolver ) {
+		m.set_convolver(spec.convolver);
+	}
+	m.set_finesampling(spec.finesampling);
+#ifdef PROFIT_HAS_RETURN_FINESAMPLED
+	m.set_return_finesampled(spec.return_finesampled);
+#endif
+
+	for(auto &profile: spec.profiles) {
+		ProfilePtr p;
+		if( _is_native_profile(profile.name) ) {
+			if( profiles ) {
+				profiles->push_back(p);
+			}
+			continue;
+		}
+		try {
+			p = m.add_profile(profile.name);
+			for(auto &param: profile.parameters) {
+				_apply_parameter(*p, param, spec.bg_scale);
+			}
+		} catch(invalid_parameter &e) {
+			std::ostringstream os;
+			os << "warning: failed to create profile " << profile.name << ": " << e.what();
+			warnings.push_back(os.str());
+			p.reset();
+		}
+		if( profiles ) {
+			profiles->push_back(p);
+		}
+	}
+}
+
+static void _print_warnings(const std::vector<std::string> &warnings) {
+	for(auto &warning: warnings) {
+		PySys_WriteStderr("%s\n", warning.c_str());
+	}
+}
+
+/*
+ * Accuracy-targeted subsampling
+ *
+ * Profiles given an accuracy (a target relative error of their image) get
+ * the cheapest of a ladder of subsampling settings meeting it. Settings
+ * are calibrated by rendering the profile alone on a stamp with each
+ * setting and comparing it against a reference rendering, using the sum of
+ * absolute differences relative to the reference's sum of absolute values.
+ * Stamps are rendered without the model's PSF, so the chosen setting meets
+ * the accuracy before convolution, which with a normalised, non-negative
+ * PSF can't increase this relative error.
+ * Results are cached per profile type and parameter regime (size in pixels
+ * in half-octaves, nser, axrat and box in coarse steps, and any explicit
+ * settings), so calibration runs only once per regime. Settings given
+ * explicitly in a profile are always kept, and are used during calibration.
+ */
+struct subsampling_setting {
+	bool rough;
+	unsigned int resolution;
+	unsigned int max_recursions;
+	double acc;
+	double rscale_switch;
+};
+
+static const subsampling_setting subsampling_ladder[] = {
+	{true,  0,  0, 0,     0},
+	{false, 3,  1, 0.2,   0.5},
+	{false, 5,  2, 0.1,   1},
+	{false, 9,  2, 0.1,   1},
+	{false, 9,  4, 0.01,  2},
+	{false, 15, 6, 0.001, 3},
+};
+static const subsampling_setting subsampling_reference = {false, 21, 8, 1e-4, 4};
+
+static std::mutex subsampling_cache_lock;
+static std::map<std::string, std::pair<std::size_t, double>> subsampling_cache;
+
+static std::vector<profile_parameter> _subsampling_parameters(const subsampling_setting &setting) {
+	if( setting.rough ) {
+		return {{"rough", profile_parameter::BOOL, 1}};
+	}
+	return {
+		{"rough", profile_parameter::BOOL, 0},
+		{"resolution", profile_parameter::UINT, double(setting.resolution)},
+		{"max_recursions", profile_parameter::UINT, double(setting.max_recursions)},
+		{"acc", profile_parameter::DOUBLE, setting.acc},
+		{"rscale_switch", profile_parameter::DOUBLE, setting.rscale_switch}
+	};
+}
+
+/* Adds the parameters of @setting not already present in @profile */
+static void _add_subsampling_parameters(profile_spec &profile, const subsampling_setting &setting, std::vector<profile_parameter> *added = nullptr) {
+	for(auto &param: _subsampling_parameters(setting)) {
+		auto &params = profile.parameters;
+		if( std::none_of(params.begin(), params.end(), [&param](const profile_parameter &p) { return p.name == param.name; }) ) {
+			params.push_back(param);
+			if( added ) {
+				added->push_back(param);
+			}
+		}
+	}
+}
+
+static double _profile_parameter(const profile_spec &profile, const char *name, double default_value) {
+	for(auto &param: profile.parameters) {
+		if( param.name == name ) {
+			return param.value;
+		}
+	}
+	return default_value;
+}
+
+/* Size of a profile in pixels, from its characteristic radii */
+static double _profile_size(const profile_spec &profile, double scale) {
+	double size = 0;
+	for(auto name: {"re", "rb", "fwhm", "rout", "rc", "rt", "h1", "h2"}) {
+		size = std::max(size, _profile_parameter(profile, name, 0));
+	}
+	return size / scale;
+}
+
+static std::string _subsampling_regime(const profile_spec &profile, double scale) {
+	std::ostringstream os;
+	double size = _profile_size(profile, scale);
+	os << profile.name
+	   << '|' << (size > 0 ? std::lround(2 * std::log2(size)) : 0)
+	   << '|' << std::lround(4 * _profile_parameter(profile, "nser", 1))
+	   << '|' << std::lround(10 * _profile_parameter(profile, "axrat", 1))
+	   << '|' << std::lround(10 * _profile_parameter(profile, "box", 0))
+	   << '|' << profile.accuracy;
+	for(auto name: {"rough", "resolution", "max_recursions", "acc", "rscale_switch"}) {
+		os << '|' << _profile_parameter(profile, name, std::numeric_limits<double>::quiet_NaN());
+	}
+	return os.str();
+}
+
+/* Renders @profile alone and centred on a stamp, with @setting */
+static Image _subsampling_stamp(const model_spec &spec, const profile_spec &profile, const subsampling_setting &setting) {
+
+	double size = _profile_size(profile, spec.scale_x);
+	unsigned int stamp_size = (unsigned int)std::min(std::max(std::ceil(6 * size), 16.), 96.);
+
+	model_spec stamp;
+	stamp.width = stamp.height = stamp_size;
+	stamp.scale_x = spec.scale_x;
+	stamp.scale_y = spec.scale_y;
+	stamp.magzero = spec.magzero;
+	profile_spec p;
+	p.name = profile.name;
+	for(auto &param: profile.parameters) {
+		if( param.name != "xcen" && param.name != "ycen" && param.name != "convolve" ) {
+			p.parameters.push_back(param);
+		}
+	}
+	p.parameters.push_back({"xcen", profile_parameter::DOUBLE, (stamp_size / 2 + 0.3) * spec.scale_x});
+	p.parameters.push_back({"ycen", profile_parameter::DOUBLE, (stamp_size / 2 + 0.2) * spec.scale_y});
+	_add_subsampling_parameters(p, setting);
+	stamp.profiles.push_back(std::move(p));
+
+	Model m;
+	std::vector<std::string> warnings;
+	_build_model(stamp, m, warnings);
+	Point offset;
+	return m.evaluate(offset);
+}
+
+static std::pair<std::size_t, double> _calibrate_subsampling(const model_spec &spec, const profile_spec &profile) {
+
+	const std::size_t n_settings = sizeof(subsampling_ladder) / sizeof(subsampling_setting);
+	Image reference = _subsampling_stamp(spec, profile, subsampling_reference);
+	double norm = 0;
+	for(std::size_t j = 0; j != reference.size(); j++) {
+		norm += std::abs(reference[j]);
+	}
+
+	/* Explicit subsampling settings rule out rough evaluation */
+	std::size_t first = 0;
+	for(auto name: {"resolution", "max_recursions", "acc", "rscale_switch"}) {
+		if( !std::isnan(_profile_parameter(profile, name, std::numeric_limits<double>::quiet_NaN())) ) {
+			first = 1;
+		}
+	}
+
+	double error = std::numeric_limits<double>::infinity();
+	for(std::size_t i = first; i != n_settings; i++) {
+		Image image = _subsampling_stamp(spec, profile, subsampling_ladder[i]);
+		double diff = 0;
+		for(std::size_t j = 0; j != image.size(); j++) {
+			diff += std::abs(image[j] - reference[j]);
+		}
+		error = norm > 0 ? diff / norm : 0;
+		if( error <= profile.accuracy ) {
+			return {i, error};
+		}
+	}
+	return {n_settings - 1, error};
+}
+
+static void _choose_subsampling(model_spec &spec) {
+
+	spec.subsampling.clear();
+	for(std::size_t i = 0; i != spec.profiles.size(); i++) {
+
+		auto &profile = spec.profiles[i];
+		if( std::isnan(profile.accuracy) || !_has_subsampling(profile.name) ) {
+			continue;
+		}
+
+		auto regime = _subsampling_regime(profile, spec.scale_x);
+		std::pair<std::size_t, double> choice;
+		bool cached;
+		{
+			std::lock_guard<std::mutex> guard(subsampling_cache_lock);
+			auto it = subsampling_cache.find(regime);
+			cached = it != subsampling_cache.end();
+			if( cached ) {
+				choice = it->second;
+			}
+		}
+		if( !cached ) {
+			try {
+				choice = _calibrate_subsampling(spec, profile);
+			} catch (std::exception &e) {
+				/* Invalid profiles are reported when the model is built */
+				continue;
+			}
+			std::lock_guard<std::mutex> guard(subsampling_cache_lock);
+			subsampling_cache[regime] = choice;
+		}
+
+		subsampling_choice report {i, profile.accuracy, choice.second, {}};
+		_add_subsampling_parameters(profile, subsampling_ladder[choice.first], &report.settings);
+		spec.subsampling.push_back(std::move(report));
+	}
+}
+
+/*
+ * Instanced rendering
+ *
+ * Catalogues of synthetic stars or injected galaxies often repeat exactly
+ * the same shape (all parameters but xcen, ycen and mag) at many positions.
+ * Models asking for it (instancing=True) take groups of such profiles out
+ * of the libprofit model: their shape is rendered once per sub-pixel phase
+ * on a stamp (PSF convolution included), and each instance is added with
+ * its own flux, interpolating bilinearly between the four phases around
+ * its sub-pixel position.
+ *
+ * Interpolating isn't exact, so the grid of phases is refined (see
+ * instancing_phases) until an instance halfway between phases, where the
+ * error is largest, is reproduced within instancing_accuracy (as a sum of
+ * absolute differences relative to that of the instance). Groups too small
+ * to pay for (at least two instances per phase) or store the grid meeting
+ * it are left to libprofit, with a warning.
+ */
+static const unsigned int instancing_phases[] = {4, 8, 16};
+static const double instancing_accuracy = 1e-3;
+static const std::size_t instancing_min_count = 2 * 4 * 4;
+static const std::size_t instancing_max_pixels = std::size_t(1) << 25;
+
+/*
+ * Identifies the shape of a profile; empty for profiles that can't be
+ * instanced. psf profiles have no shape parameters, their image is the
+ * model's PSF, which is already a sampled image and can't be interpolated
+ * between phases.
+ */
+static std::string _instance_key(const profile_spec &profile) {
+	if( profile.name == "sky" || profile.name == "null" || profile.name == "psf" || _is_native_profile(profile.name) ) {
+		return std::string();
+	}
+	std::ostringstream os;
+	os.precision(17);
+	os << profile.name;
+	for(auto &param: profile.parameters) {
+		if( param.name != "xcen" && param.name != "ycen" && param.name != "mag" ) {
+			os << '|' << param.name << '=' << param.value;
+		}
+	}
+	return os.str();
+}
+
+/* A group of profiles (indices into spec.profiles) rendered through instancing */
+struct instance_group {
+	std::vector<std::size_t> instances;
+	/* Stamps are (2 * half) pixels square, with phases x phases of them */
+	unsigned int half;
+	unsigned int phases;
+	std::vector<Image> stamps;
+};
+
+/*
+ * Renders @shape at unit flux centred at (half + fx, half + fy) pixels on a
+ * (2 * half) square stamp. Returns false if libprofit rejects the shape,
+ * which is then reported when libprofit renders the group instead.
+ */
+static bool _instance_stamp(const model_spec &spec, const profile_spec &shape, unsigned int half, double fx, double fy, Image &image) {
+
+	model_spec stamp;
+	stamp.width = stamp.height = 2 * half;
+	stamp.scale_x = spec.scale_x;
+	stamp.scale_y = spec.scale_y;
+	stamp.psf = spec.psf;
+	stamp.psf_width = spec.psf_width;
+	stamp.psf_height = spec.psf_height;
+	stamp.psf_scale_x = spec.psf_scale_x;
+	stamp.psf_scale_y = spec.psf_scale_y;
+	stamp.omp_threads = spec.omp_threads;
+	stamp.opencl_env = spec.opencl_env;
+
+	profile_spec p = shape;
+	p.parameters.erase(std::remove_if(p.parameters.begin(), p.parameters.end(), [](const profile_parameter &param) {
+		return param.name == "xcen" || param.name == "ycen" || param.name == "mag";
+	}), p.parameters.end());
+	p.parameters.push_back({"xcen", profile_parameter::DOUBLE, (half + fx) * spec.scale_x});
+	p.parameters.push_back({"ycen", profile_parameter::DOUBLE, (half + fy) * spec.scale_y});
+	p.parameters.push_back({"mag", profile_parameter::DOUBLE, 0});
+	stamp.profiles.push_back(std::move(p));
+
+	Model m;
+	std::vector<ProfilePtr> profiles;
+	std::vector<std::string> warnings;
+	_build_model(stamp, m, warnings, &profiles);
+	if( !profiles.front() ) {
+		return false;
+	}
+	Point offset;
+	image = m.evaluate(offset);
+	return true;
+}
+
+/*
+ * Renders the stamps of @group for the coarsest grid of phases meeting
+ * instancing_accuracy. Returns false if the group should be left to
+ * libprofit instead.
+ */
+static bool _instance_stamps(const model_spec &spec, instance_group &group, std::vector<std::string> &warnings) {
+
+	auto &shape = spec.profiles[group.instances.front()];
+	unsigned int psf_half = std::max(spec.psf_width, spec.psf_height) / 2 + 1;
+	double size = _profile_size(shape, std::min(spec.scale_x, spec.scale_y));
+	group.half = (unsigned int)std::min(std::ceil(16 * std::max(size, 1.)) + psf_half, double(std::max(spec.width, spec.height)));
+	std::size_t stamp_pixels = 4 * std::size_t(group.half) * group.half;
+
+	double error = std::numeric_limits<double>::infinity();
+	for(auto phases: instancing_phases) {
+		if( group.instances.size() < 2 * phases * phases || phases * phases * stamp_pixels > instancing_max_pixels ) {
+			break;
+		}
+		group.phases = phases;
+		group.stamps.resize(phases * phases);
+		for(unsigned int j = 0; j != phases; j++) {
+			for(unsigned int i = 0; i != phases; i++) {
+				if( !_instance_stamp(spec, shape, group.half, double(i) / phases, double(j) / phases, group.stamps[i + j * phases]) ) {
+					return false;
+				}
+			}
+		}
+
+		Image midway;
+		if( !_instance_stamp(spec, shape, group.half, 0.5 / phases, 0.5 / phases, midway) ) {
+			return false;
+		}
+		auto &stamps = group.stamps;
+		double diff = 0, norm = 0;
+		for(std::size_t k = 0; k != stamp_pixels; k++) {
+			double interpolated = (stamps[0][k] + stamps[1][k] + stamps[phases][k] + stamps[phases + 1][k]) / 4;
+			diff += std::abs(midway[k] - interpolated);
+			norm += std::abs(midway[k]);
+		}
+		error = norm > 0 ? diff / norm : 0;
+		if( error <= instancing_accuracy ) {
+			return true;
+		}
+	}
+
+	std::ostringstream os;
+	os << "warning: " << group.instances.size() << " " << shape.name << " profiles sharing their shape weren't instanced: ";
+	if( std::isinf(error) ) {
+		os << "there are too few of them or their stamps are too large";
+	}
+	else {
+		os << "interpolating between phases has a relative error of " << error << ", above " << instancing_accuracy;
+	}
+	warnings.push_back(os.str());
+	group.stamps.clear();
+	return false;
+}
+
+/* Adds each profile of @group to @image */
+static void _add_instances(const model_spec &spec, const instance_group &group, std::vector<double> &image) {
+
+	const unsigned int phases = group.phases;
+	const long half = group.half, stamp_size = 2 * half;
+	for(auto idx: group.instances) {
+
+		auto &profile = spec.profiles[idx];
+		double flux = std::pow(10, -0.4 * (_profile_parameter(profile, "mag", 15) - spec.magzero));
+		double u = _profile_parameter(profile, "xcen", 0) / spec.scale_x * phases;
+		double v = _profile_parameter(profile, "ycen", 0) / spec.scale_y * phases;
+		long ui = (long)std::floor(u), vi = (long)std::floor(v);
+		double tu = u - ui, tv = v - vi;
+
+		/* The four phases around the instance, their weights and stamp origins */
+		for(unsigned int corner = 0; corner != 4; corner++) {
+			long pu = ui + (corner & 1), pv = vi + (corner >> 1);
+			double w = ((corner & 1) ? tu : 1 - tu) * ((corner >> 1) ? tv : 1 - tv) * flux;
+			if( w == 0 ) {
+				continue;
+			}
+			long phase_x = ((pu % phases) + phases) % phases, phase_y = ((pv % phases) + phases) % phases;
+			long x0 = (pu - phase_x) / long(phases) - half, y0 = (pv - phase_y) / long(phases) - half;
+			auto &stamp = group.stamps[phase_x + phase_y * phases];
+
+			long sy0 = std::max(0L, -y0), sy1 = std::min(stamp_size, long(spec.height) - y0);
+			long sx0 = std::max(0L, -x0), sx1 = std::min(stamp_size, long(spec.width) - x0);
+			for(long sy = sy0; sy < sy1; sy++) {
+				for(long sx = sx0; sx < sx1; sx++) {
+					image[(sx + x0) + (sy + y0) * spec.width] += w * stamp[sx + sy * stamp_size];
+				}
+			}
+		}
+	}
+}
+
+static void _add_native_profiles(const model_spec &spec, std::vector<double> &image);
+static void _evaluate_with_native_convolver(const model_spec &spec, Image &image, Point &offset, std::vector<std::string> &warnings);
+
+/*
+ * Builds and evaluates a model specification, rendering repeated shapes
+ * through instancing and tabulated and registered profile types natively.
+ * Doesn't need the GIL; errors are returned as a non-empty string.
+ */
+static std::string _evaluate_spec(const model_spec &spec, Image &image, Point &offset, std::vector<std::string> &warnings) {
+	try {
+		if( spec.native_conv ) {
+			_evaluate_with_native_convolver(spec, image, offset, warnings);
+			return std::string();
+		}
+
+		std::vector<instance_group> instanced;
+		if( spec.instancing && spec.finesampling <= 1 && spec.profiles.size() >= instancing_min_count ) {
+			std::map<std::string, std::vector<std::size_t>> shapes;
+			for(std::size_t i = 0; i != spec.profiles.size(); i++) {
+				auto key = _instance_key(spec.profiles[i]);
+				if( !key.empty() ) {
+					shapes[key].push_back(i);
+				}
+			}
+			for(auto &shape: shapes) {
+				if( shape.second.size() < instancing_min_count ) {
+					continue;
+				}
+				instance_group group;
+				group.instances = std::move(shape.second);
+				if( _instance_stamps(spec, group, warnings) ) {
+					instanced.push_back(std::move(group));
+				}
+			}
+		}
+
+		if( instanced.empty() && !_has_native_profiles(spec) ) {
+			Model m;
+			_build_model(spec, m, warnings);
+			image = m.evaluate(offset);
+			return std::string();
+		}
+
+		/* libprofit renders the rest of the profiles, if any */
+		std::vector<bool> taken(spec.profiles.size());
+		for(std::size_t i = 0; i != spec.profiles.size(); i++) {
+			taken[i] = _is_native_profile(spec.profiles[i].name);
+		}
+		for(auto &group: instanced) {
+			for(auto idx: group.instances) {
+				taken[idx] = true;
+			}
+		}
+		model_spec rest = spec;
+		rest.profiles.clear();
+		for(std::size_t i = 0; i != spec.profiles.size(); i++) {
+			if( !taken[i] ) {
+				rest.profiles.push_back(spec.profiles[i]);
+			}
+		}
+		std::vector<double> values(std::size_t(spec.width) * spec.height);
+		offset = Point();
+		if( !rest.profiles.empty() ) {
+			Model m;
+			_build_model(rest, m, warnings);
+			Image rest_image = m.evaluate(offset);
+			std::copy(&rest_image[0], &rest_image[0] + values.size(), values.begin());
+		}
+
+		for(auto &group: instanced) {
+			_add_instances(spec, group, values);
+		}
+		_add_native_profiles(spec, values);
+		if( !spec.calcmask.empty() ) {
+			for(std::size_t i = 0; i != values.size(); i++) {
+				if( !spec.calcmask[i] ) {
+					values[i] = 0;
+				}
+			}
+		}
+		image = Image(std::move(values), spec.width, spec.height);
+	} catch (std::exception &e) {
+		return e.what();
+	}
+	return std::string();
+}
+
+/*
+ * Evaluates a specification with a convolver implemented by pyprofit (see
+ * native_convolver). The profiles not convolved are evaluated as usual.
+ */
+static void _evaluate_with_native_convolver(const model_spec &spec, Image &image, Point &offset, std::vector<std::string> &warnings) {
+
+	if( spec.finesampling > 1 ) {
+		throw invalid_parameter("OTF and hybrid convolvers don't support finesampling");
+	}
+
+	unsigned int padded_width, padded_height;
+	spec.native_conv->padded_size(spec.width, spec.height, padded_width, padded_height);
+	unsigned int pad_x = (padded_width - spec.width) / 2, pad_y = (padded_height - spec.height) / 2;
+	model_spec convolved = spec, rest = spec;
+	convolved.native_conv.reset();
+	convolved.width = padded_width;
+	convolved.height = padded_height;
+	convolved.calcmask.clear();
+	convolved.profiles.clear();
+	rest.native_conv.reset();
+	rest.profiles.clear();
+	for(auto &profile: spec.profiles) {
+		if( _profile_parameter(profile, "convolve", 0) == 0 ) {
+			rest.profiles.push_back(profile);
+			continue;
+		}
+
+		/* Moved to the padded grid (if placed at all), and not convolved by libprofit */
+		profile_spec moved = profile;
+		std::map<std::string, double> changes;
+		if( _has_centre(profile.name) ) {
+			changes = {{"xcen", pad_x * spec.scale_x}, {"ycen", pad_y * spec.scale_y}};
+		}
+		for(auto &param: moved.parameters) {
+			auto it = changes.find(param.name);
+			if( it != changes.end() ) {
+				param.value += it->second;
+				changes.erase(it);
+			}
+			else if( param.name == "convolve" ) {
+				param.value = 0;
+			}
+		}
+		for(auto &change: changes) {
+			moved.parameters.push_back({change.first, profile_parameter::DOUBLE, change.second});
+		}
+		convolved.profiles.push_back(std::move(moved));
+	}
+
+	std::vector<double> values(std::size_t(spec.width) * spec.height);
+	offset = Point();
+	if( !rest.profiles.empty() ) {
+		Image rest_image;
+		auto error = _evaluate_spec(rest, rest_image, offset, warnings);
+		if( !error.empty() ) {
+			throw invalid_parameter(error);
+		}
+		std::copy(&rest_image[0], &rest_image[0] + values.size(), values.begin());
+	}
+	if( !convolved.profiles.empty() ) {
+		Image padded_image;
+		Point padded_offset;
+		auto error = _evaluate_spec(convolved, padded_image, padded_offset, warnings);
+		if( !error.empty() ) {
+			throw invalid_parameter(error);
+		}
+		std::vector<double> padded(&padded_image[0], &padded_image[0] + std::size_t(padded_width) * padded_height);
+		spec.native_conv->convolve(padded, padded_width, padded_height);
+		for(unsigned int j = 0; j != spec.height; j++) {
+			for(unsigned int i = 0; i != spec.width; i++) {
+				values[i + j * spec.width] += padded[(i + pad_x) + (j + pad_y) * padded_width];
+			}
+		}
+	}
+
+	if( !spec.calcmask.empty() ) {
+		for(std::size_t i = 0; i != values.size(); i++) {
+			if( !spec.calcmask[i] ) {
+				values[i] = 0;
+			}
+		}
+	}
+	image = Image(std::move(values), spec.width, spec.height);
+}
+
+static PyObject *_value_to_python(double value) {
+	return PyFloat_FromDouble(value);
+}
+
+static PyObject *_value_to_python(const std::complex<double> &value) {
+	return PyComplex_FromDoubles(value.real(), value.imag());
+}
+
+/* Copies @width x @height values into a 2-D tuple */
+template <typename Values>
+static PyObject *_values_to_tuple(const Values &values, unsigned int width, unsigned int height) {
+
+	PyObject *image_tuple = PyTuple_New(height);
+	if( image_tuple == NULL ) {
+		PYPROFIT_RAISE("Couldn't create image tuple");
+	}
+	for(unsigned int i=0; i!=height; i++) {
+		PyObject *row_tuple = PyTuple_New(width);
 		if( row_tuple == NULL ) {
+			Py_DECREF(image_tuple);
 			PYPROFIT_RAISE("Couldn't create row tuple");
 		}
-		for(j=0; j!=im_dims.x; j++) {
-			PyObject *val = PyFloat_FromDouble(image[i*im_dims.x + j]);
-			PyTuple_SetItem(row_tuple, j, val);
+		for(unsigned int j=0; j!=width; j++) {
+			PyObject *val = _value_to_python(values[i*width + j]);
+			PyTuple_SetItem(row_tuple, j, val);
+		}
+		PyTuple_SetItem(image_tuple, i, row_tuple);
+	}
+	return image_tuple;
+}
+
+/*
+ * Converts an evaluated image into our return value, a 2-element tuple.
+ * Element 0 is a 2-D tuple with the image values
+ * Element 1 is a 2-element tuple with the offset
+ */
+static PyObject *_image_to_tuple(const Image &image, const Point &offset) {
+
+	auto im_dims = image.getDimensions();
+	PyObject *offset_tuple = PyTuple_New(2);
+	PyObject *return_tuple = PyTuple_New(2);
+	if (offset_tuple == NULL || return_tuple == NULL) {
+		Py_XDECREF(offset_tuple);
+		Py_XDECREF(return_tuple);
+		PYPROFIT_RAISE("Couldn't create return tuples");
+	}
+
+	/* Copy resulting image into a 2-D tuple */
+	PyObject *image_tuple = _values_to_tuple(image, im_dims.x, im_dims.y);
+	if( image_tuple == NULL ) {
+		Py_DECREF(offset_tuple);
+		Py_DECREF(return_tuple);
+		return NULL;
+	}
+
+	/* Copy offset into another 2-element tuple */
+	PyTuple_SetItem(offset_tuple, 0, PyFloat_FromDouble(offset.x));
+	PyTuple_SetItem(offset_tuple, 1, PyFloat_FromDouble(offset.y));
+
+	PyTuple_SetItem(return_tuple, 0, image_tuple);
+	PyTuple_SetItem(return_tuple, 1, offset_tuple);
+	return return_tuple;
+}
+
+/*
+ * Evaluated images, returned instead of nested tuples when asked for.
+ * They export their values through the buffer protocol and DLPack, so
+ * numpy, PyTorch, JAX and others can use them without copies.
+ */
+typedef struct {
+	PyObject_HEAD
+	std::vector<double> *values;
+	Py_ssize_t shape[2];
+	Py_ssize_t strides[2];
+} PyImage;
+
+static void image_dealloc(PyImage *self) {
+	delete self->values;
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int image_getbuffer(PyImage *self, Py_buffer *view, int flags) {
+	view->buf = self->values->data();
+	view->obj = (PyObject *)self;
+	Py_INCREF(self);
+	view->len = self->shape[0] * self->strides[0];
+	view->readonly = 0;
+	view->itemsize = sizeof(double);
+	view->format = (flags & PyBUF_FORMAT) ? const_cast<char *>("d") : NULL;
+	view->ndim = 2;
+	view->shape = self->shape;
+	view->strides = self->strides;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static PyBufferProcs image_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+	NULL, NULL, NULL, NULL,
+#endif
+	(getbufferproc)image_getbuffer,
+	NULL,
+};
+
+/* A DLManagedTensor keeping its image alive */
+struct image_dlpack_export {
+	DLManagedTensor managed;
+	std::int64_t shape[2];
+	PyObject *image;
+};
+
+static void _image_dlpack_deleter(DLManagedTensor *managed) {
+	auto exported = static_cast<image_dlpack_export *>(managed->manager_ctx);
+	PyGILState_STATE gil = PyGILState_Ensure();
+	Py_DECREF(exported->image);
+	PyGILState_Release(gil);
+	delete exported;
+}
+
+/* Capsules never consumed still own their tensor */
+static void _image_dlpack_capsule_destructor(PyObject *capsule) {
+	if( PyCapsule_IsValid(capsule, "dltensor") ) {
+		auto managed = static_cast<DLManagedTensor *>(PyCapsule_GetPointer(capsule, "dltensor"));
+		managed->deleter(managed);
+	}
+}
+
+static PyObject *image_dlpack(PyImage *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *stream = Py_None, *max_version = Py_None, *dl_device = Py_None, *copy = Py_None;
+	const char *kwlist[] = {"stream", "max_version", "dl_device", "copy", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOO:__dlpack__", const_cast<char **>(kwlist),
+	                                 &stream, &max_version, &dl_device, &copy) ) {
+		return NULL;
+	}
+	if( dl_device != Py_None ) {
+		PyObject *cpu = Py_BuildValue("(ii)", DLPACK_CPU, 0);
+		int is_cpu = cpu ? PyObject_RichCompareBool(dl_device, cpu, Py_EQ) : -1;
+		Py_XDECREF(cpu);
+		if( is_cpu != 1 ) {
+			if( is_cpu == 0 ) {
+				PyErr_SetString(PyExc_BufferError, "images can only be exported to the CPU");
+			}
+			return NULL;
+		}
+	}
+
+	auto exported = new image_dlpack_export();
+	exported->shape[0] = self->shape[0];
+	exported->shape[1] = self->shape[1];
+	exported->image = (PyObject *)self;
+	Py_INCREF(self);
+	DLTensor &t = exported->managed.dl_tensor;
+	t.data = self->values->data();
+	t.device = {DLPACK_CPU, 0};
+	t.ndim = 2;
+	t.dtype = {DLPACK_FLOAT, 64, 1};
+	t.shape = exported->shape;
+	t.strides = NULL;
+	t.byte_offset = 0;
+	exported->managed.manager_ctx = exported;
+	exported->managed.deleter = _image_dlpack_deleter;
+
+	PyObject *capsule = PyCapsule_New(&exported->managed, "dltensor", _image_dlpack_capsule_destructor);
+	if( !capsule ) {
+		_image_dlpack_deleter(&exported->managed);
+	}
+	return capsule;
+}
+
+static PyObject *image_dlpack_device(PyImage *self, PyObject *args) {
+	return Py_BuildValue("(ii)", DLPACK_CPU, 0);
+}
+
+static PyObject *image_get_width(PyImage *self, void *closure) {
+	return PyLong_FromSsize_t(self->shape[1]);
+}
+
+static PyObject *image_get_height(PyImage *self, void *closure) {
+	return PyLong_FromSsize_t(self->shape[0]);
+}
+
+static PyObject *image_to_tuple(PyImage *self, PyObject *args) {
+	return _values_to_tuple(*self->values, (unsigned int)self->shape[1], (unsigned int)self->shape[0]);
+}
+
+static PyGetSetDef PyImage_getset[] = {
+    {const_cast<char *>("width"),  (getter)image_get_width,  NULL, const_cast<char *>("Width of the image"), NULL},
+    {const_cast<char *>("height"), (getter)image_get_height, NULL, const_cast<char *>("Height of the image"), NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+static PyMethodDef PyImage_methods[] = {
+    {"__dlpack__",        (PyCFunction)image_dlpack,        METH_VARARGS | METH_KEYWORDS, "Exports the image as a DLPack capsule."},
+    {"__dlpack_device__", (PyCFunction)image_dlpack_device, METH_NOARGS, "Returns the DLPack device of the image."},
+    {"to_tuple",          (PyCFunction)image_to_tuple,      METH_NOARGS, "Returns the image values as a 2-D tuple."},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyTypeObject PyImage_Type = {
+#if PY_MAJOR_VERSION >= 3
+	PyVarObject_HEAD_INIT(NULL, 0)
+#else
+	PyObject_HEAD_INIT(NULL)
+	0,                             /*ob_size*/
+#endif
+	"pyprofit.image",              /*tp_name*/
+	sizeof(PyImage),               /*tp_basicsize*/
+};
+
+/* Like _image_to_tuple, but with the values in a pyprofit.image */
+static PyObject *_image_to_pyimage(const Image &image, const Point &offset) {
+
+	PyImage *pyimage = PyObject_New(PyImage, &PyImage_Type);
+	if( !pyimage ) {
+		return NULL;
+	}
+	auto dims = image.getDimensions();
+	pyimage->values = new std::vector<double>(&image[0], &image[0] + image.size());
+	pyimage->shape[0] = dims.y;
+	pyimage->shape[1] = dims.x;
+	pyimage->strides[0] = sizeof(double) * dims.x;
+	pyimage->strides[1] = sizeof(double);
+	return Py_BuildValue("(N(dd))", (PyObject *)pyimage, offset.x, offset.y);
+}
+
+static PyObject *pyprofit_make_model(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *model_dict, *as_image = Py_False;
+	const char *kwlist[] = {"model", "as_image", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "O!|O:make_model", const_cast<char **>(kwlist),
+	                                 &PyDict_Type, &model_dict, &as_image) ) {
+		return NULL;
+	}
+
+	model_spec spec;
+	if( !_read_model_spec(model_dict, spec) ) {
+		return NULL;
+	}
+
+	/*
+	 * Go, Go, Go!
+	 * This might take a few [ms], so we release the GIL
+	 */
+	Image image;
+	Point offset;
+	std::string error;
+	std::vector<std::string> warnings;
+	Py_BEGIN_ALLOW_THREADS
+	error = _evaluate_spec(spec, image, offset, warnings);
+	Py_END_ALLOW_THREADS
+
+	_print_warnings(warnings);
+	if( !error.empty() ) {
+		PyErr_SetString(profit_error, error.c_str());
+		return NULL;
+	}
+
+	if( PyObject_IsTrue(as_image) ) {
+		return _image_to_pyimage(image, offset);
+	}
+	return _image_to_tuple(image, offset);
+}
+
+#ifdef PYPROFIT_HAS_MMAP
+
+/* 64-bit FNV-1a hash, stable across processes and builds */
+static std::uint64_t _fnv1a(const std::string &data, std::uint64_t hash = 0xcbf29ce484222325ULL) {
+	for(unsigned char c: data) {
+		hash ^= c;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Checkpoint of a batch evaluation.
+ *
+ * Results are written to a memory-mapped file made of a header, a journal
+ * with one entry per distinct model of the batch, and a data section with
+ * one slot per model big enough to hold its image. A result's values are
+ * flushed to disk before its journal entry is marked as done, so a job
+ * interrupted at any point can be restarted with the same batch and
+ * checkpoint file, and will only evaluate the models without a result.
+ */
+class batch_checkpoint {
+public:
+	batch_checkpoint() : mem(nullptr), size(0) {}
+
+	~batch_checkpoint() {
+		if( mem ) {
+			munmap(mem, size);
+		}
+	}
+
+	/* Opens (or creates) the checkpoint for @specs; returns an error message on failure */
+	std::string open(const std::string &path, const std::vector<model_spec> &specs) {
+
+		/* Identify the job by the models it evaluates */
+		std::uint64_t job_key = 0xcbf29ce484222325ULL;
+		std::uint64_t data_size = 0;
+		for(auto &spec: specs) {
+			spec_writer w;
+			_write_model_spec(w, spec);
+			if( spec.native_conv ) {
+				w.buffer += spec.native_conv->key();
+			}
+			job_key = _fnv1a(w.buffer, job_key);
+			data_size += sizeof(double) * std::uint64_t(spec.width) * spec.height * spec.finesampling * spec.finesampling;
+		}
+		std::uint64_t journal_size = sizeof(journal_entry) * specs.size();
+		std::uint64_t total_size = sizeof(header_t) + journal_size + data_size;
+
+		int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if( fd == -1 ) {
+			return std::strerror(errno);
+		}
+		struct stat st;
+		if( fstat(fd, &st) == -1 ) {
+			int err = errno;
+			close(fd);
+			return std::strerror(err);
+		}
+
+		bool fresh = st.st_size == 0;
+		if( fresh && ftruncate(fd, total_size) == -1 ) {
+			int err = errno;
+			close(fd);
+			return std::strerror(err);
+		}
+		else if( !fresh && std::uint64_t(st.st_size) != total_size ) {
+			close(fd);
+			return "checkpoint file belongs to a different batch";
+		}
+
+		mem = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if( mem == MAP_FAILED ) {
+			mem = nullptr;
+			return std::strerror(errno);
+		}
+		size = total_size;
+
+		auto &hdr = header();
+		if( fresh ) {
+			std::memcpy(hdr.magic, MAGIC, sizeof(MAGIC));
+			hdr.n_items = specs.size();
+			hdr.job_key = job_key;
+			std::uint64_t offset = sizeof(header_t) + journal_size;
+			for(std::size_t i = 0; i != specs.size(); i++) {
+				auto &spec = specs[i];
+				journal()[i].data_offset = offset;
+				journal()[i].capacity = std::uint64_t(spec.width) * spec.height * spec.finesampling * spec.finesampling;
+				offset += sizeof(double) * journal()[i].capacity;
+			}
+			try {
+				sync(mem, sizeof(header_t) + journal_size);
+			} catch (std::exception &e) {
+				return e.what();
+			}
+		}
+		else if( std::memcmp(hdr.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+		         hdr.n_items != specs.size() || hdr.job_key != job_key ) {
+			return "checkpoint file belongs to a different batch";
+		}
+		else {
+			/* The journal comes from disk: its layout must be the one we'd write */
+			std::uint64_t offset = sizeof(header_t) + journal_size;
+			for(std::size_t i = 0; i != specs.size(); i++) {
+				auto &spec = specs[i];
+				auto &entry = journal()[i];
+				std::uint64_t capacity = std::uint64_t(spec.width) * spec.height * spec.finesampling * spec.finesampling;
+				if( entry.data_offset != offset || entry.capacity != capacity ||
+				    (entry.state == DONE && std::uint64_t(entry.width) * entry.height > capacity) ) {
+					return "checkpoint file is corrupted";
+				}
+				offset += sizeof(double) * capacity;
+			}
+		}
+
+		return std::string();
+	}
+
+	bool done(std::size_t i) const {
+		return journal()[i].state == DONE;
+	}
+
+	void load(std::size_t i, Image &image, Point &offset) const {
+		auto &entry = journal()[i];
+		std::uint64_t n = std::uint64_t(entry.width) * entry.height;
+		if( n > entry.capacity || entry.data_offset > size || sizeof(double) * n > size - entry.data_offset ) {
+			throw std::runtime_error("checkpoint file is corrupted");
+		}
+		auto data = reinterpret_cast<const double *>(static_cast<const char *>(mem) + entry.data_offset);
+		image = Image(std::vector<double>(data, data + std::size_t(entry.width) * entry.height), entry.width, entry.height);
+		offset = Point(entry.offset_x, entry.offset_y);
+	}
+
+	void store(std::size_t i, const Image &image, const Point &offset) {
+		auto &entry = journal()[i];
+		auto dims = image.getDimensions();
+		std::size_t n = std::size_t(dims.x) * dims.y;
+		if( n > entry.capacity ) {
+			throw std::runtime_error("image doesn't fit in its checkpoint slot");
+		}
+
+		auto data = reinterpret_cast<double *>(static_cast<char *>(mem) + entry.data_offset);
+		for(std::size_t j = 0; j != n; j++) {
+			data[j] = image[j];
+		}
+		sync(data, sizeof(double) * n);
+
+		entry.width = dims.x;
+		entry.height = dims.y;
+		entry.offset_x = offset.x;
+		entry.offset_y = offset.y;
+		sync(&entry, sizeof(entry));
+		entry.state = DONE;
+		sync(&entry, sizeof(entry));
+	}
+
+private:
+	struct header_t {
+		char magic[8];
+		std::uint64_t n_items;
+		std::uint64_t job_key;
+		char padding[40];
+	};
+
+	struct journal_entry {
+		std::uint32_t state;
+		std::uint32_t width;
+		std::uint32_t height;
+		std::uint32_t padding;
+		double offset_x;
+		double offset_y;
+		std::uint64_t data_offset;
+		std::uint64_t capacity;
+	};
+
+	static constexpr std::uint32_t DONE = 1;
+	static constexpr char MAGIC[8] = {'P', 'Y', 'P', 'R', 'O', 'F', 'C', 'K'};
+
+	void *mem;
+	std::size_t size;
+
+	header_t &header() {
+		return *static_cast<header_t *>(mem);
+	}
+
+	journal_entry *journal() const {
+		return reinterpret_cast<journal_entry *>(static_cast<char *>(mem) + sizeof(header_t));
+	}
+
+	static void sync(void *addr, std::size_t len) {
+		static const std::size_t page_size = sysconf(_SC_PAGESIZE);
+		auto start = reinterpret_cast<std::uintptr_t>(addr) / page_size * page_size;
+		auto end = reinterpret_cast<std::uintptr_t>(addr) + len;
+		if( msync(reinterpret_cast<void *>(start), end - start, MS_SYNC) == -1 ) {
+			throw std::runtime_error(std::string("error while writing checkpoint: ") + std::strerror(errno));
+		}
+	}
+};
+
+constexpr char batch_checkpoint::MAGIC[8];
+
+#endif // PYPROFIT_HAS_MMAP
+
+/*
+ * Evaluates a batch of models.
+ *
+ * Batches built from parameter grids or walker ensembles often contain
+ * exact duplicates, so models are first reduced to their specification and
+ * only distinct specifications are evaluated. Duplicates share the same
+ * (immutable) result object.
+ *
+ * If a checkpoint file is given, results are written to it as they are
+ * produced, and results already present in it are not evaluated again.
+ */
+static PyObject *pyprofit_make_models(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *models;
+	PyObject *return_stats = Py_False;
+	const char *checkpoint_path = NULL;
+	const char *kwlist[] = {"models", "return_stats", "checkpoint", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "O|Oz:make_models", const_cast<char **>(kwlist),
+	                                 &models, &return_stats, &checkpoint_path) ) {
+		return NULL;
+	}
+#ifndef PYPROFIT_HAS_MMAP
+	if( checkpoint_path ) {
+		PYPROFIT_RAISE("checkpoints are not supported in this platform");
+	}
+#endif // PYPROFIT_HAS_MMAP
+
+	PyObject *models_seq = PySequence_Fast(models, "models must be a sequence of model dictionaries");
+	if( !models_seq ) {
+		return NULL;
+	}
+	Py_ssize_t n_models = PySequence_Fast_GET_SIZE(models_seq);
+
+	/* Read all specifications, keeping only the distinct ones */
+	std::vector<model_spec> specs;
+	std::vector<std::size_t> spec_idx(n_models);
+	std::unordered_map<std::string, std::size_t> seen;
+	for(Py_ssize_t i = 0; i != n_models; i++) {
+		model_spec spec;
+		if( !_read_model_spec(PySequence_Fast_GET_ITEM(models_seq, i), spec) ) {
+			Py_DECREF(models_seq);
+			return NULL;
+		}
+		auto inserted = seen.emplace(_model_spec_key(spec), specs.size());
+		if( inserted.second ) {
+			specs.push_back(std::move(spec));
+		}
+		spec_idx[i] = inserted.first->second;
+	}
+	Py_DECREF(models_seq);
+
+	/* Evaluate each distinct model once */
+	std::vector<Image> images(specs.size());
+	std::vector<Point> offsets(specs.size());
+	std::vector<std::string> warnings;
+	std::string error;
+	std::size_t n_resumed = 0;
+	Py_BEGIN_ALLOW_THREADS
+#ifdef PYPROFIT_HAS_MMAP
+	batch_checkpoint checkpoint;
+	if( checkpoint_path ) {
+		error = checkpoint.open(checkpoint_path, specs);
+	}
+#endif // PYPROFIT_HAS_MMAP
+	for(std::size_t i = 0; i != specs.size() && error.empty(); i++) {
+#ifdef PYPROFIT_HAS_MMAP
+		if( checkpoint_path && checkpoint.done(i) ) {
+			try {
+				checkpoint.load(i, images[i], offsets[i]);
+			} catch (std::exception &e) {
+				error = e.what();
+				break;
+			}
+			n_resumed++;
+			continue;
+		}
+#endif // PYPROFIT_HAS_MMAP
+		error = _evaluate_spec(specs[i], images[i], offsets[i], warnings);
+#ifdef PYPROFIT_HAS_MMAP
+		if( checkpoint_path && error.empty() ) {
+			try {
+				checkpoint.store(i, images[i], offsets[i]);
+			} catch (std::exception &e) {
+				error = e.what();
+			}
+		}
+#endif // PYPROFIT_HAS_MMAP
+	}
+	Py_END_ALLOW_THREADS
+
+	_print_warnings(warnings);
+	if( !error.empty() ) {
+		PyErr_SetString(profit_error, error.c_str());
+		return NULL;
+	}
+
+	/* Convert distinct results and fan them out to their duplicates */
+	std::vector<PyObject *> results(specs.size());
+	PyObject *results_list = PyList_New(n_models);
+	if( !results_list ) {
+		return NULL;
+	}
+	for(std::size_t i = 0; i != specs.size(); i++) {
+		results[i] = _image_to_tuple(images[i], offsets[i]);
+		if( !results[i] ) {
+			for(std::size_t j = 0; j != i; j++) {
+				Py_DECREF(results[j]);
+			}
+			Py_DECREF(results_list);
+			return NULL;
+		}
+		images[i] = Image();
+	}
+	for(Py_ssize_t i = 0; i != n_models; i++) {
+		PyObject *result = results[spec_idx[i]];
+		Py_INCREF(result);
+		PyList_SET_ITEM(results_list, i, result);
+	}
+	for(auto result: results) {
+		Py_DECREF(result);
+	}
+
+	if( !PyObject_IsTrue(return_stats) ) {
+		return results_list;
+	}
+
+	std::size_t n_duplicates = n_models - specs.size();
+	double hit_rate = n_models ? double(n_duplicates) / n_models : 0.;
+	PyObject *stats = Py_BuildValue("{s:n,s:n,s:n,s:d,s:n}",
+	                                "models", n_models,
+	                                "evaluated", (Py_ssize_t)(specs.size() - n_resumed),
+	                                "duplicates", (Py_ssize_t)n_duplicates,
+	                                "dedup_hit_rate", hit_rate,
+	                                "resumed", (Py_ssize_t)n_resumed);
+	if( !stats ) {
+		Py_DECREF(results_list);
+		return NULL;
+	}
+	return Py_BuildValue("(NN)", results_list, stats);
+}
+
+/*
+ * Compiled models
+ *
+ * A compiled model keeps the parsed specification of a model together with
+ * the profit::Model built from it, so repeated evaluations don't need to
+ * parse the model dictionary again. The specification is also what gets
+ * serialised when pickling, so other processes can rebuild the model
+ * without going through dictionaries.
+ */
+/*
+ * A single profile of a compiled model evaluated on its own, together with
+ * the last image it produced. Profile images scale linearly with their flux,
+ * so when only the flux of a profile changes (its magnitude, or the
+ * background of a sky profile) the cached image is rescaled instead of
+ * evaluated again.
+ */
+struct model_component {
+	std::unique_ptr<Model> model;
+	Image image;
+	Point offset;
+	double rendered_flux = std::numeric_limits<double>::quiet_NaN();
+	bool dirty = true;
+};
+
+/*
+ * A band of rows of a compiled model, evaluated on its own by
+ * compiled_model::likelihood(threshold, aborted). Rows [y0, y1) are
+ * compared with the data, and its model is cropped to rows
+ * [rows_y0, rows_y1), which include the halo needed by convolution, with
+ * profiles moved up by rows_y0 rows.
+ */
+struct likelihood_band {
+	unsigned int y0, y1, rows_y0, rows_y1;
+	std::unique_ptr<Model> model;
+	std::vector<ProfilePtr> profiles;
+};
+
+/*
+ * Solves the n x n linear system A x = b (A is row-major, and both A and b
+ * are overwritten) using Gaussian elimination with partial pivoting.
+ * Unknowns whose pivot is negligible are considered degenerate and set to 0.
+ */
+static std::vector<double> _solve_linear_system(std::vector<double> &A, std::vector<double> &b, std::size_t n) {
+
+	std::vector<double> x(n);
+	double max_diag = 0;
+	for(std::size_t k = 0; k != n; k++) {
+		max_diag = std::max(max_diag, std::abs(A[k * n + k]));
+	}
+	std::vector<bool> degenerate(n, false);
+	for(std::size_t k = 0; k != n; k++) {
+		std::size_t pivot = k;
+		for(std::size_t r = k + 1; r != n; r++) {
+			if( std::abs(A[r * n + k]) > std::abs(A[pivot * n + k]) ) {
+				pivot = r;
+			}
+		}
+		if( std::abs(A[pivot * n + k]) <= 1e-12 * max_diag ) {
+			degenerate[k] = true;
+			continue;
+		}
+		if( pivot != k ) {
+			for(std::size_t c = 0; c != n; c++) {
+				std::swap(A[k * n + c], A[pivot * n + c]);
+			}
+			std::swap(b[k], b[pivot]);
+		}
+		for(std::size_t r = k + 1; r != n; r++) {
+			double f = A[r * n + k] / A[k * n + k];
+			for(std::size_t c = k; c != n; c++) {
+				A[r * n + c] -= f * A[k * n + c];
+			}
+			b[r] -= f * b[k];
+		}
+	}
+	for(std::size_t k = n; k-- != 0;) {
+		if( degenerate[k] ) {
+			x[k] = 0;
+			continue;
+		}
+		double sum = b[k];
+		for(std::size_t c = k + 1; c != n; c++) {
+			sum -= A[k * n + c] * x[c];
+		}
+		x[k] = sum / A[k * n + k];
+	}
+	return x;
+}
+
+/* A rectangular region of an image and its values, in image pixels */
+struct image_stamp {
+	unsigned int x0 = 0, y0 = 0, width = 0, height = 0;
+	std::vector<double> values;
+};
+
+/*
+ * Elliptical geometry shared by radial profiles: centre, position angle
+ * (degrees, counter-clockwise from the y axis), axis ratio and boxiness.
+ * Profiles with identical geometry see identical radius grids.
+ */
+struct elliptical_geometry {
+	double xcen, ycen, ang, axrat, box;
+
+	bool operator<(const elliptical_geometry &other) const {
+		return std::tie(xcen, ycen, ang, axrat, box) < std::tie(other.xcen, other.ycen, other.ang, other.axrat, other.box);
+	}
+};
+
+/*
+ * Boxy elliptical radius of the point (x, y), following libprofit's
+ * convention. @cos_ang and @sin_ang are those of the geometry's angle
+ * turned by 90 degrees (see _radius_grid).
+ */
+static double _elliptical_radius(const elliptical_geometry &g, double cos_ang, double sin_ang, double x, double y) {
+	x -= g.xcen;
+	y -= g.ycen;
+	double x_ell = std::abs(x * cos_ang + y * sin_ang);
+	double y_ell = std::abs((-x * sin_ang + y * cos_ang) / g.axrat);
+	if( g.box == 0 ) {
+		return std::sqrt(x_ell * x_ell + y_ell * y_ell);
+	}
+	double exponent = 2 + g.box;
+	return std::pow(std::pow(x_ell, exponent) + std::pow(y_ell, exponent), 1 / exponent);
+}
+
+/*
+ * Boxy elliptical radius at the centre of each pixel of a @width x @height
+ * image with the given pixel scale.
+ */
+static std::vector<double> _radius_grid(const elliptical_geometry &g, unsigned int width, unsigned int height, double scale_x, double scale_y) {
+
+	double angrad = std::fmod(g.ang + 90, 360.) * M_PI / 180;
+	double cos_ang = std::cos(angrad), sin_ang = std::sin(angrad);
+
+	std::vector<double> radii(std::size_t(width) * height);
+	for(unsigned int j = 0; j != height; j++) {
+		for(unsigned int i = 0; i != width; i++) {
+			radii[i + j * width] = _elliptical_radius(g, cos_ang, sin_ang, (i + 0.5) * scale_x, (j + 0.5) * scale_y);
+		}
+	}
+	return radii;
+}
+
+/*
+ * Convolves an image with a PSF by direct summation, normalising the PSF
+ * first and keeping its centre at (psf_width / 2, psf_height / 2) as
+ * libprofit does.
+ */
+static std::vector<double> _convolve_direct(const std::vector<double> &image, unsigned int width, unsigned int height,
+                                            const std::vector<double> &psf, unsigned int psf_width, unsigned int psf_height) {
+
+	double psf_sum = 0;
+	for(auto v: psf) {
+		psf_sum += v;
+	}
+	if( psf_sum == 0 ) {
+		psf_sum = 1;
+	}
+	std::vector<double> kernel(psf.size());
+	for(std::size_t k = 0; k != psf.size(); k++) {
+		kernel[k] = psf[k] / psf_sum;
+	}
+
+	/*
+	 * Each source pixel is spread over the output one kernel row at a time,
+	 * clipping the row against the image first so the innermost loop is a
+	 * branch-free multiply-add the compiler can vectorise
+	 */
+	std::vector<double> convolved(image.size());
+	int half_w = psf_width / 2, half_h = psf_height / 2;
+	for(int y = 0; y != int(height); y++) {
+		int j0 = std::max(0, half_h - y), j1 = std::min(int(psf_height), int(height) + half_h - y);
+		for(int x = 0; x != int(width); x++) {
+			double value = image[x + y * width];
+			if( value == 0 ) {
+				continue;
+			}
+			int i0 = std::max(0, half_w - x), i1 = std::min(int(psf_width), int(width) + half_w - x);
+			for(int j = j0; j < j1; j++) {
+				double *out = &convolved[(y + j - half_h) * width + (x + i0 - half_w)];
+				const double *krn = &kernel[j * psf_width + i0];
+				for(int i = 0; i < i1 - i0; i++) {
+					out[i] += value * krn[i];
+				}
+			}
+		}
+	}
+	return convolved;
+}
+
+/*
+ * Native radial profiles
+ *
+ * libprofit has no tabulated profiles, nor knows about the profile types
+ * registered by other extensions, so these are evaluated here. Their
+ * surface brightness is given by a function of the usual boxy elliptical
+ * radius, and is normalised so that the total flux is given by mag. Like
+ * libprofit, pixels are recursively subsampled (resolution x resolution,
+ * up to max_recursions times) while the surface brightness changes by more
+ * than acc across them, unless rough is set. Profiles sharing their
+ * elliptical geometry share the radii of their pixel centres, computed once
+ * by _radius_grid. Rows of large stamps are split among omp_threads threads.
+ */
+struct radial_function {
+	std::function<double(double)> value;
+	/* Integral of r * I(r) dr */
+	double integral;
+	/* Radius beyond which the function is (or can be taken as) zero */
+	double extent;
+};
+
+/*
+ * Tabulated profiles linearly interpolate their table, are constant inside
+ * its first radius and zero beyond its last
+ */
+static double _tabulated_value(const profile_spec &profile, double r) {
+	auto &radii = profile.radii;
+	auto &values = profile.values;
+	if( r <= radii.front() ) {
+		return values.front();
+	}
+	if( r > radii.back() ) {
+		return 0;
+	}
+	std::size_t i = std::lower_bound(radii.begin(), radii.end(), r) - radii.begin();
+	double t = (r - radii[i - 1]) / (radii[i] - radii[i - 1]);
+	return values[i - 1] + t * (values[i] - values[i - 1]);
+}
+
+static radial_function _radial_function(const profile_spec &profile) {
+
+	if( profile.name == "tabulated" ) {
+		auto &radii = profile.radii;
+		auto &values = profile.values;
+		double integral = values.front() * radii.front() * radii.front() / 2;
+		for(std::size_t i = 1; i < radii.size(); i++) {
+			double a = radii[i - 1], b = radii[i];
+			double slope = (values[i] - values[i - 1]) / (b - a);
+			integral += values[i - 1] * (b * b - a * a) / 2 + slope * ((b * b * b - a * a * a) / 3 - a * (b * b - a * a) / 2);
+		}
+		return {[&profile](double r) { return _tabulated_value(profile, r); }, integral, radii.back()};
+	}
+
+	auto type = _registered_profile_type(profile.name);
+	if( !type ) {
+		throw invalid_parameter("Unknown profile type " + profile.name);
+	}
+	auto parameters = std::make_shared<std::vector<double>>();
+	for(std::size_t i = 0; i != type->parameters.size(); i++) {
+		parameters->push_back(_profile_parameter(profile, type->parameters[i].c_str(), type->defaults[i]));
+	}
+	auto &t = type->type;
+	double integral = t.flux(parameters->data(), t.user_data) / (2 * M_PI);
+	double extent = t.extent(parameters->data(), t.user_data);
+	return {[type, parameters](double r) { return type->type.evaluate(r, parameters->data(), type->type.user_data); }, integral, extent};
+}
+
+struct radial_pixel_integrator {
+
+	const radial_function &f;
+	elliptical_geometry g;
+	double cos_ang, sin_ang;
+	unsigned int resolution, max_recursions;
+	double acc;
+
+	double value(double r) const {
+		return r > f.extent ? 0 : f.value(r);
+	}
+
+	/*
+	 * Mean surface brightness over a pixel of size @w x @h centred at (x, y),
+	 * whose centre is at radius @r
+	 */
+	double integrate(double x, double y, double w, double h, double r, unsigned int depth) const {
+
+		double centre = value(r);
+		if( depth == max_recursions ) {
+			return centre;
+		}
+
+		double half_diagonal = std::sqrt(w * w + h * h) / 2 / std::min(g.axrat, 1.);
+		double inner = value(std::max(r - half_diagonal, 0.));
+		double outer = value(r + half_diagonal);
+		if( std::abs(inner - outer) <= acc * std::abs(centre) && (centre != 0 || inner == outer) ) {
+			return centre;
+		}
+
+		double sub_w = w / resolution, sub_h = h / resolution, sum = 0;
+		for(unsigned int j = 0; j != resolution; j++) {
+			for(unsigned int i = 0; i != resolution; i++) {
+				double sub_x = x - w / 2 + (i + 0.5) * sub_w, sub_y = y - h / 2 + (j + 0.5) * sub_h;
+				sum += integrate(sub_x, sub_y, sub_w, sub_h, _elliptical_radius(g, cos_ang, sin_ang, sub_x, sub_y), depth + 1);
+			}
+		}
+		return sum / (resolution * resolution);
+	}
+};
+
+static const std::size_t native_pixels_per_thread = 4096;
+
+/*
+ * A native profile ready to be added to a @width x @height image whose first
+ * pixel is at pixel (x0, y0) of the model's image. Only pixels in
+ * [i0, i1) x [j0, j1) of that image are touched.
+ */
+struct native_render {
+	const profile_spec &profile;
+	std::vector<double> &image;
+	unsigned int width;
+	int x0, y0;
+	elliptical_geometry g;
+	radial_function f;
+	double norm;
+	int i0, i1, j0, j1;
+};
+
+/* Prepares @profile for rendering; returns false if it adds nothing */
+static bool _prepare_radial_profile(const model_spec &spec, native_render &r, unsigned int height) {
+
+	auto &g = r.g;
+	auto &profile = r.profile;
+	g = {
+		_profile_parameter(profile, "xcen", 0), _profile_parameter(profile, "ycen", 0),
+		_profile_parameter(profile, "ang", 0), _profile_parameter(profile, "axrat", 1),
+		_profile_parameter(profile, "box", 0)
+	};
+	if( !(g.axrat > 0 && g.axrat <= 1) ) {
+		throw invalid_parameter("axrat must be in (0, 1]");
+	}
+	if( !(g.box > -2) ) {
+		throw invalid_parameter("box must be greater than -2");
+	}
+	r.f = _radial_function(profile);
+
+	/* Area of the boxy ellipse of radius r is axrat * shape * r^2 */
+	double c = 2 + g.box;
+	double shape = 4 * std::pow(std::tgamma(1 + 1 / c), 2) / std::tgamma(1 + 2 / c);
+	double total = 2 * g.axrat * shape * r.f.integral;
+	double flux = std::pow(10, -0.4 * (_profile_parameter(profile, "mag", 15) - spec.magzero));
+	if( total == 0 || !std::isfinite(total) ) {
+		return false;
+	}
+	r.norm = flux / total * spec.scale_x * spec.scale_y;
+
+	/*
+	 * Only pixels within the function's extent are touched, which is never
+	 * further than sqrt(2) times it. Bounds are clamped to the image while
+	 * still in double, since huge extents don't fit in an int.
+	 */
+	double extent = r.f.extent * std::sqrt(2.);
+	auto clamp = [](double v, int limit) {
+		return int(std::max(0., std::min(double(limit), v)));
+	};
+	r.i0 = clamp(std::floor((g.xcen - extent) / spec.scale_x) - r.x0, int(r.width));
+	r.i1 = clamp(std::ceil((g.xcen + extent) / spec.scale_x) - r.x0 + 1, int(r.width));
+	r.j0 = clamp(std::floor((g.ycen - extent) / spec.scale_y) - r.y0, int(height));
+	r.j1 = clamp(std::ceil((g.ycen + extent) / spec.scale_y) - r.y0 + 1, int(height));
+	return r.i0 < r.i1 && r.j0 < r.j1;
+}
+
+/*
+ * Adds a prepared profile to its image. @radii holds the radius of the
+ * centres of a @grid_width wide region of the image starting at
+ * (grid_x0, grid_y0), which covers the profile's pixels.
+ */
+static void _add_radial_profile(const model_spec &spec, const native_render &r,
+                                const std::vector<double> &radii, unsigned int grid_width, int grid_x0, int grid_y0) {
+
+	auto &profile = r.profile;
+	double angrad = std::fmod(r.g.ang + 90, 360.) * M_PI / 180;
+	bool rough = _profile_parameter(profile, "rough", 0) != 0;
+	radial_pixel_integrator integrator {
+		r.f, r.g, std::cos(angrad), std::sin(angrad),
+		std::max(1u, (unsigned int)_profile_parameter(profile, "resolution", 9)),
+		rough ? 0u : (unsigned int)_profile_parameter(profile, "max_recursions", 2),
+		_profile_parameter(profile, "acc", 0.1)
+	};
+
+	auto add_rows = [&](int first, int last) {
+		for(int j = first; j < last; j++) {
+			double y = (j + r.y0 + 0.5) * spec.scale_y;
+			for(int i = r.i0; i < r.i1; i++) {
+				double x = (i + r.x0 + 0.5) * spec.scale_x;
+				double radius = radii[(i - grid_x0) + std::size_t(j - grid_y0) * grid_width];
+				r.image[i + std::size_t(j) * r.width] += r.norm * integrator.integrate(x, y, spec.scale_x, spec.scale_y, radius, 0);
+			}
+		}
+	};
+
+	/* Small stamps aren't worth starting threads for */
+	std::size_t pixels = std::size_t(r.i1 - r.i0) * (r.j1 - r.j0);
+	int threads = int(std::max<std::size_t>(1, std::min<std::size_t>({spec.omp_threads, std::size_t(r.j1 - r.j0), pixels / native_pixels_per_thread})));
+	int rows = (r.j1 - r.j0 + threads - 1) / threads;
+	std::vector<std::thread> workers;
+	for(int t = 1; t < threads; t++) {
+		workers.emplace_back(add_rows, r.j0 + t * rows, std::min(r.j1, r.j0 + (t + 1) * rows));
+	}
+	add_rows(r.j0, std::min(r.j1, r.j0 + rows));
+	for(auto &worker: workers) {
+		worker.join();
+	}
+}
+
+/*
+ * Adds all native profiles of @spec to @image. Convolved profiles are
+ * rendered on an image padded by half the PSF, so flux from just outside
+ * the image is convolved into it, as libprofit does. Profiles rendered on
+ * the same image with the same geometry share one radius grid, covering
+ * all their pixels.
+ */
+static void _add_native_profiles(const model_spec &spec, std::vector<double> &image) {
+
+	if( spec.finesampling > 1 ) {
+		throw invalid_parameter("tabulated and registered profile types don't support finesampling");
+	}
+
+	unsigned int pad_x = spec.psf_width / 2, pad_y = spec.psf_height / 2;
+	unsigned int padded_width = spec.width + 2 * pad_x, padded_height = spec.height + 2 * pad_y;
+	std::vector<double> convolved;
+	std::vector<native_render> renders;
+	std::map<std::pair<bool, elliptical_geometry>, std::vector<std::size_t>> groups;
+	for(auto &profile: spec.profiles) {
+		if( !_is_native_profile(profile.name) ) {
+			continue;
+		}
+		bool is_convolved = !spec.psf.empty() && _profile_parameter(profile, "convolve", 0) != 0;
+		if( is_convolved ) {
+			convolved.resize(std::size_t(padded_width) * padded_height);
+			renders.push_back({profile, convolved, padded_width, -int(pad_x), -int(pad_y)});
+		}
+		else {
+			renders.push_back({profile, image, spec.width, 0, 0});
+		}
+		if( !_prepare_radial_profile(spec, renders.back(), is_convolved ? padded_height : spec.height) ) {
+			renders.pop_back();
+			continue;
+		}
+		groups[std::make_pair(is_convolved, renders.back().g)].push_back(renders.size() - 1);
+	}
+
+	for(auto &group: groups) {
+		auto &members = group.second;
+		int i0 = renders[members[0]].i0, i1 = renders[members[0]].i1;
+		int j0 = renders[members[0]].j0, j1 = renders[members[0]].j1;
+		for(auto m: members) {
+			i0 = std::min(i0, renders[m].i0);
+			i1 = std::max(i1, renders[m].i1);
+			j0 = std::min(j0, renders[m].j0);
+			j1 = std::max(j1, renders[m].j1);
+		}
+
+		/* The grid starts at pixel (i0, j0) of the image, so its geometry is moved by as much */
+		auto &first = renders[members[0]];
+		elliptical_geometry g = first.g;
+		g.xcen -= (i0 + first.x0) * spec.scale_x;
+		g.ycen -= (j0 + first.y0) * spec.scale_y;
+		auto radii = _radius_grid(g, i1 - i0, j1 - j0, spec.scale_x, spec.scale_y);
+		for(auto m: members) {
+			_add_radial_profile(spec, renders[m], radii, i1 - i0, i0, j0);
+		}
+	}
+
+	if( convolved.empty() ) {
+		return;
+	}
+	convolved = _convolve_direct(convolved, padded_width, padded_height, spec.psf, spec.psf_width, spec.psf_height);
+	for(unsigned int j = 0; j != spec.height; j++) {
+		for(unsigned int i = 0; i != spec.width; i++) {
+			image[i + j * spec.width] += convolved[(i + pad_x) + (j + pad_y) * padded_width];
+		}
+	}
+}
+
+/* Outcome of fitting a compiled model */
+struct fit_result {
+	std::vector<double> values;
+	double chisq = std::numeric_limits<double>::quiet_NaN();
+	unsigned int iterations = 0;
+	bool converged = false;
+	std::string message;
+};
+
+/* A parameter of one of the profiles of a compiled model */
+struct parameter_ref {
+	std::size_t profile;
+	std::string name;
+};
+
+/*
+ * Sums @factor x @factor blocks of a @width x @height row-major matrix,
+ * which is how pixel values (integrated fluxes) combine into larger pixels.
+ * Blocks at the right and bottom edges can be incomplete.
+ */
+static std::vector<double> _bin_matrix(const std::vector<double> &values, unsigned int width, unsigned int height, unsigned int factor) {
+
+	unsigned int binned_w = (width + factor - 1) / factor, binned_h = (height + factor - 1) / factor;
+	std::vector<double> binned(std::size_t(binned_w) * binned_h);
+	for(unsigned int y = 0; y != height; y++) {
+		for(unsigned int x = 0; x != width; x++) {
+			binned[x / factor + (y / factor) * binned_w] += values[x + y * width];
+		}
+	}
+	return binned;
+}
+
+/*
+ * Bins a PSF into pixels @factor times larger, keeping its centre where it
+ * was (so the binned PSF keeps the parity of the original one). Pixels
+ * straddling two binned pixels have their value split between them by area.
+ */
+static std::vector<double> _bin_psf(const std::vector<double> &psf, unsigned int width, unsigned int height, unsigned int factor,
+                                    unsigned int &binned_w, unsigned int &binned_h) {
+
+	auto binned_size = [factor](unsigned int size) {
+		unsigned int binned = (size + factor - 1) / factor;
+		return binned % 2 == size % 2 ? binned : binned + 1;
+	};
+	binned_w = binned_size(width);
+	binned_h = binned_size(height);
+
+	/* Binned pixel containing the start of pixel @i, and the fraction of @i it gets */
+	auto split = [factor](unsigned int i, unsigned int size, unsigned int binned, unsigned int &k, double &fraction) {
+		double start = (i - size / 2.) / factor + binned / 2.;
+		k = std::min((unsigned int)std::max(std::floor(start), 0.), binned - 1);
+		fraction = std::min(std::max((k + 1 - start) * factor, 0.), 1.);
+		if( k + 1 == binned ) {
+			fraction = 1;
+		}
+	};
+
+	std::vector<double> binned(std::size_t(binned_w) * binned_h);
+	for(unsigned int y = 0; y != height; y++) {
+		unsigned int ky;
+		double fy;
+		split(y, height, binned_h, ky, fy);
+		for(unsigned int x = 0; x != width; x++) {
+			unsigned int kx;
+			double fx;
+			split(x, width, binned_w, kx, fx);
+			double value = psf[x + y * width];
+			binned[kx + ky * binned_w] += value * fx * fy;
+			if( fx < 1 ) {
+				binned[kx + 1 + ky * binned_w] += value * (1 - fx) * fy;
+			}
+			if( fy < 1 ) {
+				binned[kx + (ky + 1) * binned_w] += value * fx * (1 - fy);
+				if( fx < 1 ) {
+					binned[kx + 1 + (ky + 1) * binned_w] += value * (1 - fx) * (1 - fy);
+				}
+			}
+		}
+	}
+	return binned;
+}
+
+/*
+ * Bins data and weights like _bin_matrix. Variances (1/weight) add up, and
+ * binned pixels are only used if all the pixels they contain were.
+ */
+static void _bin_data(const std::vector<double> &data, const std::vector<double> &weights, unsigned int width, unsigned int height, unsigned int factor,
+                      std::vector<double> &binned_data, std::vector<double> &binned_weights) {
+
+	std::vector<double> variances(weights.size());
+	std::vector<double> unused(weights.size());
+	for(std::size_t i = 0; i != weights.size(); i++) {
+		variances[i] = weights[i] > 0 ? 1 / weights[i] : 0;
+		unused[i] = weights[i] > 0 ? 0 : 1;
+	}
+	unsigned int full_w = width / factor, full_h = height / factor;
+	unsigned int binned_w = (width + factor - 1) / factor;
+	binned_data = _bin_matrix(data, width, height, factor);
+	binned_weights = _bin_matrix(variances, width, height, factor);
+	auto binned_unused = _bin_matrix(unused, width, height, factor);
+	for(std::size_t i = 0; i != binned_weights.size(); i++) {
+		bool complete = (i % binned_w) < full_w && (i / binned_w) < full_h;
+		binned_weights[i] = complete && binned_unused[i] == 0 && binned_weights[i] > 0 ? 1 / binned_weights[i] : 0;
+	}
+}
+
+/*
+ * Hybrid convolution
+ *
+ * PSFs with a compact, bright core and extended, faint wings are split in
+ * two: the core is convolved directly, and exactly, while the wings are
+ * convolved on the image binned by a factor (see _bin_matrix and _bin_psf),
+ * directly or through FFTs, and spread evenly back over the pixels of each
+ * bin. The core size and binning factor are chosen, for the image size
+ * given to make_convolver, as the cheapest combination whose error stays
+ * within the user's error budget. The error is the largest relative L1
+ * error of the convolved image of a point source, over its positions
+ * within a bin, which also bounds the relative error of convolving any
+ * non-negative image.
+ */
+struct hybrid_convolver : native_convolver {
+	unsigned int psf_width = 0;
+	unsigned int psf_height = 0;
+	std::vector<double> psf;
+	double error_budget = 0;
+	/* The core, and the factors making both parts sum up to the normalised PSF */
+	std::vector<double> core;
+	unsigned int core_width = 0;
+	unsigned int core_height = 0;
+	double core_scale = 0;
+	/* The binned wings (none if factor is 0), convolved through wings_otf if planned for the image */
+	std::vector<double> wings;
+	unsigned int wings_width = 0;
+	unsigned int wings_height = 0;
+	double wings_scale = 0;
+	unsigned int factor = 0;
+	std::shared_ptr<const otf_psf> wings_otf;
+	unsigned int binned_width = 0;
+	unsigned int binned_height = 0;
+
+	void padded_size(unsigned int width, unsigned int height, unsigned int &padded_width, unsigned int &padded_height) const {
+		padded_width = width + 2 * (psf_width / 2);
+		padded_height = height + 2 * (psf_height / 2);
+	}
+
+	void convolve(std::vector<double> &image, unsigned int width, unsigned int height) const {
+
+		auto convolved = _convolve_direct(image, width, height, core, core_width, core_height);
+		for(auto &v: convolved) {
+			v *= core_scale;
+		}
+		if( factor == 0 ) {
+			image = std::move(convolved);
+			return;
+		}
+
+		unsigned int binned_w = (width + factor - 1) / factor, binned_h = (height + factor - 1) / factor;
+		auto binned = factor > 1 ? _bin_matrix(image, width, height, factor) : image;
+		std::vector<double> wings_image;
+		if( wings_otf && binned_w == binned_width && binned_h == binned_height ) {
+			unsigned int grid_w = wings_otf->width, grid_h = wings_otf->height;
+			unsigned int offset_x = (grid_w - binned_w) / 2, offset_y = (grid_h - binned_h) / 2;
+			std::vector<double> grid(std::size_t(grid_w) * grid_h);
+			for(unsigned int j = 0; j != binned_h; j++) {
+				std::copy_n(&binned[j * binned_w], binned_w, &grid[offset_x + (j + offset_y) * grid_w]);
+			}
+			wings_otf->convolve(grid, grid_w, grid_h);
+			wings_image.resize(binned.size());
+			for(unsigned int j = 0; j != binned_h; j++) {
+				std::copy_n(&grid[offset_x + (j + offset_y) * grid_w], binned_w, &wings_image[j * binned_w]);
+			}
+		}
+		else {
+			wings_image = _convolve_direct(binned, binned_w, binned_h, wings, wings_width, wings_height);
+		}
+
+		double norm = wings_scale / (factor * factor);
+		for(unsigned int y = 0; y != height; y++) {
+			for(unsigned int x = 0; x != width; x++) {
+				convolved[x + y * width] += wings_image[x / factor + (y / factor) * binned_w] * norm;
+			}
+		}
+		image = std::move(convolved);
+	}
+
+	std::string key() const {
+		std::string key("hybrid");
+		key.append(reinterpret_cast<const char *>(&psf_width), sizeof(psf_width));
+		key.append(reinterpret_cast<const char *>(&psf_height), sizeof(psf_height));
+		key.append(reinterpret_cast<const char *>(&error_budget), sizeof(error_budget));
+		key.append(reinterpret_cast<const char *>(psf.data()), psf.size() * sizeof(psf[0]));
+		return key;
+	}
+};
+
+#ifdef PYPROFIT_HAS_FFTW
+/* A size at least @n FFTW transforms quickly (a product of 2, 3, 5 and 7) */
+static unsigned int _fft_size(unsigned int n) {
+	for(;; n++) {
+		unsigned int m = n;
+		for(unsigned int p: {2, 3, 5, 7}) {
+			while( m % p == 0 ) {
+				m /= p;
+			}
+		}
+		if( m == 1 ) {
+			return n;
+		}
+	}
+}
+#endif // PYPROFIT_HAS_FFTW
+
+/* The factor by which _convolve_direct results must be scaled to use @kernel as part of a PSF adding up to @psf_sum */
+static double _kernel_scale(const std::vector<double> &kernel, double psf_sum) {
+	double sum = 0;
+	for(auto v: kernel) {
+		sum += v;
+	}
+	return (sum == 0 ? 1 : sum) / psf_sum;
+}
+
+/*
+ * The error (see hybrid_convolver) of convolving the @wings of a PSF whose
+ * absolute values add up to @psf_abs_sum, binned by @factor into @binned
+ */
+static double _hybrid_wings_error(const std::vector<double> &wings, unsigned int psf_width, unsigned int psf_height, double psf_abs_sum,
+                                  const std::vector<double> &binned, unsigned int binned_w, unsigned int binned_h, unsigned int factor) {
+
+	/* A grid large enough for the point source's image, sitting at bin (cx, cy) */
+	unsigned int grid_bw = binned_w + (psf_width + factor - 1) / factor + 4;
+	unsigned int grid_bh = binned_h + (psf_height + factor - 1) / factor + 4;
+	unsigned int grid_w = grid_bw * factor, grid_h = grid_bh * factor;
+	unsigned int cx = grid_bw / 2, cy = grid_bh / 2;
+
+	double worst = 0;
+	std::vector<double> exact(std::size_t(grid_w) * grid_h);
+	for(unsigned int py = 0; py != factor; py++) {
+		for(unsigned int px = 0; px != factor; px++) {
+			std::fill(exact.begin(), exact.end(), 0.);
+			unsigned int x0 = cx * factor + px - psf_width / 2, y0 = cy * factor + py - psf_height / 2;
+			for(unsigned int j = 0; j != psf_height; j++) {
+				for(unsigned int i = 0; i != psf_width; i++) {
+					exact[x0 + i + (y0 + j) * grid_w] = wings[i + j * psf_width];
+				}
+			}
+			double error = 0;
+			for(unsigned int y = 0; y != grid_h; y++) {
+				for(unsigned int x = 0; x != grid_w; x++) {
+					int a = int(x / factor) - int(cx) + int(binned_w / 2), b = int(y / factor) - int(cy) + int(binned_h / 2);
+					double approx = 0;
+					if( a >= 0 && a < int(binned_w) && b >= 0 && b < int(binned_h) ) {
+						approx = binned[a + b * binned_w] / (factor * factor);
+					}
+					error += std::abs(exact[x + y * grid_w] - approx);
+				}
+			}
+			worst = std::max(worst, error / psf_abs_sum);
+		}
+	}
+	return worst;
+}
+
+static std::shared_ptr<const native_convolver> _make_hybrid_convolver(const std::vector<double> &psf, unsigned int psf_width, unsigned int psf_height,
+                                                                      unsigned int width, unsigned int height, double error_budget) {
+
+	double psf_sum = 0, psf_abs_sum = 0;
+	for(auto v: psf) {
+		psf_sum += v;
+		psf_abs_sum += std::abs(v);
+	}
+	if( psf.empty() || !(psf_sum > 0) ) {
+		throw invalid_parameter("hybrid convolvers need a PSF with positive total flux");
+	}
+
+	auto hybrid = std::make_shared<hybrid_convolver>();
+	hybrid->psf = psf;
+	hybrid->psf_width = psf_width;
+	hybrid->psf_height = psf_height;
+	hybrid->error_budget = error_budget;
+	unsigned int padded_w, padded_h;
+	hybrid->padded_size(width, height, padded_w, padded_h);
+	double n_pixels = double(padded_w) * padded_h;
+
+	/* Without wings, everything is convolved directly */
+	double best_cost = n_pixels * psf.size();
+	unsigned int best_half = std::numeric_limits<unsigned int>::max(), best_factor = 0;
+	bool best_fft = false;
+
+	/* Cores are centred boxes of 2 * half + 1 pixels a side, within the PSF */
+	unsigned int half_x = psf_width / 2, half_y = psf_height / 2;
+	unsigned int max_half = std::min(std::min(half_x, psf_width - 1 - half_x), std::min(half_y, psf_height - 1 - half_y));
+	std::vector<unsigned int> halves;
+	for(unsigned int half = 0; half < max_half; half = std::max(half + 1, half * 4 / 3)) {
+		halves.push_back(half);
+	}
+
+	std::vector<double> wings;
+	for(auto half: halves) {
+		double core_cost = n_pixels * (2 * half + 1) * (2 * half + 1);
+		if( core_cost >= best_cost ) {
+			break;
+		}
+		wings = psf;
+		for(unsigned int j = half_y - half; j <= half_y + half; j++) {
+			std::fill_n(&wings[half_x - half + j * psf_width], 2 * half + 1, 0.);
+		}
+
+		for(unsigned int factor: {1, 2, 4, 8}) {
+			unsigned int binned_w, binned_h;
+			auto binned = factor > 1 ? _bin_psf(wings, psf_width, psf_height, factor, binned_w, binned_h) : wings;
+			if( factor == 1 ) {
+				binned_w = psf_width;
+				binned_h = psf_height;
+			}
+			double binned_pixels = std::ceil(double(padded_w) / factor) * std::ceil(double(padded_h) / factor);
+			double cost = core_cost + binned_pixels * binned.size() + (factor > 1 ? 2 * n_pixels : 0);
+			bool fft = false;
+#ifdef PYPROFIT_HAS_FFTW
+			double binned_sum = 0;
+			for(auto v: binned) {
+				binned_sum += v;
+			}
+			double fft_pixels = double(_fft_size((padded_w + factor - 1) / factor + binned_w)) * _fft_size((padded_h + factor - 1) / factor + binned_h);
+			double fft_cost = core_cost + 5 * fft_pixels * std::log2(fft_pixels) + fft_pixels + (factor > 1 ? 2 * n_pixels : 0);
+			if( binned_sum > 1e-12 * psf_abs_sum && fft_cost < cost ) {
+				cost = fft_cost;
+				fft = true;
+			}
+#endif // PYPROFIT_HAS_FFTW
+			if( cost >= best_cost ) {
+				continue;
+			}
+			if( factor > 1 && _hybrid_wings_error(wings, psf_width, psf_height, psf_abs_sum, binned, binned_w, binned_h, factor) > error_budget ) {
+				continue;
+			}
+			best_cost = cost;
+			best_half = half;
+			best_factor = factor;
+			best_fft = fft;
+		}
+	}
+
+	if( best_factor == 0 ) {
+		hybrid->core = psf;
+		hybrid->core_width = psf_width;
+		hybrid->core_height = psf_height;
+		hybrid->core_scale = _kernel_scale(psf, psf_sum);
+		return hybrid;
+	}
+
+	unsigned int side = 2 * best_half + 1;
+	hybrid->core.resize(side * side);
+	hybrid->core_width = hybrid->core_height = side;
+	wings = psf;
+	for(unsigned int j = 0; j != side; j++) {
+		auto row = &wings[half_x - best_half + (half_y - best_half + j) * psf_width];
+		std::copy_n(row, side, &hybrid->core[j * side]);
+		std::fill_n(row, side, 0.);
+	}
+	hybrid->core_scale = _kernel_scale(hybrid->core, psf_sum);
+	hybrid->factor = best_factor;
+	if( best_factor > 1 ) {
+		hybrid->wings = _bin_psf(wings, psf_width, psf_height, best_factor, hybrid->wings_width, hybrid->wings_height);
+	}
+	else {
+		hybrid->wings = std::move(wings);
+		hybrid->wings_width = psf_width;
+		hybrid->wings_height = psf_height;
+	}
+	hybrid->wings_scale = _kernel_scale(hybrid->wings, psf_sum);
+
+	if( best_fft ) {
+		hybrid->binned_width = (padded_w + best_factor - 1) / best_factor;
+		hybrid->binned_height = (padded_h + best_factor - 1) / best_factor;
+#ifdef PYPROFIT_HAS_FFTW
+		hybrid->wings_otf = _kernel_otf(hybrid->wings, hybrid->wings_width, hybrid->wings_height,
+		                                _fft_size(hybrid->binned_width + hybrid->wings_width),
+		                                _fft_size(hybrid->binned_height + hybrid->wings_height));
+#endif // PYPROFIT_HAS_FFTW
+	}
+	return hybrid;
+}
+
+/* The linear flux of a profile, or NaN if it can't be determined */
+static double _profile_flux(const profile_spec &profile) {
+	const char *name = profile.name == "sky" ? "bg" : "mag";
+	if( profile.name == "null" ) {
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+	for(auto &param: profile.parameters) {
+		if( param.name == name ) {
+			return profile.name == "sky" ? param.value : std::pow(10., -0.4 * param.value);
+		}
+	}
+	return std::numeric_limits<double>::quiet_NaN();
+}
+
+static bool _is_flux_parameter(const profile_spec &profile, const std::string &name) {
+	return name == (profile.name == "sky" ? "bg" : "mag");
+}
+
+struct compiled_model {
+	model_spec spec;
+	bool cache_components = false;
+	std::unique_ptr<Model> model;
+	std::vector<model_component> components;
+	std::vector<ProfilePtr> profiles;
+	std::vector<std::string> warnings;
+	std::mutex lock;
+
+	/*
+	 * Builds the model. If components are cached each profile is built into
+	 * its own profit::Model, otherwise a single one holds all profiles.
+	 * Native profiles are rejected, since likelihoods, jacobians and fits
+	 * would otherwise silently use a model without them.
+	 */
+	void build() {
+		if( _has_native_profiles(spec) ) {
+			throw invalid_parameter("tabulated and registered profile types are only supported by make_model, make_models and the evaluation server's one-off evaluations");
+		}
+		warnings.clear();
+		profiles.clear();
+		components.clear();
+		bands.clear();
+		model.reset();
+		if( !cache_components || spec.profiles.empty() ) {
+			model.reset(new Model());
+			_build_model(spec, *model, warnings, &profiles);
+			return;
+		}
+
+		model_spec component_spec(spec);
+		for(auto &profile: spec.profiles) {
+			component_spec.profiles.assign(1, profile);
+			model_component component;
+			component.model.reset(new Model());
+			_build_model(component_spec, *component.model, warnings, &profiles);
+			components.push_back(std::move(component));
+		}
+	}
+
+	/*
+	 * Returns the cached image of a component, evaluating it again only if
+	 * needed. The image must be multiplied by @scale to account for flux
+	 * changes since it was evaluated.
+	 */
+	const Image &component_image(std::size_t i, double &scale) {
+
+		auto &component = components[i];
+		double flux = _profile_flux(spec.profiles[i]);
+		scale = 1;
+		if( component.dirty ) {
+			component.image = component.model->evaluate(component.offset);
+			component.rendered_flux = flux;
+			component.dirty = false;
+		}
+		else if( !std::isnan(flux) && !std::isnan(component.rendered_flux) ) {
+			if( component.rendered_flux != 0 ) {
+				scale = flux / component.rendered_flux;
+			}
+			else if( flux != 0 ) {
+				component.image = component.model->evaluate(component.offset);
+				component.rendered_flux = flux;
+			}
+		}
+		return component.image;
+	}
+
+	Image evaluate(Point &offset) {
+
+		if( model ) {
+			return model->evaluate(offset);
+		}
+
+		Image result;
+		bool first = true;
+		for(std::size_t i = 0; i != components.size(); i++) {
+
+			if( !profiles[i] ) {
+				continue;
+			}
+
+			double scale;
+			auto &image = component_image(i, scale);
+			if( first ) {
+				result = Image(std::vector<double>(image.size()), image.getWidth(), image.getHeight());
+				offset = components[i].offset;
+				first = false;
+			}
+			for(std::size_t j = 0; j != result.size(); j++) {
+				result[j] += scale * image[j];
+			}
+		}
+
+		if( first ) {
+			throw invalid_parameter("None of the model profiles could be evaluated");
+		}
+		return result;
+	}
+
+	/*
+	 * Data for likelihood calculations. Weights are 1/sigma^2, or 0 for
+	 * pixels that should not be considered.
+	 */
+	std::vector<double> data;
+	std::vector<double> weights;
+
+	void check_data(const Image &image) const {
+		if( data.empty() ) {
+			throw invalid_parameter("No data has been set for this model");
+		}
+		if( image.size() != data.size() ) {
+			throw invalid_parameter("Model image and data dimensions differ");
+		}
+	}
+
+	double chisq(const Image &image) const {
+		check_data(image);
+		double chisq = 0;
+		for(std::size_t i = 0; i != data.size(); i++) {
+			double diff = data[i] - image[i];
+			chisq += weights[i] * diff * diff;
+		}
+		return chisq;
+	}
+
+	/* Gaussian log-likelihood of the data given the model, up to a constant */
+	double likelihood() {
+		Point offset;
+		return -0.5 * chisq(evaluate(offset));
+	}
+
+	/*
+	 * Like likelihood(), but returns as soon as the log-likelihood is known
+	 * to be below @threshold, in which case @aborted is set and the
+	 * returned value is an upper bound of the actual log-likelihood.
+	 *
+	 * The model is evaluated in bands of rows, each band grown by the PSF
+	 * half-height so convolution near its edges is exact, and chi-square
+	 * (which only grows) is accumulated after each band. Each band is its
+	 * own model, cropped to the band and with its profiles moved along,
+	 * built once and kept up to date by set_parameter, so a full likelihood
+	 * costs about one evaluation plus the halos. Bands with most weighted
+	 * data are visited first, since that's where mismatching models usually
+	 * accumulate most of their chi-square.
+	 *
+	 * Models with a single band, with an explicit convolver (which is sized
+	 * for the whole image) or caching their components (which bands would
+	 * bypass) are evaluated in full instead.
+	 */
+	std::vector<likelihood_band> bands;
+
+	unsigned int band_height() const {
+		return std::max({1u, 2 * spec.psf_height, (spec.height + 7) / 8});
+	}
+
+	void build_bands() {
+
+		bands.clear();
+		unsigned int halo = spec.psf_height / 2 + 1;
+		for(unsigned int y0 = 0; y0 < spec.height; y0 += band_height()) {
+
+			likelihood_band band;
+			band.y0 = y0;
+			band.y1 = std::min(y0 + band_height(), spec.height);
+			band.rows_y0 = y0 > halo ? y0 - halo : 0;
+			band.rows_y1 = std::min(band.y1 + halo, spec.height);
+
+			model_spec band_spec(spec);
+			band_spec.height = band.rows_y1 - band.rows_y0;
+			if( !spec.calcmask.empty() ) {
+				auto first = spec.calcmask.begin() + std::size_t(band.rows_y0) * spec.width;
+				band_spec.calcmask.assign(first, first + std::size_t(band_spec.height) * spec.width);
+			}
+			for(auto &profile: band_spec.profiles) {
+				if( !_has_centre(profile.name) ) {
+					continue;
+				}
+				auto it = std::find_if(profile.parameters.begin(), profile.parameters.end(), [](const profile_parameter &p) {
+					return p.name == "ycen";
+				});
+				if( it != profile.parameters.end() ) {
+					it->value = band_ycen(band, it->value);
+				}
+				else {
+					profile.parameters.push_back({"ycen", profile_parameter::DOUBLE, band_ycen(band, 0)});
+				}
+			}
+
+			band.model.reset(new Model());
+			std::vector<std::string> band_warnings;
+			_build_model(band_spec, *band.model, band_warnings, &band.profiles);
+			bands.push_back(std::move(band));
+		}
+	}
+
+	double band_ycen(const likelihood_band &band, double ycen) const {
+		return ycen - band.rows_y0 * spec.scale_y;
+	}
+
+	double likelihood(double threshold, bool &aborted) {
+
+		aborted = false;
+		if( data.empty() ) {
+			throw invalid_parameter("No data has been set for this model");
+		}
+		std::size_t model_pixels = std::size_t(spec.width) * spec.height;
+		unsigned int factor = data.size() == model_pixels ? 1 : spec.finesampling;
+		if( data.size() != model_pixels * factor * factor ) {
+			throw invalid_parameter("Model image and data dimensions differ");
+		}
+		if( spec.convolver || cache_components || spec.height <= band_height() ) {
+			return likelihood();
+		}
+		if( bands.empty() ) {
+			build_bands();
+		}
+		unsigned int data_width = spec.width * factor;
+
+		/* Bands by decreasing weighted data */
+		std::vector<std::pair<double, std::size_t>> order;
+		for(std::size_t b = 0; b != bands.size(); b++) {
+			double weighted = 0;
+			auto end = std::size_t(bands[b].y1) * factor * data_width;
+			for(auto j = std::size_t(bands[b].y0) * factor * data_width; j != end; j++) {
+				weighted += weights[j] * data[j] * data[j];
+			}
+			order.emplace_back(-weighted, b);
+		}
+		std::sort(order.begin(), order.end());
+
+		double chisq = 0;
+		for(auto &entry: order) {
+
+			auto &band = bands[entry.second];
+			Point offset;
+			Image image = band.model->evaluate(offset);
+			auto image_start = std::size_t(band.rows_y0) * factor * data_width;
+			if( image.size() != std::size_t(band.rows_y1 - band.rows_y0) * factor * data_width ) {
+				throw invalid_parameter("Model image and data dimensions differ");
+			}
+			for(auto j = std::size_t(band.y0) * factor * data_width; j != std::size_t(band.y1) * factor * data_width; j++) {
+				double diff = data[j] - image[j - image_start];
+				chisq += weights[j] * diff * diff;
+			}
+			if( -0.5 * chisq < threshold ) {
+				aborted = true;
+				break;
+			}
+		}
+
+		return -0.5 * chisq;
+	}
+
+	/*
+	 * Profiled log-likelihood where the flux of every profile (its mag, or
+	 * bg for sky profiles) is not taken from the model but solved for. Each
+	 * profile is evaluated at unit flux and the weighted linear least squares
+	 * problem for all fluxes solved. The best magnitude (or background) of
+	 * each profile is stored in @fluxes, or NaN if the profile has no flux
+	 * or the best flux is not positive. The model parameters are left
+	 * untouched.
+	 */
+	double solve_linear(std::vector<double> &fluxes) {
+
+		ensure_components();
+
+		/* Unit-flux images for linear profiles, fixed image for the rest */
+		std::vector<std::size_t> linear;
+		std::vector<std::pair<const Image *, double>> unit_images;
+		std::vector<double> original;
+		std::vector<double> fixed;
+		for(std::size_t i = 0; i != components.size(); i++) {
+			if( !profiles[i] ) {
+				continue;
+			}
+			auto &profile = spec.profiles[i];
+			bool is_linear = !std::isnan(_profile_flux(profile));
+			const char *flux_name = profile.name == "sky" ? "bg" : "mag";
+			if( is_linear ) {
+				auto param = std::find_if(profile.parameters.begin(), profile.parameters.end(), [flux_name](const profile_parameter &p) {
+					return p.name == flux_name;
+				});
+				original.push_back(param->value);
+				set_parameter(i, flux_name, profile.name == "sky" ? 1. : spec.magzero);
+			}
+			double scale;
+			auto &image = component_image(i, scale);
+			if( is_linear ) {
+				linear.push_back(i);
+				unit_images.emplace_back(&image, scale);
+			}
+			else {
+				fixed.resize(image.size());
+				for(std::size_t j = 0; j != image.size(); j++) {
+					fixed[j] += scale * image[j];
+				}
+			}
+		}
+		for(std::size_t k = 0; k != linear.size(); k++) {
+			set_parameter(linear[k], spec.profiles[linear[k]].name == "sky" ? "bg" : "mag", original[k]);
+		}
+		if( unit_images.empty() ) {
+			throw invalid_parameter("Model has no profiles with a linear flux");
+		}
+		check_data(*unit_images[0].first);
+		if( fixed.empty() ) {
+			fixed.resize(data.size());
+		}
+
+		/* Normal equations A x = b */
+		auto n = unit_images.size();
+		std::vector<double> A(n * n), b(n);
+		for(std::size_t k = 0; k != n; k++) {
+			auto &uk = *unit_images[k].first;
+			double sk = unit_images[k].second;
+			for(std::size_t l = k; l != n; l++) {
+				auto &ul = *unit_images[l].first;
+				double sl = unit_images[l].second;
+				double sum = 0;
+				for(std::size_t j = 0; j != data.size(); j++) {
+					sum += weights[j] * uk[j] * ul[j];
+				}
+				A[k * n + l] = A[l * n + k] = sum * sk * sl;
+			}
+			double sum = 0;
+			for(std::size_t j = 0; j != data.size(); j++) {
+				sum += weights[j] * uk[j] * (data[j] - fixed[j]);
+			}
+			b[k] = sum * sk;
+		}
+
+		auto x = _solve_linear_system(A, b, n);
+
+		/* Profiled chi-square and best fluxes */
+		double chisq = 0;
+		for(std::size_t j = 0; j != data.size(); j++) {
+			double model_value = fixed[j];
+			for(std::size_t k = 0; k != n; k++) {
+				model_value += x[k] * unit_images[k].second * (*unit_images[k].first)[j];
+			}
+			double diff = data[j] - model_value;
+			chisq += weights[j] * diff * diff;
+		}
+
+		fluxes.assign(spec.profiles.size(), std::numeric_limits<double>::quiet_NaN());
+		for(std::size_t k = 0; k != n; k++) {
+			if( spec.profiles[linear[k]].name == "sky" ) {
+				fluxes[linear[k]] = x[k];
+			}
+			else if( x[k] > 0 ) {
+				fluxes[linear[k]] = spec.magzero - 2.5 * std::log10(x[k]);
+			}
+		}
+
+		return -0.5 * chisq;
+	}
+
+	/* Switches to per-component evaluation, needed for per-profile images */
+	void ensure_components() {
+		if( !cache_components ) {
+			cache_components = true;
+			build();
+		}
+	}
+
+	/* Looks up the @index-th profile of type @profile_name */
+	std::size_t resolve_profile(const std::string &profile_name, std::size_t index) const {
+		for(std::size_t i = 0; i != spec.profiles.size(); i++) {
+			if( spec.profiles[i].name == profile_name && index-- == 0 ) {
+				return i;
+			}
+		}
+		std::ostringstream os;
+		os << "Model doesn't have enough " << profile_name << " profiles";
+		throw invalid_parameter(os.str());
+	}
+
+	/*
+	 * Looks up the @index-th profile of type @profile_name and checks that
+	 * @name is one of its explicitly-set, real-valued parameters.
+	 */
+	parameter_ref resolve_parameter(const std::string &profile_name, std::size_t index, const std::string &name) const {
+
+		auto i = resolve_profile(profile_name, index);
+		auto &params = spec.profiles[i].parameters;
+		auto it = std::find_if(params.begin(), params.end(), [&name](const profile_parameter &p) {
+			return p.name == name;
+		});
+		if( it == params.end() || it->kind != profile_parameter::DOUBLE ) {
+			std::ostringstream os;
+			os << "Parameter " << name << " of " << profile_name << " profile must be set explicitly to a real value";
+			throw invalid_parameter(os.str());
+		}
+		return {i, name};
+	}
+
+	double parameter_value(const parameter_ref &ref) const {
+		for(auto &param: spec.profiles[ref.profile].parameters) {
+			if( param.name == ref.name ) {
+				return param.value;
+			}
+		}
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+
+	/*
+	 * Evaluates component @i with parameter @name temporarily set to
+	 * @value, leaving the component and its cached image as they were.
+	 */
+	void component_variant(std::size_t i, const std::string &name, double value, std::vector<double> &out) {
+
+		auto &component = components[i];
+		double original = parameter_value({i, name});
+		Image saved_image = component.image;
+		double saved_flux = component.rendered_flux;
+		bool saved_dirty = component.dirty;
+
+		set_parameter(i, name, value);
+		double scale;
+		auto &image = component_image(i, scale);
+		out.resize(image.size());
+		for(std::size_t j = 0; j != image.size(); j++) {
+			out[j] = scale * image[j];
+		}
+
+		set_parameter(i, name, original);
+		component.image = std::move(saved_image);
+		component.rendered_flux = saved_flux;
+		component.dirty = saved_dirty;
+	}
+
+	/*
+	 * Profiles must be rendered with the same subsampling at every step of
+	 * a finite difference, or the difference picks up the jumps between
+	 * subsampling settings rather than the change of the profile. Explicit
+	 * settings (rough, resolution, max_recursions, acc) are never changed
+	 * by set_parameter, but libprofit adjusts acc and rscale_switch to the
+	 * parameters of each evaluation unless told otherwise, so adjust is
+	 * turned off for differentiated profiles that don't set it themselves.
+	 */
+	void fix_subsampling(const std::vector<parameter_ref> &refs) {
+		for(auto &ref: refs) {
+			auto &profile = spec.profiles[ref.profile];
+			if( _has_subsampling(profile.name) && std::isnan(_profile_parameter(profile, "adjust", std::numeric_limits<double>::quiet_NaN())) ) {
+				set_parameter(ref.profile, "adjust", 0);
+			}
+		}
+	}
+
+	/*
+	 * Derivative of the model image with respect to a parameter. Only the
+	 * profile owning the parameter is evaluated again. Magnitudes and sky
+	 * backgrounds enter the image linearly and are differentiated exactly;
+	 * other parameters use forward differences against the cached image of
+	 * the profile, with a step of @step relative to the parameter value
+	 * (absolute for values below 1), so each costs a single evaluation.
+	 * Subsampling must have been fixed with fix_subsampling.
+	 */
+	void derivative(const parameter_ref &ref, double step, std::vector<double> &out) {
+
+		auto i = ref.profile;
+		auto &profile = spec.profiles[i];
+		if( _is_flux_parameter(profile, ref.name) && profile.name != "sky" ) {
+			double scale;
+			auto &image = component_image(i, scale);
+			const double factor = -0.4 * std::log(10.) * scale;
+			out.resize(image.size());
+			for(std::size_t j = 0; j != image.size(); j++) {
+				out[j] = factor * image[j];
+			}
+			return;
+		}
+		if( _is_flux_parameter(profile, ref.name) ) {
+			component_variant(i, ref.name, 1, out);
+			return;
+		}
+
+		double value = parameter_value(ref);
+		double h = step * std::max(std::abs(value), 1.);
+		component_variant(i, ref.name, value + h, out);
+		double scale;
+		auto &image = component_image(i, scale);
+		for(std::size_t j = 0; j != out.size(); j++) {
+			out[j] = (out[j] - scale * image[j]) / h;
+		}
+	}
+
+	/* Evaluates the model, and its derivatives with respect to @refs */
+	Image jacobian(const std::vector<parameter_ref> &refs, double step, Point &offset, std::vector<std::vector<double>> &derivatives) {
+		ensure_components();
+		fix_subsampling(refs);
+		Image image = evaluate(offset);
+		derivatives.resize(refs.size());
+		for(std::size_t k = 0; k != refs.size(); k++) {
+			if( profiles[refs[k].profile] ) {
+				derivative(refs[k], step, derivatives[k]);
+			}
+			else {
+				derivatives[k].assign(image.size(), 0);
+			}
+		}
+		return image;
+	}
+
+	/*
+	 * Region of the image where component @i is larger than @threshold
+	 * times its peak absolute value, grown by the PSF half-size plus one
+	 * pixel so it also covers small shifts and shape changes. A negative
+	 * @threshold selects the whole image.
+	 */
+	image_stamp component_support(std::size_t i, double threshold) {
+
+		double scale;
+		auto &image = component_image(i, scale);
+		unsigned int width = image.getWidth(), height = image.getHeight();
+		image_stamp box;
+		if( threshold < 0 ) {
+			box.width = width;
+			box.height = height;
+			return box;
+		}
+
+		double peak = 0;
+		for(std::size_t j = 0; j != image.size(); j++) {
+			peak = std::max(peak, std::abs(image[j]));
+		}
+
+		if( peak == 0 ) {
+			return box;
+		}
+		unsigned int x0 = width, y0 = height, x1 = 0, y1 = 0;
+		for(unsigned int y = 0; y != height; y++) {
+			for(unsigned int x = 0; x != width; x++) {
+				if( std::abs(image[x + y * width]) > threshold * peak ) {
+					x0 = std::min(x0, x);
+					y0 = std::min(y0, y);
+					x1 = std::max(x1, x + 1);
+					y1 = std::max(y1, y + 1);
+				}
+			}
+		}
+		if( x1 == 0 ) {
+			return box;
+		}
+
+		unsigned int factor = spec.width ? width / spec.width : 1;
+		unsigned int margin = (std::max(spec.psf_width, spec.psf_height) / 2 + 1) * factor;
+		box.x0 = x0 > margin ? x0 - margin : 0;
+		box.y0 = y0 > margin ? y0 - margin : 0;
+		box.width = std::min(width, x1 + margin) - box.x0;
+		box.height = std::min(height, y1 + margin) - box.y0;
+		return box;
+	}
+
+	/*
+	 * Like jacobian(), but each derivative is only calculated and returned
+	 * within the support of its profile (see component_support). Forward
+	 * differences are evaluated by a single-profile model whose calculation
+	 * mask is restricted to that region, so cost scales with the size of
+	 * the profile rather than that of the image. Its unperturbed image is
+	 * evaluated once and shared by all parameters of the profile.
+	 */
+	Image sparse_jacobian(const std::vector<parameter_ref> &refs, double step, double threshold, Point &offset, std::vector<image_stamp> &derivatives) {
+
+		ensure_components();
+		fix_subsampling(refs);
+		Image image = evaluate(offset);
+		unsigned int width = image.getWidth();
+		unsigned int factor = spec.width ? width / spec.width : 1;
+
+		/* Single-profile, masked models, shared by all parameters of a profile */
+		std::map<std::size_t, std::tuple<std::unique_ptr<Model>, ProfilePtr, image_stamp, Image>> stamp_models;
+
+		derivatives.resize(refs.size());
+		for(std::size_t k = 0; k != refs.size(); k++) {
+
+			auto &ref = refs[k];
+			auto &out = derivatives[k];
+			auto i = ref.profile;
+			if( !profiles[i] ) {
+				out = image_stamp();
+				continue;
+			}
+
+			auto &profile = spec.profiles[i];
+			bool is_flux = _is_flux_parameter(profile, ref.name);
+			auto found = stamp_models.find(i);
+			if( found == stamp_models.end() ) {
+				/* Sky profiles cover the whole image */
+				auto box = component_support(i, profile.name == "sky" ? -1 : threshold);
+				std::unique_ptr<Model> stamp_model;
+				std::vector<ProfilePtr> stamp_profiles;
+				Image stamp_base;
+				if( box.width && profile.name != "sky" ) {
+					model_spec stamp_spec(spec);
+					stamp_spec.profiles.assign(1, profile);
+					std::vector<bool> calcmask(spec.width * spec.height, false);
+					for(unsigned int y = box.y0 / factor; y < (box.y0 + box.height + factor - 1) / factor; y++) {
+						for(unsigned int x = box.x0 / factor; x < (box.x0 + box.width + factor - 1) / factor; x++) {
+							auto idx = x + y * spec.width;
+							calcmask[idx] = spec.calcmask.empty() || spec.calcmask[idx];
+						}
+					}
+					stamp_spec.calcmask = std::move(calcmask);
+					stamp_model.reset(new Model());
+					_build_model(stamp_spec, *stamp_model, warnings, &stamp_profiles);
+					Point stamp_offset;
+					stamp_base = stamp_model->evaluate(stamp_offset);
+				}
+				found = stamp_models.emplace(i, std::make_tuple(std::move(stamp_model), stamp_profiles.empty() ? ProfilePtr() : stamp_profiles[0], box, std::move(stamp_base))).first;
+			}
+
+			auto &stamp_model = std::get<0>(found->second);
+			auto &stamp_profile = std::get<1>(found->second);
+			auto &stamp_base = std::get<3>(found->second);
+			out = std::get<2>(found->second);
+			out.values.assign(std::size_t(out.width) * out.height, 0);
+			if( !out.width ) {
+				continue;
+			}
+
+			/* Flux parameters: exact derivatives, as in derivative() */
+			if( is_flux ) {
+				std::vector<double> full;
+				derivative(ref, step, full);
+				for(unsigned int y = 0; y != out.height; y++) {
+					for(unsigned int x = 0; x != out.width; x++) {
+						out.values[x + y * out.width] = full[out.x0 + x + (out.y0 + y) * width];
+					}
+				}
+				continue;
+			}
+
+			double value = parameter_value(ref);
+			double h = step * std::max(std::abs(value), 1.);
+			Point stamp_offset;
+			_apply_parameter(*stamp_profile, {ref.name, profile_parameter::DOUBLE, value + h});
+			Image upper = stamp_model->evaluate(stamp_offset);
+			_apply_parameter(*stamp_profile, {ref.name, profile_parameter::DOUBLE, value});
+			for(unsigned int y = 0; y != out.height; y++) {
+				for(unsigned int x = 0; x != out.width; x++) {
+					auto idx = out.x0 + x + (out.y0 + y) * width;
+					out.values[x + y * out.width] = (upper[idx] - stamp_base[idx]) / h;
+				}
+			}
+		}
+
+		return image;
+	}
+
+	/*
+	 * Fits @refs to the data using Levenberg-Marquardt, starting from their
+	 * current values and keeping them within [@lower, @upper]. Steps leaving
+	 * the bounds are clamped to them. Convergence is declared when an
+	 * accepted step improves chi-square by less than @tolerance relative to
+	 * its value, or when no step improving it can be found. The model is
+	 * left at the best parameters found.
+	 */
+	fit_result fit(const std::vector<parameter_ref> &refs, const std::vector<double> &lower, const std::vector<double> &upper,
+	               unsigned int max_iterations, double tolerance) {
+
+		auto n = refs.size();
+		fit_result result;
+		result.values.resize(n);
+		for(std::size_t k = 0; k != n; k++) {
+			result.values[k] = std::min(std::max(parameter_value(refs[k]), lower[k]), upper[k]);
+			set_parameter(refs[k].profile, refs[k].name, result.values[k]);
+		}
+
+		Point offset;
+		std::vector<std::vector<double>> derivatives;
+		Image image = jacobian(refs, 1e-4, offset, derivatives);
+		result.chisq = chisq(image);
+
+		double lambda = 1e-3;
+		std::vector<double> A(n * n), g(n), trial(n);
+		while( result.iterations < max_iterations && !result.converged ) {
+
+			result.iterations++;
+
+			/* Normal equations of the linearised problem */
+			for(std::size_t k = 0; k != n; k++) {
+				auto &dk = derivatives[k];
+				for(std::size_t l = k; l != n; l++) {
+					auto &dl = derivatives[l];
+					double sum = 0;
+					for(std::size_t j = 0; j != data.size(); j++) {
+						sum += weights[j] * dk[j] * dl[j];
+					}
+					A[k * n + l] = A[l * n + k] = sum;
+				}
+				double sum = 0;
+				for(std::size_t j = 0; j != data.size(); j++) {
+					sum += weights[j] * dk[j] * (data[j] - image[j]);
+				}
+				g[k] = sum;
+			}
+
+			bool accepted = false;
+			while( !accepted && lambda < 1e10 ) {
+				std::vector<double> damped(A), rhs(g);
+				for(std::size_t k = 0; k != n; k++) {
+					damped[k * n + k] += lambda * (A[k * n + k] > 0 ? A[k * n + k] : 1);
+				}
+				auto step = _solve_linear_system(damped, rhs, n);
+				for(std::size_t k = 0; k != n; k++) {
+					trial[k] = std::min(std::max(result.values[k] + step[k], lower[k]), upper[k]);
+					set_parameter(refs[k].profile, refs[k].name, trial[k]);
+				}
+
+				Point trial_offset;
+				double trial_chisq = chisq(evaluate(trial_offset));
+				if( trial_chisq < result.chisq ) {
+					result.converged = result.chisq - trial_chisq <= tolerance * result.chisq;
+					result.chisq = trial_chisq;
+					result.values = trial;
+					lambda = std::max(lambda / 10, 1e-12);
+					accepted = true;
+				}
+				else {
+					lambda *= 10;
+				}
+			}
+
+			if( !accepted ) {
+				for(std::size_t k = 0; k != n; k++) {
+					set_parameter(refs[k].profile, refs[k].name, result.values[k]);
+				}
+				result.converged = true;
+			}
+			else if( !result.converged && result.iterations < max_iterations ) {
+				image = jacobian(refs, 1e-4, offset, derivatives);
+			}
+		}
+
+		return result;
+	}
+
+	/*
+	 * Multi-resolution evaluation. At level k > 0 the model is evaluated by
+	 * @coarse, a copy of this model with 2^k times larger pixels and a
+	 * correspondingly binned PSF, whose data is this model's binned in
+	 * 2^k x 2^k blocks.
+	 * libprofit integrates the profiles over the larger pixels, so coarse
+	 * likelihoods are consistent with full-resolution ones. Parameter
+	 * updates are forwarded to the coarse model.
+	 */
+	unsigned int level = 0;
+	std::unique_ptr<compiled_model> coarse;
+
+	compiled_model &active() {
+		return level ? *coarse : *this;
+	}
+
+	void set_level(unsigned int new_level) {
+
+		unsigned int factor = 1u << new_level;
+		if( factor > spec.width || factor > spec.height ) {
+			throw invalid_parameter("Level is too coarse for the model's dimensions");
+		}
+		if( new_level == level ) {
+			return;
+		}
+		level = 0;
+		coarse.reset();
+		if( !new_level ) {
+			return;
+		}
+
+		std::unique_ptr<compiled_model> binned(new compiled_model());
+		auto &coarse_spec = binned->spec;
+		coarse_spec = spec;
+		coarse_spec.width = (spec.width + factor - 1) / factor;
+		coarse_spec.height = (spec.height + factor - 1) / factor;
+		coarse_spec.scale_x *= factor;
+		coarse_spec.scale_y *= factor;
+		if( !spec.psf.empty() ) {
+			coarse_spec.psf = _bin_psf(spec.psf, spec.psf_width, spec.psf_height, factor, coarse_spec.psf_width, coarse_spec.psf_height);
+			coarse_spec.psf_scale_x *= factor;
+			coarse_spec.psf_scale_y *= factor;
+		}
+		if( !spec.calcmask.empty() ) {
+			std::vector<double> mask(spec.calcmask.begin(), spec.calcmask.end());
+			auto binned_mask = _bin_matrix(mask, spec.width, spec.height, factor);
+			coarse_spec.calcmask.assign(binned_mask.size(), false);
+			for(std::size_t i = 0; i != binned_mask.size(); i++) {
+				coarse_spec.calcmask[i] = binned_mask[i] > 0;
+			}
+		}
+
+		/* Convolvers are tied to a PSF and image size */
+		coarse_spec.convolver = nullptr;
+
+		/* Sky backgrounds are given per full-resolution pixel */
+		coarse_spec.bg_scale = spec.bg_scale * factor * factor;
+
+		binned->cache_components = cache_components;
+		binned->build();
+		coarse = std::move(binned);
+		level = new_level;
+		bin_data();
+	}
+
+	/* Sets the data, binning it for the coarse model if needed */
+	void set_data(std::vector<double> &&new_data, std::vector<double> &&new_weights) {
+		data = std::move(new_data);
+		weights = std::move(new_weights);
+		bin_data();
+	}
+
+	void bin_data() {
+		if( !coarse || data.empty() ) {
+			return;
+		}
+		std::size_t model_pixels = std::size_t(spec.width) * spec.height;
+		unsigned int output_factor = data.size() == model_pixels ? 1 : spec.finesampling;
+		_bin_data(data, weights, spec.width * output_factor, spec.height * output_factor, 1u << level,
+		          coarse->data, coarse->weights);
+	}
+
+	/*
+	 * Updates a parameter of an existing profile, both in the specification
+	 * and in the underlying profit::Profile, without rebuilding the model
+	 */
+	void set_parameter(std::size_t profile_idx, const std::string &name, double value) {
+
+		if( profile_idx >= spec.profiles.size() ) {
+			throw invalid_parameter("profile index out of range");
+		}
+
+		auto &profile = spec.profiles[profile_idx];
+		auto &params = profile.parameters;
+		auto it = std::find_if(params.begin(), params.end(), [&name](const profile_parameter &p) {
+			return p.name == name;
+		});
+		profile_parameter param {name, it != params.end() ? it->kind : _parameter_kind(name), value};
+		if( profiles[profile_idx] ) {
+			_apply_parameter(*profiles[profile_idx], param, spec.bg_scale);
+		}
+		if( coarse ) {
+			coarse->set_parameter(profile_idx, name, value);
+		}
+		for(auto &band: bands) {
+			if( band.profiles[profile_idx] ) {
+				bool shifted = name == "ycen" && _has_centre(profile.name);
+				_apply_parameter(*band.profiles[profile_idx], {name, param.kind, shifted ? band_ycen(band, value) : value}, spec.bg_scale);
+			}
+		}
+
+		/* Flux changes are handled by rescaling the cached component image */
+		bool flux_only = _is_flux_parameter(profile, name) && it != params.end();
+		if( !components.empty() && !flux_only ) {
+			components[profile_idx].dirty = true;
+		}
+
+		if( it != params.end() ) {
+			it->value = value;
+		}
+		else {
+			params.push_back(std::move(param));
+		}
+	}
+};
+
+typedef struct {
+	PyObject_HEAD
+	std::shared_ptr<compiled_model> compiled;
+	PyObject *convolver;
+	PyObject *openclenv;
+} PyModel;
+
+/* Version of the pickled state of compiled models */
+static const unsigned int PYPROFIT_MODEL_STATE_VERSION = 3;
+
+static void model_dealloc(PyModel *self) {
+	self->compiled.reset();
+	Py_XDECREF(self->convolver);
+	Py_XDECREF(self->openclenv);
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyTypeObject PyModel_Type = {
+#if PY_MAJOR_VERSION >= 3
+	PyVarObject_HEAD_INIT(NULL, 0)
+#else
+	PyObject_HEAD_INIT(NULL)
+	0,                             /*ob_size*/
+#endif
+	"pyprofit.model",              /*tp_name*/
+	sizeof(PyModel),               /*tp_basicsize*/
+};
+
+#ifdef PYPROFIT_HAS_ATFORK
+
+/*
+ * Fork safety
+ *
+ * Forking while another thread holds one of our locks leaves it locked
+ * forever in the child. The atfork handlers below take all global locks
+ * and the lock of every live compiled model before forking, and release
+ * them afterwards in both the parent and the child. fork() therefore
+ * blocks until in-flight evaluations and fits on other threads finish.
+ * The forking thread holds the GIL, so model locks are only ever taken
+ * with the GIL released, and never held while waiting for it. Caches
+ * (subsampling calibrations, compiled models, convolvers) are plain memory
+ * and reach the child through copy-on-write, warm. Thread pools owned by
+ * libprofit's dependencies (OpenMP, threaded FFTW) are outside of our
+ * control.
+ */
+static std::mutex fork_models_lock;
+static std::vector<std::weak_ptr<compiled_model>> fork_models;
+static std::vector<std::shared_ptr<compiled_model>> fork_locked_models;
+
+static void _track_for_fork(const std::shared_ptr<compiled_model> &compiled) {
+	std::lock_guard<std::mutex> guard(fork_models_lock);
+	fork_models.erase(std::remove_if(fork_models.begin(), fork_models.end(), [](const std::weak_ptr<compiled_model> &m) {
+		return m.expired();
+	}), fork_models.end());
+	fork_models.push_back(compiled);
+}
+
+static void _fork_prepare() {
+	fork_models_lock.lock();
+	for(auto &weak: fork_models) {
+		auto compiled = weak.lock();
+		if( compiled ) {
+			compiled->lock.lock();
+			fork_locked_models.push_back(std::move(compiled));
+		}
+	}
+	profile_types_lock.lock();
+	subsampling_cache_lock.lock();
+#ifdef PYPROFIT_HAS_FFTW
+	fftw_planner_lock.lock();
+#endif // PYPROFIT_HAS_FFTW
+}
+
+static void _fork_release() {
+#ifdef PYPROFIT_HAS_FFTW
+	fftw_planner_lock.unlock();
+#endif // PYPROFIT_HAS_FFTW
+	subsampling_cache_lock.unlock();
+	profile_types_lock.unlock();
+	for(auto it = fork_locked_models.rbegin(); it != fork_locked_models.rend(); it++) {
+		(*it)->lock.unlock();
+	}
+	fork_locked_models.clear();
+	fork_models_lock.unlock();
+}
+
+#endif // PYPROFIT_HAS_ATFORK
+
+/*
+ * Finishes the initialisation of a compiled model whose specification has
+ * already been set
+ */
+static bool _setup_model(PyModel *self, PyObject *convolver, PyObject *openclenv) {
+
+	if( convolver == Py_None ) {
+		convolver = NULL;
+	}
+	if( openclenv == Py_None ) {
+		openclenv = NULL;
+	}
+	if( convolver && !PyObject_TypeCheck(convolver, &PyConvolver_Type) ) {
+		PyErr_SetString(profit_error, "Given convolver is not of type pyprofit.convolver");
+		return false;
+	}
+	if( convolver && ((PyConvolver *)convolver)->native ) {
+		PyErr_SetString(profit_error, "OTF and hybrid convolvers are only supported by make_model and make_models");
+		return false;
+	}
+	if( openclenv && !PyObject_TypeCheck(openclenv, &PyOpenCLEnv_Type) ) {
+		PyErr_SetString(profit_error, "Given openclenv is not of type pyprofit.openclenv");
+		return false;
+	}
+
+	auto &spec = self->compiled->spec;
+	Py_XINCREF(convolver);
+	Py_XDECREF(self->convolver);
+	self->convolver = convolver;
+	spec.convolver = convolver ? ((PyConvolver *)convolver)->convolver : nullptr;
+	Py_XINCREF(openclenv);
+	Py_XDECREF(self->openclenv);
+	self->openclenv = openclenv;
+	spec.opencl_env = openclenv ? ((PyOpenCLEnv *)openclenv)->env : nullptr;
+
+	try {
+		self->compiled->build();
+	} catch (std::exception &e) {
+		PyErr_SetString(profit_error, e.what());
+		return false;
+	}
+	_print_warnings(self->compiled->warnings);
+#ifdef PYPROFIT_HAS_ATFORK
+	_track_for_fork(self->compiled);
+#endif // PYPROFIT_HAS_ATFORK
+	return true;
+}
+
+static PyObject *pyprofit_compile_model(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *model_dict;
+	PyObject *cache_components = Py_False;
+	const char *kwlist[] = {"model", "cache_components", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "O!|O:compile_model", const_cast<char **>(kwlist),
+	                                 &PyDict_Type, &model_dict, &cache_components) ) {
+		return NULL;
+	}
+
+	auto compiled = std::make_shared<compiled_model>();
+	if( !_read_model_spec(model_dict, compiled->spec) ) {
+		return NULL;
+	}
+	if( compiled->spec.native_conv ) {
+		PYPROFIT_RAISE("OTF and hybrid convolvers are only supported by make_model and make_models");
+	}
+	compiled->cache_components = PyObject_IsTrue(cache_components);
+
+	PyModel *model = (PyModel *)PyObject_CallObject((PyObject *)&PyModel_Type, NULL);
+	if( !model ) {
+		return NULL;
+	}
+	model->compiled = compiled;
+	if( !_setup_model(model, PyDict_GetItemString(model_dict, "convolver"),
+	                  PyDict_GetItemString(model_dict, "openclenv")) ) {
+		Py_DECREF(model);
+		return NULL;
+	}
+	return (PyObject *)model;
+}
+
+static PyObject *model_evaluate(PyModel *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *as_image = Py_False;
+	const char *kwlist[] = {"as_image", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "|O:evaluate", const_cast<char **>(kwlist), &as_image) ) {
+		return NULL;
+	}
+	if( !self->compiled ) {
+		PYPROFIT_RAISE("Model has not been compiled");
+	}
+
+	auto compiled = self->compiled;
+	Image image;
+	Point offset;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		std::lock_guard<std::mutex> guard(compiled->lock);
+		image = compiled->active().evaluate(offset);
+	} catch (std::exception &e) {
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS
+
+	if( !error.empty() ) {
+		PyErr_SetString(profit_error, error.c_str());
+		return NULL;
+	}
+
+	if( PyObject_IsTrue(as_image) ) {
+		return _image_to_pyimage(image, offset);
+	}
+	return _image_to_tuple(image, offset);
+}
+
+/*
+ * Updates profile parameters. @profiles has the same layout as the
+ * "profiles" item of a model dictionary, with each profile dictionary
+ * containing only the parameters that change.
+ */
+static PyObject *model_update(PyModel *self, PyObject *profiles) {
+
+	if( !self->compiled ) {
+		PYPROFIT_RAISE("Model has not been compiled");
+	}
+	if( !PyDict_Check(profiles) ) {
+		PyErr_SetString(PyExc_TypeError, "profiles must be a dictionary");
+		return NULL;
+	}
+
+	/* Collect all updates first, so they are applied all or none */
+	auto &spec = self->compiled->spec;
+	std::vector<std::tuple<std::size_t, std::string, double>> updates;
+	PyObject *name, *profile_sequence;
+	Py_ssize_t pos = 0;
+	while( PyDict_Next(profiles, &pos, &name, &profile_sequence) ) {
+
+		PyObject *name_bytes = PyUnicode_Check(name) ? PyUnicode_AsUTF8String(name) : (Py_INCREF(name), name);
+		if( !name_bytes ) {
+			return NULL;
+		}
+		std::string profile_name = PyBytes_AsString(name_bytes) ? PyBytes_AsString(name_bytes) : "";
+		Py_DECREF(name_bytes);
+		if( PyErr_Occurred() ) {
+			return NULL;
+		}
+
+		/* Indices of the profiles of this type in the specification */
+		std::vector<std::size_t> indices;
+		for(std::size_t i = 0; i != spec.profiles.size(); i++) {
+			if( spec.profiles[i].name == profile_name ) {
+				indices.push_back(i);
+			}
+		}
+
+		PyObject *seq = PySequence_Fast(profile_sequence, "profiles must be sequences of dictionaries");
+		if( !seq ) {
+			return NULL;
+		}
+		Py_ssize_t length = PySequence_Fast_GET_SIZE(seq);
+		if( std::size_t(length) > indices.size() ) {
+			Py_DECREF(seq);
+			PyErr_Format(profit_error, "Model has only %d %s profiles", int(indices.size()), profile_name.c_str());
+			return NULL;
+		}
+		for(Py_ssize_t i = 0; i != length; i++) {
+			PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+			if( !PyDict_Check(item) ) {
+				Py_DECREF(seq);
+				PyErr_SetString(PyExc_TypeError, "profiles must be sequences of dictionaries");
+				return NULL;
+			}
+			PyObject *key, *value;
+			Py_ssize_t item_pos = 0;
+			while( PyDict_Next(item, &item_pos, &key, &value) ) {
+				PyObject *key_bytes = PyUnicode_Check(key) ? PyUnicode_AsUTF8String(key) : (Py_INCREF(key), key);
+				if( !key_bytes ) {
+					Py_DECREF(seq);
+					return NULL;
+				}
+				const char *param_name = PyBytes_AsString(key_bytes);
+				double val = PyFloat_AsDouble(value);
+				if( param_name ) {
+					updates.emplace_back(indices[i], param_name, val);
+				}
+				Py_DECREF(key_bytes);
+				if( PyErr_Occurred() ) {
+					Py_DECREF(seq);
+					return NULL;
+				}
+			}
+		}
+		Py_DECREF(seq);
+	}
+
+	auto compiled = self->compiled;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		std::lock_guard<std::mutex> guard(compiled->lock);
+		for(auto &update: updates) {
+			compiled->set_parameter(std::get<0>(update), std::get<1>(update), std::get<2>(update));
+		}
+	} catch (std::exception &e) {
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS
+
+	if( !error.empty() ) {
+		PYPROFIT_RAISE(error.c_str());
+	}
+	Py_RETURN_NONE;
+}
+
+/*
+ * Reads data, sigma and an optional region (which can be NULL or None) into
+ * data values and their weights (see compiled_model::weights).
+ */
+static bool _read_data(PyObject *data_p, PyObject *sigma_p, PyObject *region_p, std::vector<double> &data, std::vector<double> &weights) {
+
+	if( region_p == Py_None ) {
+		region_p = NULL;
+	}
+
+	std::vector<double> sigma;
+	std::vector<bool> region;
+	unsigned int data_w = 0, data_h = 0, sigma_w = 0, sigma_h = 0, region_w = 0, region_h = 0;
+	if( !_read_double_matrix(data_p, data, &data_w, &data_h) ||
+	    !_read_double_matrix(sigma_p, sigma, &sigma_w, &sigma_h) ||
+	    !_read_boolean_matrix(region_p, region, &region_w, &region_h) ) {
+		return false;
+	}
+	if( sigma_w != data_w || sigma_h != data_h || (region_p && (region_w != data_w || region_h != data_h)) ) {
+		PyErr_SetString(profit_error, "data, sigma and region must have the same dimensions");
+		return false;
+	}
+
+	weights.resize(data.size());
+	for(std::size_t i = 0; i != data.size(); i++) {
+		bool use = (region.empty() || region[i]) && sigma[i] > 0 && std::isfinite(sigma[i]) && std::isfinite(data[i]);
+		weights[i] = use ? 1. / (sigma[i] * sigma[i]) : 0.;
+		if( !use ) {
+			data[i] = 0;
+		}
+	}
+	return true;
+}
+
+/*
+ * Sets the data (and its uncertainties) the likelihood is calculated against.
+ * An optional boolean region restricts the pixels that are considered;
+ * pixels with non-positive or non-finite sigma are always ignored.
+ */
+static PyObject *model_set_data(PyModel *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *data_p, *sigma_p, *region_p = NULL;
+	const char *kwlist[] = {"data", "sigma", "region", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "OO|O:set_data", const_cast<char **>(kwlist),
+	                                 &data_p, &sigma_p, &region_p) ) {
+		return NULL;
+	}
+	if( !self->compiled ) {
+		PYPROFIT_RAISE("Model has not been compiled");
+	}
+
+	std::vector<double> data, weights;
+	if( !_read_data(data_p, sigma_p, region_p, data, weights) ) {
+		return NULL;
+	}
+
+	auto compiled = self->compiled;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		std::lock_guard<std::mutex> guard(compiled->lock);
+		compiled->set_data(std::move(data), std::move(weights));
+	} catch (std::exception &e) {
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS
+
+	if( !error.empty() ) {
+		PYPROFIT_RAISE(error.c_str());
+	}
+	Py_RETURN_NONE;
+}
+
+/*
+ * Converts per-profile values into the layout used by update(), with
+ * @name as the parameter name of each profile. NaN values are skipped.
+ */
+static PyObject *_profile_values_to_dict(const model_spec &spec, const std::vector<double> &values) {
+
+	PyObject *profiles = PyDict_New();
+	if( !profiles ) {
+		return NULL;
+	}
+	for(std::size_t i = 0; i != spec.profiles.size(); i++) {
+		auto &name = spec.profiles[i].name;
+		PyObject *seq = PyDict_GetItemString(profiles, name.c_str());
+		if( !seq ) {
+			seq = PyList_New(0);
+			if( !seq || PyDict_SetItemString(profiles, name.c_str(), seq) == -1 ) {
+				Py_XDECREF(seq);
+				Py_DECREF(profiles);
+				return NULL;
+			}
+			Py_DECREF(seq);
+		}
+		PyObject *item = std::isnan(values[i]) ?
+		    PyDict_New() :
+		    Py_BuildValue("{s:d}", name == "sky" ? "bg" : "mag", values[i]);
+		if( !item || PyList_Append(seq, item) == -1 ) {
+			Py_XDECREF(item);
+			Py_DECREF(profiles);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+	return profiles;
+}
+
+/*
+ * Calculates the log-likelihood of the data given the model. With
+ * solve_linear=True the fluxes of all profiles are solved for, and a
+ * (loglike, fluxes) tuple is returned, with fluxes in the layout taken by
+ * update(). With a threshold the calculation stops as soon as the
+ * log-likelihood is known to be below it, returning a value that is also
+ * below it (but not necessarily the actual log-likelihood); this is useful
+ * to reject Metropolis proposals early.
+ */
+static PyObject *model_likelihood(PyModel *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *solve_linear = Py_False, *threshold_p = Py_None;
+	const char *kwlist[] = {"solve_linear", "threshold", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "|OO:likelihood", const_cast<char **>(kwlist),
+	                                 &solve_linear, &threshold_p) ) {
+		return NULL;
+	}
+	if( !self->compiled ) {
+		PYPROFIT_RAISE("Model has not been compiled");
+	}
+
+	bool do_solve = PyObject_IsTrue(solve_linear);
+	bool has_threshold = threshold_p != Py_None;
+	double threshold = 0;
+	if( has_threshold ) {
+		threshold = PyFloat_AsDouble(threshold_p);
+		if( PyErr_Occurred() ) {
+			return NULL;
+		}
+		if( do_solve ) {
+			PYPROFIT_RAISE("threshold can't be used together with solve_linear");
+		}
+	}
+
+	auto compiled = self->compiled;
+	double loglike = 0;
+	bool aborted;
+	std::vector<double> fluxes;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		std::lock_guard<std::mutex> guard(compiled->lock);
+		if( do_solve ) {
+			loglike = compiled->active().solve_linear(fluxes);
+		}
+		else if( has_threshold ) {
+			loglike = compiled->active().likelihood(threshold, aborted);
+		}
+		else {
+			loglike = compiled->active().likelihood();
+		}
+	} catch (std::exception &e) {
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS
+
+	if( !error.empty() ) {
+		PYPROFIT_RAISE(error.c_str());
+	}
+	if( !do_solve ) {
+		return PyFloat_FromDouble(loglike);
+	}
+
+	PyObject *fluxes_dict = _profile_values_to_dict(compiled->spec, fluxes);
+	if( !fluxes_dict ) {
+		return NULL;
+	}
+	return Py_BuildValue("(dN)", loglike, fluxes_dict);
+}
+
+/* A parameter as named by the user, before resolving it against a model */
+struct parameter_name {
+	std::string profile;
+	unsigned int index;
+	std::string name;
+};
+
+/*
+ * Reads a sequence of (profile_name, index, parameter_name) tuples without
+ * resolving them, so the model doesn't need to be locked while the GIL is
+ * held.
+ */
+static bool _read_parameter_names(PyObject *parameters, std::vector<parameter_name> &names) {
+
+	PyObject *seq = PySequence_Fast(parameters, "parameters must be a sequence of (profile, index, name) tuples");
+	if( !seq ) {
+		return false;
+	}
+	Py_ssize_t length = PySequence_Fast_GET_SIZE(seq);
+	for(Py_ssize_t i = 0; i != length; i++) {
+		const char *profile_name, *name;
+		unsigned int index;
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+		if( !PyTuple_Check(item) || !PyArg_ParseTuple(item, "sIs", &profile_name, &index, &name) ) {
+			Py_DECREF(seq);
+			if( !PyErr_Occurred() ) {
+				PyErr_SetString(PyExc_TypeError, "parameters must be a sequence of (profile, index, name) tuples");
+			}
+			return false;
+		}
+		names.push_back({profile_name, index, name});
+	}
+	Py_DECREF(seq);
+	return true;
+}
+
+/*
+ * Resolves @names against @compiled, taking its lock; call it with the GIL
+ * released. Returns an error message on failure.
+ */
+static std::string _resolve_parameter_names(compiled_model &compiled, const std::vector<parameter_name> &names, std::vector<parameter_ref> &refs) {
+	try {
+		std::lock_guard<std::mutex> guard(compiled.lock);
+		for(auto &name: names) {
+			refs.push_back(compiled.resolve_parameter(name.profile, name.index, name.name));
+		}
+	} catch (std::exception &e) {
+		return e.what();
+	}
+	return std::string();
+}
+
+/*
+ * Evaluates the model and its derivatives with respect to the given
+ * parameters, returning (image, offset, derivatives), with one 2-D tuple
+ * per parameter in derivatives. With sparse=True each derivative is
+ * instead an (x0, y0, stamp) tuple holding only the region around its
+ * profile where the profile is above threshold (1e-6 by default) times
+ * its peak, grown by the PSF half-size; the derivative is zero elsewhere.
+ * Most profiles never reach zero, so a zero threshold selects the whole
+ * image. Derivatives other than those of magnitudes and sky backgrounds
+ * are forward differences with a relative step, taken with a fixed
+ * subsampling: radial profiles differentiated this way are switched to
+ * adjust=False unless they set adjust themselves, for this and later
+ * evaluations.
+ */
+static PyObject *model_jacobian(PyModel *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *parameters, *sparse = Py_False;
+	double step = 1e-4, threshold = 1e-6;
+	const char *kwlist[] = {"parameters", "step", "sparse", "threshold", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "O|dOd:jacobian", const_cast<char **>(kwlist),
+	                                 &parameters, &step, &sparse, &threshold) ) {
+		return NULL;
+	}
+	if( !self->compiled ) {
+		PYPROFIT_RAISE("Model has not been compiled");
+	}
+	if( !(step > 0) ) {
+		PYPROFIT_RAISE("step must be positive");
+	}
+	if( !(threshold >= 0) ) {
+		PYPROFIT_RAISE("threshold must be non-negative");
+	}
+	bool is_sparse = PyObject_IsTrue(sparse);
+
+	std::vector<parameter_name> names;
+	if( !_read_parameter_names(parameters, names) ) {
+		return NULL;
+	}
+
+	auto compiled = self->compiled;
+	std::vector<parameter_ref> refs;
+	Image image;
+	Point offset;
+	std::vector<std::vector<double>> derivatives;
+	std::vector<image_stamp> stamps;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		std::lock_guard<std::mutex> guard(compiled->lock);
+		for(auto &name: names) {
+			refs.push_back(compiled->resolve_parameter(name.profile, name.index, name.name));
+		}
+		if( is_sparse ) {
+			image = compiled->active().sparse_jacobian(refs, step, threshold, offset, stamps);
+		}
+		else {
+			image = compiled->active().jacobian(refs, step, offset, derivatives);
+		}
+	} catch (std::exception &e) {
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS
+
+	if( !error.empty() ) {
+		PYPROFIT_RAISE(error.c_str());
+	}
+
+	PyObject *image_tuple = _image_to_tuple(image, offset);
+	PyObject *derivatives_tuple = PyTuple_New(refs.size());
+	if( !image_tuple || !derivatives_tuple ) {
+		Py_XDECREF(image_tuple);
+		Py_XDECREF(derivatives_tuple);
+		return NULL;
+	}
+	for(std::size_t k = 0; k != refs.size(); k++) {
+		PyObject *derivative;
+		if( is_sparse ) {
+			auto &stamp = stamps[k];
+			derivative = Py_BuildValue("(IIN)", stamp.x0, stamp.y0, _values_to_tuple(stamp.values, stamp.width, stamp.height));
+		}
+		else {
+			derivative = _values_to_tuple(derivatives[k], image.getWidth(), image.getHeight());
+		}
+		if( !derivative ) {
+			Py_DECREF(image_tuple);
+			Py_DECREF(derivatives_tuple);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(derivatives_tuple, k, derivative);
+	}
+
+	PyObject *result = Py_BuildValue("(OON)", PyTuple_GET_ITEM(image_tuple, 0), PyTuple_GET_ITEM(image_tuple, 1), derivatives_tuple);
+	Py_DECREF(image_tuple);
+	return result;
+}
+
+/*
+ * Pickling support. The state is the serialised specification, plus the
+ * convolver and OpenCL environment (which are pickled on their own).
+ */
+static PyObject *model_reduce(PyModel *self, PyObject *args) {
+
+	if( !self->compiled ) {
+		PYPROFIT_RAISE("Model has not been compiled");
+	}
+
+	spec_writer w;
+	w.put(PYPROFIT_MODEL_STATE_VERSION);
+	_write_model_spec(w, self->compiled->spec);
+
+	return Py_BuildValue("(O()(NOOO))", (PyObject *)Py_TYPE(self),
+	                     PyBytes_FromStringAndSize(w.buffer.data(), w.buffer.size()),
+	                     self->convolver ? self->convolver : Py_None,
+	                     self->openclenv ? self->openclenv : Py_None,
+	                     self->compiled->cache_components ? Py_True : Py_False);
+}
+
+static PyObject *model_setstate(PyModel *self, PyObject *state) {
+
+	const char *data;
+	Py_ssize_t size;
+	PyObject *convolver, *openclenv;
+	PyObject *cache_components = Py_False;
+	if( !PyArg_ParseTuple(state, "s#OO|O:__setstate__", &data, &size, &convolver, &openclenv, &cache_components) ) {
+		return NULL;
+	}
+
+	auto compiled = std::make_shared<compiled_model>();
+	compiled->cache_components = PyObject_IsTrue(cache_components);
+	try {
+		spec_reader r(data, size);
+		if( r.get<unsigned int>() != PYPROFIT_MODEL_STATE_VERSION ) {
+			PYPROFIT_RAISE("Unsupported pickled model version");
+		}
+		_read_model_spec(r, compiled->spec);
+		if( !r.at_end() ) {
+			PYPROFIT_RAISE("Unexpected trailing data in pickled model");
+		}
+	} catch (std::exception &e) {
+		PYPROFIT_RAISE(e.what());
+	}
+
+	self->compiled = compiled;
+	if( !_setup_model(self, convolver, openclenv) ) {
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+/*
+ * Resolution level at which the model is evaluated: 0 is full resolution,
+ * and each level above doubles the pixel size. evaluate(), likelihood(),
+ * jacobian() and fit_batch() work at the current level, with images and
+ * data binned accordingly; update() always applies to all levels.
+ */
+static PyObject *model_get_level(PyModel *self, void *closure) {
+	if( !self->compiled ) {
+		PYPROFIT_RAISE("Model has not been compiled");
+	}
+	return PyLong_FromUnsignedLong(self->compiled->level);
+}
+
+static int model_set_level(PyModel *self, PyObject *value, void *closure) {
+
+	if( !self->compiled ) {
+		PyErr_SetString(profit_error, "Model has not been compiled");
+		return -1;
+	}
+	if( !value ) {
+		PyErr_SetString(PyExc_TypeError, "level can't be deleted");
+		return -1;
+	}
+	long level = PyInt_AsLong(value);
+	if( level == -1 && PyErr_Occurred() ) {
+		return -1;
+	}
+	if( level < 0 || level > 8 ) {
+		PyErr_SetString(profit_error, "level must be between 0 and 8");
+		return -1;
+	}
+
+	auto compiled = self->compiled;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		std::lock_guard<std::mutex> guard(compiled->lock);
+		compiled->set_level((unsigned int)level);
+	} catch (std::exception &e) {
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS
+
+	if( !error.empty() ) {
+		PyErr_SetString(profit_error, error.c_str());
+		return -1;
+	}
+	_print_warnings(compiled->active().warnings);
+	return 0;
+}
+
+/* Index of a profile among those of its same type, as used in model dictionaries */
+static Py_ssize_t _profile_type_index(const model_spec &spec, std::size_t profile_idx) {
+	Py_ssize_t index = 0;
+	for(std::size_t i = 0; i != profile_idx; i++) {
+		index += spec.profiles[i].name == spec.profiles[profile_idx].name;
+	}
+	return index;
+}
+
+/*
+ * Subsampling settings chosen for profiles given an accuracy, as a list of
+ * dictionaries with the profile type and index, the target accuracy, the
+ * relative error measured during calibration (which is larger than the
+ * accuracy if no setting met it) and the settings added to the profile.
+ */
+static PyObject *model_get_subsampling(PyModel *self, void *closure) {
+
+	if( !self->compiled ) {
+		PYPROFIT_RAISE("Model has not been compiled");
+	}
+
+	auto &spec = self->compiled->spec;
+	PyObject *choices = PyList_New(0);
+	for(auto &choice: spec.subsampling) {
+
+		auto &name = spec.profiles[choice.profile].name;
+		Py_ssize_t index = _profile_type_index(spec, choice.profile);
+
+		PyObject *settings = PyDict_New();
+		for(auto &param: choice.settings) {
+			PyObject *value;
+			switch(param.kind) {
+			case profile_parameter::BOOL:
+				value = PyBool_FromLong(param.value != 0);
+				break;
+			case profile_parameter::UINT:
+				value = PyLong_FromUnsignedLong((unsigned long)param.value);
+				break;
+			default:
+				value = PyFloat_FromDouble(param.value);
+			}
+			if( !settings || !value || PyDict_SetItemString(settings, param.name.c_str(), value) == -1 ) {
+				Py_XDECREF(value);
+				Py_XDECREF(settings);
+				Py_DECREF(choices);
+				return NULL;
+			}
+			Py_DECREF(value);
+		}
+
+		PyObject *item = Py_BuildValue("{s:s,s:n,s:d,s:d,s:N}", "profile", name.c_str(), "index", index,
+		                               "accuracy", choice.accuracy, "error", choice.error, "settings", settings);
+		if( !item || PyList_Append(choices, item) == -1 ) {
+			Py_XDECREF(item);
+			Py_DECREF(choices);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+	return choices;
+}
+
+static PyObject *model_get_psf_trim(PyModel *self, void *closure) {
+
+	if( !self->compiled ) {
+		PYPROFIT_RAISE("Model has not been compiled");
+	}
+	return _psf_trim_to_dict(self->compiled->spec.psf_trim);
+}
+
+static PyGetSetDef PyModel_getset[] = {
+    {const_cast<char *>("level"), (getter)model_get_level, (setter)model_set_level, const_cast<char *>("Resolution level of the model"), NULL},
+    {const_cast<char *>("subsampling"), (getter)model_get_subsampling, NULL, const_cast<char *>("Subsampling settings chosen for the requested accuracies"), NULL},
+    {const_cast<char *>("psf_trim"), (getter)model_get_psf_trim, NULL, const_cast<char *>("How the PSF was trimmed, if requested"), NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+static PyMethodDef PyModel_methods[] = {
+    {"evaluate",     (PyCFunction)model_evaluate, METH_VARARGS | METH_KEYWORDS, "Evaluates the model."},
+    {"update",       (PyCFunction)model_update,   METH_O,      "Updates profile parameters."},
+    {"set_data",     (PyCFunction)model_set_data, METH_VARARGS | METH_KEYWORDS, "Sets the data used to calculate likelihoods."},
+    {"likelihood",   (PyCFunction)model_likelihood, METH_VARARGS | METH_KEYWORDS, "Calculates the log-likelihood of the data given the model."},
+    {"jacobian",     (PyCFunction)model_jacobian, METH_VARARGS | METH_KEYWORDS, "Evaluates the model and its parameter derivatives."},
+    {"__reduce__",   (PyCFunction)model_reduce,   METH_NOARGS, "Helper for pickle."},
+    {"__setstate__", (PyCFunction)model_setstate, METH_O,      "Helper for pickle."},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+/*
+ * C-API (see pyprofit.h)
+ *
+ * Templates keep the compiled model alive through its shared pointer, so
+ * they don't hold references to python objects and can be used and freed
+ * without the GIL.
+ */
+struct pyprofit_template {
+	std::shared_ptr<compiled_model> compiled;
+	std::vector<parameter_ref> refs;
+	std::string error;
+};
+
+static pyprofit_template *_c_api_template_new(PyObject *model, PyObject *parameters) {
+
+	if( !PyObject_TypeCheck(model, &PyModel_Type) ) {
+		PyErr_SetString(PyExc_TypeError, "model must be a pyprofit.model");
+		return NULL;
+	}
+	auto compiled = ((PyModel *)model)->compiled;
+	if( !compiled ) {
+		PyErr_SetString(profit_error, "Model has not been compiled");
+		return NULL;
+	}
+
+	std::vector<parameter_name> names;
+	if( !_read_parameter_names(parameters, names) ) {
+		return NULL;
+	}
+
+	std::unique_ptr<pyprofit_template> t(new pyprofit_template());
+	t->compiled = compiled;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	error = _resolve_parameter_names(*compiled, names, t->refs);
+	Py_END_ALLOW_THREADS
+	if( !error.empty() ) {
+		PyErr_SetString(profit_error, error.c_str());
+		return NULL;
+	}
+	return t.release();
+}
+
+static void _c_api_template_free(pyprofit_template *t) {
+	delete t;
+}
+
+static unsigned int _c_api_template_parameters(const pyprofit_template *t) {
+	return (unsigned int)t->refs.size();
+}
+
+/* Runs @f with the template's model locked, recording errors */
+template <typename F>
+static int _c_api_call(pyprofit_template *t, F f) {
+	std::lock_guard<std::mutex> guard(t->compiled->lock);
+	try {
+		f(*t->compiled);
+	} catch (std::exception &e) {
+		t->error = e.what();
+		return -1;
+	}
+	return 0;
+}
+
+static void _c_api_shape(compiled_model &compiled, unsigned int &width, unsigned int &height) {
+	auto &spec = compiled.active().spec;
+	unsigned int factor = spec.finesampling > 1 && spec.return_finesampled ? spec.finesampling : 1;
+	width = spec.width * factor;
+	height = spec.height * factor;
+}
+
+static int _c_api_template_shape(pyprofit_template *t, unsigned int *width, unsigned int *height) {
+	return _c_api_call(t, [&](compiled_model &compiled) {
+		_c_api_shape(compiled, *width, *height);
+	});
+}
+
+static void _c_api_set_parameters(pyprofit_template *t, compiled_model &compiled, const double *parameters) {
+	for(std::size_t i = 0; i != t->refs.size(); i++) {
+		compiled.set_parameter(t->refs[i].profile, t->refs[i].name, parameters[i]);
+	}
+}
+
+static int _c_api_evaluate(pyprofit_template *t, const double *parameters, double *image) {
+	return _c_api_call(t, [&](compiled_model &compiled) {
+		_c_api_set_parameters(t, compiled, parameters);
+		unsigned int width, height;
+		_c_api_shape(compiled, width, height);
+		Point offset;
+		Image result = compiled.active().evaluate(offset);
+		if( result.size() != std::size_t(width) * height ) {
+			throw invalid_parameter("Model image has unexpected dimensions");
+		}
+		std::copy(&result[0], &result[0] + result.size(), image);
+	});
+}
+
+static int _c_api_likelihood(pyprofit_template *t, const double *parameters, double *loglike) {
+	return _c_api_call(t, [&](compiled_model &compiled) {
+		_c_api_set_parameters(t, compiled, parameters);
+		*loglike = compiled.active().likelihood();
+	});
+}
+
+static const char *_c_api_template_error(const pyprofit_template *t) {
+	return t->error.c_str();
+}
+
+static const pyprofit_C_API pyprofit_c_api = {
+	PYPROFIT_C_API_VERSION,
+	_c_api_template_new,
+	_c_api_template_free,
+	_c_api_template_parameters,
+	_c_api_template_shape,
+	_c_api_evaluate,
+	_c_api_likelihood,
+	_c_api_template_error
+};
+
+/*
+ * Batched fitting
+ *
+ * fit_batch() fits many independent problems, each made of a compiled model
+ * with its own data, sigma, optional region, free parameters and bounds.
+ * Problems are taken in turn by a pool of native threads, each of which
+ * fits one problem at a time with compiled_model::fit. Results are
+ * returned as columns, one entry per problem.
+ */
+struct fit_problem {
+	std::shared_ptr<compiled_model> compiled;
+	std::vector<double> data;
+	std::vector<double> weights;
+	std::vector<parameter_ref> refs;
+	std::vector<double> initial;
+	std::vector<double> lower;
+	std::vector<double> upper;
+	fit_result result;
+};
+
+static bool _read_fit_problem(PyObject *item, fit_problem &problem) {
+
+	if( !PyDict_Check(item) ) {
+		PyErr_SetString(PyExc_TypeError, "problems must be dictionaries");
+		return false;
+	}
+
+	PyObject *model = PyDict_GetItemString(item, "model");
+	if( !model || !PyObject_TypeCheck(model, &PyModel_Type) || !((PyModel *)model)->compiled ) {
+		PyErr_SetString(profit_error, "problem's model must be a compiled model");
+		return false;
+	}
+	problem.compiled = ((PyModel *)model)->compiled;
+
+	PyObject *data = PyDict_GetItemString(item, "data");
+	PyObject *sigma = PyDict_GetItemString(item, "sigma");
+	if( !data || !sigma ) {
+		PyErr_SetString(profit_error, "problem must contain data and sigma");
+		return false;
+	}
+	if( !_read_data(data, sigma, PyDict_GetItemString(item, "region"), problem.data, problem.weights) ) {
+		return false;
+	}
+
+	PyObject *parameters = PyDict_GetItemString(item, "parameters");
+	if( !parameters ) {
+		PyErr_SetString(profit_error, "problem must contain parameters");
+		return false;
+	}
+	std::vector<parameter_name> names;
+	if( !_read_parameter_names(parameters, names) ) {
+		return false;
+	}
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	error = _resolve_parameter_names(*problem.compiled, names, problem.refs);
+	Py_END_ALLOW_THREADS
+	if( !error.empty() ) {
+		PyErr_SetString(profit_error, error.c_str());
+		return false;
+	}
+	auto n = problem.refs.size();
+
+	PyObject *initial = PyDict_GetItemString(item, "initial");
+	if( initial && initial != Py_None ) {
+		PyObject *seq = PySequence_Fast(initial, "initial must be a sequence of numbers");
+		if( !seq ) {
+			return false;
+		}
+		if( std::size_t(PySequence_Fast_GET_SIZE(seq)) != n ) {
+			Py_DECREF(seq);
+			PyErr_SetString(profit_error, "initial must have one value per parameter");
+			return false;
+		}
+		for(std::size_t k = 0; k != n; k++) {
+			problem.initial.push_back(PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, k)));
+		}
+		Py_DECREF(seq);
+		if( PyErr_Occurred() ) {
+			return false;
+		}
+	}
+
+	problem.lower.assign(n, -std::numeric_limits<double>::infinity());
+	problem.upper.assign(n, std::numeric_limits<double>::infinity());
+	PyObject *bounds = PyDict_GetItemString(item, "bounds");
+	if( bounds && bounds != Py_None ) {
+		PyObject *seq = PySequence_Fast(bounds, "bounds must be a sequence of (lower, upper) tuples");
+		if( !seq ) {
+			return false;
+		}
+		if( std::size_t(PySequence_Fast_GET_SIZE(seq)) != n ) {
+			Py_DECREF(seq);
+			PyErr_SetString(profit_error, "bounds must have one (lower, upper) tuple per parameter");
+			return false;
+		}
+		for(std::size_t k = 0; k != n; k++) {
+			PyObject *lower, *upper;
+			if( !PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, k), "OO", &lower, &upper) ) {
+				Py_DECREF(seq);
+				return false;
+			}
+			if( lower != Py_None ) {
+				problem.lower[k] = PyFloat_AsDouble(lower);
+			}
+			if( upper != Py_None ) {
+				problem.upper[k] = PyFloat_AsDouble(upper);
+			}
+		}
+		Py_DECREF(seq);
+		if( PyErr_Occurred() ) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void _fit_problem(fit_problem &problem, unsigned int max_iterations, double tolerance) {
+	try {
+		auto &compiled = *problem.compiled;
+		std::lock_guard<std::mutex> guard(compiled.lock);
+		compiled.set_data(std::move(problem.data), std::move(problem.weights));
+		for(std::size_t k = 0; k != problem.initial.size(); k++) {
+			compiled.set_parameter(problem.refs[k].profile, problem.refs[k].name, problem.initial[k]);
+		}
+
+		/* Fit at the model's current level, then bring the full model along */
+		problem.result = compiled.active().fit(problem.refs, problem.lower, problem.upper, max_iterations, tolerance);
+		for(std::size_t k = 0; k != problem.refs.size(); k++) {
+			compiled.set_parameter(problem.refs[k].profile, problem.refs[k].name, problem.result.values[k]);
+		}
+	} catch (std::exception &e) {
+		problem.result.message = e.what();
+	}
+}
+
+static PyObject *pyprofit_fit_batch(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *problems_p;
+	unsigned int threads = 0, max_iterations = 100;
+	double tolerance = 1e-8;
+	const char *kwlist[] = {"problems", "threads", "max_iterations", "tolerance", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "O|IId:fit_batch", const_cast<char **>(kwlist),
+	                                 &problems_p, &threads, &max_iterations, &tolerance) ) {
+		return NULL;
+	}
+
+	PyObject *seq = PySequence_Fast(problems_p, "problems must be a sequence of dictionaries");
+	if( !seq ) {
+		return NULL;
+	}
+	std::size_t n_problems = PySequence_Fast_GET_SIZE(seq);
+	std::vector<fit_problem> problems(n_problems);
+	std::map<compiled_model *, std::size_t> models;
+	for(std::size_t i = 0; i != n_problems; i++) {
+		if( !_read_fit_problem(PySequence_Fast_GET_ITEM(seq, i), problems[i]) ) {
+			Py_DECREF(seq);
+			return NULL;
+		}
+		if( !models.emplace(problems[i].compiled.get(), i).second ) {
+			Py_DECREF(seq);
+			PyErr_Format(profit_error, "problems %d and %d use the same model", int(models[problems[i].compiled.get()]), int(i));
+			return NULL;
+		}
+	}
+	Py_DECREF(seq);
+
+	if( threads == 0 ) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	threads = std::max(1u, std::min(threads, (unsigned int)n_problems));
+
+	Py_BEGIN_ALLOW_THREADS
+	std::atomic<std::size_t> next(0);
+	auto work = [&]() {
+		for(std::size_t i = next++; i < n_problems; i = next++) {
+			_fit_problem(problems[i], max_iterations, tolerance);
+		}
+	};
+	std::vector<std::thread> workers;
+	for(unsigned int t = 1; t < threads; t++) {
+		workers.emplace_back(work);
+	}
+	work();
+	for(auto &worker: workers) {
+		worker.join();
+	}
+	Py_END_ALLOW_THREADS
+
+	PyObject *values = PyList_New(n_problems);
+	PyObject *chisq = PyList_New(n_problems);
+	PyObject *iterations = PyList_New(n_problems);
+	PyObject *converged = PyList_New(n_problems);
+	PyObject *messages = PyList_New(n_problems);
+	if( !values || !chisq || !iterations || !converged || !messages ) {
+		Py_XDECREF(values);
+		Py_XDECREF(chisq);
+		Py_XDECREF(iterations);
+		Py_XDECREF(converged);
+		Py_XDECREF(messages);
+		return NULL;
+	}
+	for(std::size_t i = 0; i != n_problems; i++) {
+		auto &result = problems[i].result;
+		PyObject *problem_values = PyTuple_New(result.values.size());
+		if( problem_values ) {
+			for(std::size_t k = 0; k != result.values.size(); k++) {
+				PyTuple_SET_ITEM(problem_values, k, PyFloat_FromDouble(result.values[k]));
+			}
+		}
+		PyList_SET_ITEM(values, i, problem_values);
+		PyList_SET_ITEM(chisq, i, PyFloat_FromDouble(result.chisq));
+		PyList_SET_ITEM(iterations, i, PyLong_FromUnsignedLong(result.iterations));
+		PyList_SET_ITEM(converged, i, PyBool_FromLong(result.converged));
+		PyList_SET_ITEM(messages, i, PyUnicode_FromString(result.message.c_str()));
+	}
+
+	return Py_BuildValue("{s:N,s:N,s:N,s:N,s:N}",
+	                     "values", values, "chisq", chisq, "iterations", iterations,
+	                     "converged", converged, "message", messages);
+}
+
+/*
+ * Source grouping
+ *
+ * group_sources() splits a full-frame model into groups of sources that
+ * must be fitted simultaneously. Each source (a profile with xcen and
+ * ycen) is assigned the bounding box of the segment its centre falls on,
+ * or just its centre pixel if that's background (segment 0). Boxes are
+ * grown by a halo, which defaults to the PSF half-size plus one pixel, and
+ * sources whose grown boxes overlap are put in the same group. Profiles
+ * without a centre (like sky) affect all groups, and are included in
+ * each of them. A convolver given in the model is sized for the full frame
+ * and isn't passed on, so groups convolve with their own.
+ *
+ * Each group is returned as a cropped model that can be compiled and
+ * evaluated or fitted (e.g., with fit_batch) independently of the others,
+ * so work scales with the size of the groups rather than that of the
+ * frame.
+ */
+struct source_box {
+	long x0, y0, x1, y1;
+
+	bool overlaps(const source_box &other) const {
+		return x0 < other.x1 && other.x0 < x1 && y0 < other.y1 && other.y0 < y1;
+	}
+};
+
+struct grouped_source {
+	std::string profile;
+	Py_ssize_t index;
+	PyObject *dict;
+	long segment;
+	source_box box;
+};
+
+static std::size_t _find_group(std::vector<std::size_t> &parents, std::size_t i) {
+	while( parents[i] != i ) {
+		parents[i] = parents[parents[i]];
+		i = parents[i];
+	}
+	return i;
+}
+
+static bool _get_double(PyObject *dict, const char *key, double &value) {
+	PyObject *tmp = PyDict_GetItemString(dict, key);
+	if( !tmp ) {
+		return false;
+	}
+	value = PyFloat_AsDouble(tmp);
+	return !PyErr_Occurred();
+}
+
+static PyObject *_bools_to_tuple(const std::vector<bool> &values, unsigned int width, unsigned int height) {
+	PyObject *rows = PyTuple_New(height);
+	for(unsigned int y = 0; rows && y != height; y++) {
+		PyObject *row = PyTuple_New(width);
+		if( !row ) {
+			Py_DECREF(rows);
+			return NULL;
+		}
+		for(unsigned int x = 0; x != width; x++) {
+			PyObject *value = values[x + y * width] ? Py_True : Py_False;
+			Py_INCREF(value);
+			PyTuple_SET_ITEM(row, x, value);
+		}
+		PyTuple_SET_ITEM(rows, y, row);
+	}
+	return rows;
+}
+
+/* Copies a profile dictionary, moving its centre by (-dx, -dy) */
+static PyObject *_shifted_profile(PyObject *profile, double dx, double dy) {
+	PyObject *copy = PyDict_Copy(profile);
+	double xcen, ycen;
+	if( copy && _get_double(copy, "xcen", xcen) && _get_double(copy, "ycen", ycen) ) {
+		PyObject *new_xcen = PyFloat_FromDouble(xcen - dx);
+		PyObject *new_ycen = PyFloat_FromDouble(ycen - dy);
+		bool ok = new_xcen && new_ycen &&
+		          PyDict_SetItemString(copy, "xcen", new_xcen) == 0 &&
+		          PyDict_SetItemString(copy, "ycen", new_ycen) == 0;
+		Py_XDECREF(new_xcen);
+		Py_XDECREF(new_ycen);
+		if( !ok ) {
+			Py_DECREF(copy);
+			return NULL;
+		}
+	}
+	return copy;
+}
+
+static bool _append_profile(PyObject *profiles, const std::string &name, PyObject *profile) {
+	PyObject *seq = PyDict_GetItemString(profiles, name.c_str());
+	if( !seq ) {
+		seq = PyList_New(0);
+		if( !seq || PyDict_SetItemString(profiles, name.c_str(), seq) == -1 ) {
+			Py_XDECREF(seq);
+			return false;
+		}
+		Py_DECREF(seq);
+	}
+	return PyList_Append(seq, profile) == 0;
+}
+
+static PyObject *_make_group(PyObject *model_dict, const std::vector<double> &segmap, unsigned int width,
+                             double scale_x, double scale_y,
+                             const std::vector<grouped_source> &sources, const std::vector<std::size_t> &members,
+                             const std::vector<grouped_source> &global_sources) {
+
+	source_box box = sources[members[0]].box;
+	for(auto i: members) {
+		auto &b = sources[i].box;
+		box = {std::min(box.x0, b.x0), std::min(box.y0, b.y0), std::max(box.x1, b.x1), std::max(box.y1, b.y1)};
+	}
+	unsigned int group_w = (unsigned int)(box.x1 - box.x0), group_h = (unsigned int)(box.y1 - box.y0);
+	double dx = box.x0 * scale_x, dy = box.y0 * scale_y;
+
+	/*
+	 * Fitting region: the group's segments, or the members' grown boxes if
+	 * they all sit on background
+	 */
+	std::vector<long> segments;
+	for(auto i: members) {
+		if( sources[i].segment && std::find(segments.begin(), segments.end(), sources[i].segment) == segments.end() ) {
+			segments.push_back(sources[i].segment);
+		}
+	}
+	std::vector<bool> region(std::size_t(group_w) * group_h);
+	if( segments.empty() ) {
+		for(auto i: members) {
+			auto &b = sources[i].box;
+			for(long y = b.y0; y != b.y1; y++) {
+				for(long x = b.x0; x != b.x1; x++) {
+					region[(x - box.x0) + (y - box.y0) * group_w] = true;
+				}
+			}
+		}
+	}
+	else {
+		for(unsigned int y = 0; y != group_h; y++) {
+			for(unsigned int x = 0; x != group_w; x++) {
+				long id = (long)segmap[(box.x0 + x) + (box.y0 + y) * width];
+				region[x + y * group_w] = id && std::find(segments.begin(), segments.end(), id) != segments.end();
+			}
+		}
+	}
+
+	/* Convolvers are made for the full frame, groups use their own */
+	PyObject *model = PyDict_Copy(model_dict);
+	if( model && PyDict_GetItemString(model, "convolver") && PyDict_DelItemString(model, "convolver") == -1 ) {
+		Py_CLEAR(model);
+	}
+	PyObject *profiles = PyDict_New();
+	PyObject *source_list = PyList_New(0);
+	PyObject *segment_list = PyList_New(0);
+	PyObject *region_tuple = _bools_to_tuple(region, group_w, group_h);
+	auto cleanup = [&]() {
+		Py_XDECREF(model);
+		Py_XDECREF(profiles);
+		Py_XDECREF(source_list);
+		Py_XDECREF(segment_list);
+		Py_XDECREF(region_tuple);
+		return (PyObject *)NULL;
+	};
+	if( !model || !profiles || !source_list || !segment_list || !region_tuple ) {
+		return cleanup();
+	}
+
+	for(auto i: members) {
+		auto &source = sources[i];
+		PyObject *profile = _shifted_profile(source.dict, dx, dy);
+		PyObject *source_id = Py_BuildValue("(sn)", source.profile.c_str(), source.index);
+		bool ok = profile && source_id && _append_profile(profiles, source.profile, profile) && PyList_Append(source_list, source_id) == 0;
+		Py_XDECREF(profile);
+		Py_XDECREF(source_id);
+		if( !ok ) {
+			return cleanup();
+		}
+	}
+	for(auto &source: global_sources) {
+		PyObject *profile = PyDict_Copy(source.dict);
+		bool ok = profile && _append_profile(profiles, source.profile, profile);
+		Py_XDECREF(profile);
+		if( !ok ) {
+			return cleanup();
+		}
+	}
+	for(auto id: segments) {
+		PyObject *segment = PyLong_FromLong(id);
+		bool ok = segment && PyList_Append(segment_list, segment) == 0;
+		Py_XDECREF(segment);
+		if( !ok ) {
+			return cleanup();
+		}
+	}
+
+	/* The calculation mask, if any, is cropped too */
+	PyObject *calcmask_p = PyDict_GetItemString(model_dict, "calcmask");
+	if( calcmask_p ) {
+		std::vector<bool> calcmask, cropped(std::size_t(group_w) * group_h);
+		unsigned int mask_w, mask_h;
+		if( !_read_boolean_matrix(calcmask_p, calcmask, &mask_w, &mask_h) ) {
+			return cleanup();
+		}
+		if( mask_w != width || mask_h != segmap.size() / width ) {
+			PyErr_SetString(profit_error, "calcmask and segmentation map dimensions differ");
+			return cleanup();
+		}
+		for(unsigned int y = 0; y != group_h; y++) {
+			for(unsigned int x = 0; x != group_w; x++) {
+				cropped[x + y * group_w] = calcmask[(box.x0 + x) + (box.y0 + y) * width];
+			}
+		}
+		PyObject *cropped_tuple = _bools_to_tuple(cropped, group_w, group_h);
+		bool ok = cropped_tuple && PyDict_SetItemString(model, "calcmask", cropped_tuple) == 0;
+		Py_XDECREF(cropped_tuple);
+		if( !ok ) {
+			return cleanup();
+		}
+	}
+
+	PyObject *w = PyLong_FromUnsignedLong(group_w);
+	PyObject *h = PyLong_FromUnsignedLong(group_h);
+	bool ok = w && h &&
+	          PyDict_SetItemString(model, "width", w) == 0 &&
+	          PyDict_SetItemString(model, "height", h) == 0 &&
+	          PyDict_SetItemString(model, "profiles", profiles) == 0;
+	Py_XDECREF(w);
+	Py_XDECREF(h);
+	if( !ok ) {
+		return cleanup();
+	}
+	Py_CLEAR(profiles);
+
+	return Py_BuildValue("{s:l,s:l,s:I,s:I,s:N,s:N,s:N,s:N}",
+	                     "x0", box.x0, "y0", box.y0, "width", group_w, "height", group_h,
+	                     "sources", source_list, "segments", segment_list,
+	                     "region", region_tuple, "model", model);
+}
+
+static PyObject *pyprofit_group_sources(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *segmap_p, *model_dict;
+	int halo = -1;
+	const char *kwlist[] = {"segmap", "model", "halo", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "OO|i:group_sources", const_cast<char **>(kwlist),
+	                                 &segmap_p, &model_dict, &halo) ) {
+		return NULL;
+	}
+	if( !PyDict_Check(model_dict) ) {
+		PyErr_SetString(PyExc_TypeError, "model must be a dictionary");
+		return NULL;
+	}
+
+	std::vector<double> segmap;
+	unsigned int width, height;
+	if( !_read_double_matrix(segmap_p, segmap, &width, &height) ) {
+		return NULL;
+	}
+
+	double model_w, model_h;
+	if( _get_double(model_dict, "width", model_w) && _get_double(model_dict, "height", model_h) &&
+	    (model_w != width || model_h != height) ) {
+		PYPROFIT_RAISE("Model and segmentation map dimensions differ");
+	}
+
+	double scale_x = 1, scale_y = 1;
+	_get_double(model_dict, "scale_x", scale_x);
+	_get_double(model_dict, "scale_y", scale_y);
+	if( PyErr_Occurred() ) {
+		return NULL;
+	}
+
+	if( halo < 0 ) {
+		halo = 1;
+		PyObject *psf_p = PyDict_GetItemString(model_dict, "psf");
+		if( psf_p ) {
+			std::vector<double> psf;
+			unsigned int psf_w, psf_h;
+			if( !_read_double_matrix(psf_p, psf, &psf_w, &psf_h) ) {
+				return NULL;
+			}
+			PyObject *flux_fraction_p = PyDict_GetItemString(model_dict, "psf_flux_fraction");
+			if( flux_fraction_p && flux_fraction_p != Py_None ) {
+				psf_trim_info psf_trim;
+				double flux_fraction = PyFloat_AsDouble(flux_fraction_p);
+				if( PyErr_Occurred() || !_trim_psf(psf, psf_w, psf_h, flux_fraction, psf_trim) ) {
+					return NULL;
+				}
+			}
+			halo += std::max(psf_w, psf_h) / 2;
+		}
+	}
+
+	/* Bounding boxes of all segments */
+	std::map<long, source_box> segment_boxes;
+	for(unsigned int y = 0; y != height; y++) {
+		for(unsigned int x = 0; x != width; x++) {
+			long id = (long)segmap[x + y * width];
+			if( !id ) {
+				continue;
+			}
+			auto it = segment_boxes.find(id);
+			if( it == segment_boxes.end() ) {
+				segment_boxes[id] = {long(x), long(y), long(x) + 1, long(y) + 1};
+			}
+			else {
+				auto &b = it->second;
+				b = {std::min(b.x0, long(x)), std::min(b.y0, long(y)), std::max(b.x1, long(x) + 1), std::max(b.y1, long(y) + 1)};
+			}
+		}
+	}
+
+	/* Sources, with their grown and clipped boxes */
+	PyObject *profiles = PyDict_GetItemString(model_dict, "profiles");
+	if( !profiles || !PyDict_Check(profiles) ) {
+		PYPROFIT_RAISE("model must contain a profiles dictionary");
+	}
+	std::vector<grouped_source> sources, global_sources;
+	PyObject *name, *profile_sequence;
+	Py_ssize_t pos = 0;
+	while( PyDict_Next(profiles, &pos, &name, &profile_sequence) ) {
+
+		PyObject *name_bytes = PyUnicode_Check(name) ? PyUnicode_AsUTF8String(name) : (Py_INCREF(name), name);
+		if( !name_bytes ) {
+			return NULL;
+		}
+		std::string profile_name = PyBytes_AsString(name_bytes) ? PyBytes_AsString(name_bytes) : "";
+		Py_DECREF(name_bytes);
+		if( PyErr_Occurred() ) {
+			return NULL;
+		}
+
+		PyObject *seq = PySequence_Fast(profile_sequence, "profiles must be sequences of dictionaries");
+		if( !seq ) {
+			return NULL;
+		}
+		for(Py_ssize_t i = 0; i != PySequence_Fast_GET_SIZE(seq); i++) {
+			PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+			if( !PyDict_Check(item) ) {
+				Py_DECREF(seq);
+				PyErr_SetString(PyExc_TypeError, "profiles must be sequences of dictionaries");
+				return NULL;
+			}
+
+			grouped_source source {profile_name, i, item, 0, {0, 0, 0, 0}};
+			double xcen, ycen;
+			if( !_get_double(item, "xcen", xcen) || !_get_double(item, "ycen", ycen) ) {
+				if( PyErr_Occurred() ) {
+					Py_DECREF(seq);
+					return NULL;
+				}
+				global_sources.push_back(source);
+				continue;
+			}
+
+			long cx = (long)std::floor(xcen / scale_x), cy = (long)std::floor(ycen / scale_y);
+			if( cx >= 0 && cy >= 0 && cx < long(width) && cy < long(height) ) {
+				source.segment = (long)segmap[cx + cy * width];
+			}
+			auto &b = source.box;
+			b = source.segment ? segment_boxes[source.segment] : source_box {cx, cy, cx + 1, cy + 1};
+			b = {std::max(b.x0 - halo, 0L), std::max(b.y0 - halo, 0L),
+			     std::min(b.x1 + halo, long(width)), std::min(b.y1 + halo, long(height))};
+
+			/* Sources whose grown box is outside the image are left out */
+			if( b.x0 < b.x1 && b.y0 < b.y1 ) {
+				sources.push_back(source);
+			}
+		}
+		Py_DECREF(seq);
+	}
+
+	/* Union overlapping boxes, sweeping them in x0 order */
+	std::vector<std::size_t> parents(sources.size()), order(sources.size());
+	for(std::size_t i = 0; i != sources.size(); i++) {
+		parents[i] = order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&sources](std::size_t a, std::size_t b) {
+		return sources[a].box.x0 < sources[b].box.x0;
+	});
+	for(std::size_t a = 0; a != order.size(); a++) {
+		auto &box_a = sources[order[a]].box;
+		for(std::size_t b = a + 1; b != order.size() && sources[order[b]].box.x0 < box_a.x1; b++) {
+			if( box_a.overlaps(sources[order[b]].box) ) {
+				parents[_find_group(parents, order[a])] = _find_group(parents, order[b]);
+			}
+		}
+	}
+
+	/* Groups, in order of their first source */
+	std::vector<std::vector<std::size_t>> groups;
+	std::map<std::size_t, std::size_t> group_of_root;
+	for(std::size_t i = 0; i != sources.size(); i++) {
+		auto root = _find_group(parents, i);
+		auto it = group_of_root.find(root);
+		if( it == group_of_root.end() ) {
+			it = group_of_root.emplace(root, groups.size()).first;
+			groups.emplace_back();
+		}
+		groups[it->second].push_back(i);
+	}
+
+	PyObject *result = PyList_New(groups.size());
+	if( !result ) {
+		return NULL;
+	}
+	for(std::size_t g = 0; g != groups.size(); g++) {
+		PyObject *group = _make_group(model_dict, segmap, width, scale_x, scale_y, sources, groups[g], global_sources);
+		if( !group ) {
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyList_SET_ITEM(result, g, group);
+	}
+	return result;
+}
+
+/*
+ * Sersic template banks
+ *
+ * A bank holds sersic stamps of unit total flux rendered by libprofit at a
+ * reference effective radius, on a grid of nser, axrat and box values.
+ * Sersic profiles are then rendered from the bank instead of libprofit:
+ * the eight stamps around the profile's (nser, axrat, box) are
+ * interpolated trilinearly, and sampled bilinearly at the rotated and
+ * scaled pixel positions (several times per pixel for pixels larger than
+ * the scaled stamp pixels). Stamps extend to size/2 reference radii from
+ * their centre, and flux beyond that is not rendered.
+ *
+ * Banks are built once and saved to disk with a 64 bytes header:
+ *
+ *   char magic[8] = "PYPROFSK", uint32 version, uint32 size, double re,
+ *   uint32 n_nser, uint32 n_axrat, uint32 n_box, padding,
+ *
+ * followed by the nser, axrat and box nodes and the stamps (all doubles,
+ * in native byte order), with box varying fastest and nser slowest.
+ */
+static const char PYPROFIT_BANK_MAGIC[8] = {'P', 'Y', 'P', 'R', 'O', 'F', 'S', 'K'};
+static const unsigned int PYPROFIT_BANK_VERSION = 1;
+static const std::size_t PYPROFIT_BANK_HEADER_SIZE = 64;
+
+/* Node interval containing @value and its position within it */
+static void _bank_bracket(const std::vector<double> &nodes, double value, const char *name, std::size_t &idx, double &t) {
+	if( nodes.size() == 1 ) {
+		if( std::abs(value - nodes[0]) > 1e-9 ) {
+			std::ostringstream os;
+			os << name << " = " << value << " is not covered by the bank";
+			throw invalid_parameter(os.str());
+		}
+		idx = 0;
+		t = 0;
+		return;
+	}
+	if( !(value >= nodes.front() && value <= nodes.back()) ) {
+		std::ostringstream os;
+		os << name << " = " << value << " is outside the bank's range [" << nodes.front() << ", " << nodes.back() << "]";
+		throw invalid_parameter(os.str());
+	}
+	idx = std::min(std::size_t(std::upper_bound(nodes.begin(), nodes.end(), value) - nodes.begin()), nodes.size() - 1) - 1;
+	t = (value - nodes[idx]) / (nodes[idx + 1] - nodes[idx]);
+}
+
+struct sersic_bank {
+
+	unsigned int size = 0;
+	double re = 0;
+	std::vector<double> nser, axrat, box;
+	std::vector<double> stamps;
+
+	std::size_t stamp_pixels() const {
+		return std::size_t(size) * size;
+	}
+
+	const double *stamp(std::size_t i, std::size_t j, std::size_t k) const {
+		return stamps.data() + ((i * axrat.size() + j) * box.size() + k) * stamp_pixels();
+	}
+
+	/* Renders a stamp with libprofit, at high accuracy */
+	static Image render_stamp(unsigned int size, double re, double nser, double axrat, double box) {
+		model_spec spec;
+		spec.width = spec.height = size;
+		profile_spec profile;
+		profile.name = "sersic";
+		profile.parameters = {
+			{"xcen", profile_parameter::DOUBLE, size / 2.},
+			{"ycen", profile_parameter::DOUBLE, size / 2.},
+			{"re", profile_parameter::DOUBLE, re},
+			{"nser", profile_parameter::DOUBLE, nser},
+			{"axrat", profile_parameter::DOUBLE, axrat},
+			{"box", profile_parameter::DOUBLE, box},
+			{"ang", profile_parameter::DOUBLE, 0},
+			{"mag", profile_parameter::DOUBLE, 0}
+		};
+		_add_subsampling_parameters(profile, subsampling_reference);
+		spec.profiles.push_back(std::move(profile));
+
+		Model m;
+		std::vector<std::string> warnings;
+		_build_model(spec, m, warnings);
+		Point offset;
+		return m.evaluate(offset);
+	}
+
+	/* Renders all stamps, using @threads threads */
+	void build(unsigned int threads) {
+
+		std::size_t n_stamps = nser.size() * axrat.size() * box.size();
+		stamps.assign(n_stamps * stamp_pixels(), 0);
+
+		std::atomic<std::size_t> next(0);
+		std::mutex error_lock;
+		std::string error;
+		auto work = [&]() {
+			for(std::size_t s = next++; s < n_stamps; s = next++) {
+				std::size_t k = s % box.size(), j = (s / box.size()) % axrat.size(), i = s / (box.size() * axrat.size());
+				try {
+					Image image = render_stamp(size, re, nser[i], axrat[j], box[k]);
+					std::copy(&image[0], &image[0] + stamp_pixels(), stamps.begin() + s * stamp_pixels());
+				} catch (std::exception &e) {
+					std::lock_guard<std::mutex> guard(error_lock);
+					error = e.what();
+				}
+			}
+		};
+		std::vector<std::thread> workers;
+		for(unsigned int t = 1; t < threads; t++) {
+			workers.emplace_back(work);
+		}
+		work();
+		for(auto &worker: workers) {
+			worker.join();
+		}
+		if( !error.empty() ) {
+			throw invalid_parameter(error);
+		}
+	}
+
+	/*
+	 * Adds the image of a sersic profile with the given parameters to
+	 * @image, a @width x @height image with the given pixel scale.
+	 */
+	void render(const profile_spec &profile, double magzero, unsigned int width, unsigned int height,
+	            double scale_x, double scale_y, std::vector<double> &image) const {
+
+		double xcen = _profile_parameter(profile, "xcen", 0), ycen = _profile_parameter(profile, "ycen", 0);
+		double profile_re = _profile_parameter(profile, "re", 1), ang = _profile_parameter(profile, "ang", 0);
+		double flux = std::pow(10, -0.4 * (_profile_parameter(profile, "mag", 15) - magzero));
+		if( !(profile_re > 0) ) {
+			throw invalid_parameter("re must be positive");
+		}
+
+		std::size_t i0, j0, k0;
+		double ti, tj, tk;
+		_bank_bracket(nser, _profile_parameter(profile, "nser", 4), "nser", i0, ti);
+		_bank_bracket(axrat, _profile_parameter(profile, "axrat", 1), "axrat", j0, tj);
+		_bank_bracket(box, _profile_parameter(profile, "box", 0), "box", k0, tk);
+
+		/* The (up to) eight stamps around the profile, and their weights */
+		std::vector<std::pair<const double *, double>> corners;
+		for(unsigned int c = 0; c != 8; c++) {
+			std::size_t di = c & 1, dj = (c >> 1) & 1, dk = (c >> 2) & 1;
+			double w = (di ? ti : 1 - ti) * (dj ? tj : 1 - tj) * (dk ? tk : 1 - tk);
+			if( w > 0 ) {
+				corners.emplace_back(stamp(i0 + di, j0 + dj, k0 + dk), w);
+			}
+		}
+
+		/* Stamp pixel size in image coordinates, and samples per pixel */
+		double s = profile_re / re;
+		unsigned int samples = (unsigned int)std::min(std::max(std::ceil(std::max(scale_x, scale_y) / s), 1.), 8.);
+		double norm = flux * scale_x * scale_y / (s * s * samples * samples);
+
+		double angrad = std::fmod(ang + 90, 360.) * M_PI / 180;
+		double cos_ang = std::cos(angrad), sin_ang = std::sin(angrad);
+		double extent = size / 2. * s * std::sqrt(2.);
+		long x0 = std::max(0L, (long)std::floor((xcen - extent) / scale_x));
+		long x1 = std::min(long(width), (long)std::ceil((xcen + extent) / scale_x));
+		long y0 = std::max(0L, (long)std::floor((ycen - extent) / scale_y));
+		long y1 = std::min(long(height), (long)std::ceil((ycen + extent) / scale_y));
+
+		for(long y = y0; y < y1; y++) {
+			for(long x = x0; x < x1; x++) {
+				double value = 0;
+				for(unsigned int sy = 0; sy != samples; sy++) {
+					double dy = (y + (sy + 0.5) / samples) * scale_y - ycen;
+					for(unsigned int sx = 0; sx != samples; sx++) {
+						double dx = (x + (sx + 0.5) / samples) * scale_x - xcen;
+
+						/* Continuous stamp coordinates, with pixel centres at integers */
+						double u = (dx * sin_ang - dy * cos_ang) / s + size / 2. - 0.5;
+						double v = (dx * cos_ang + dy * sin_ang) / s + size / 2. - 0.5;
+						if( u < 0 || v < 0 || u >= size - 1 || v >= size - 1 ) {
+							continue;
+						}
+						std::size_t ui = std::size_t(u), vi = std::size_t(v);
+						double fu = u - ui, fv = v - vi;
+						std::size_t p = ui + vi * size;
+						for(auto &corner: corners) {
+							auto st = corner.first;
+							value += corner.second * ((1 - fv) * ((1 - fu) * st[p] + fu * st[p + 1]) +
+							                          fv * ((1 - fu) * st[p + size] + fu * st[p + size + 1]));
+						}
+					}
+				}
+				image[x + y * width] += value * norm;
+			}
+		}
+	}
+
+	/* Renders all sersic profiles of @spec (other profiles are not supported) */
+	std::vector<double> render(const model_spec &spec) const {
+
+		std::vector<double> convolved(std::size_t(spec.width) * spec.height);
+		std::vector<double> unconvolved(convolved.size());
+		for(auto &profile: spec.profiles) {
+			if( profile.name != "sersic" ) {
+				throw invalid_parameter("Only sersic profiles can be rendered from a bank");
+			}
+			bool convolve = _profile_parameter(profile, "convolve", 0) != 0 && !spec.psf.empty();
+			render(profile, spec.magzero, spec.width, spec.height, spec.scale_x, spec.scale_y, convolve ? convolved : unconvolved);
+		}
+		if( !spec.psf.empty() ) {
+			convolved = _convolve_direct(convolved, spec.width, spec.height, spec.psf, spec.psf_width, spec.psf_height);
+		}
+		for(std::size_t i = 0; i != convolved.size(); i++) {
+			convolved[i] += unconvolved[i];
+		}
+		return convolved;
+	}
+
+	/*
+	 * Compares bank renderings of @samples random profiles within the bank's
+	 * range against direct libprofit evaluations, returning the maximum and
+	 * mean relative errors (sum of absolute differences over total flux).
+	 */
+	std::pair<double, double> validate(unsigned int samples, unsigned int seed) const {
+
+		std::mt19937 rng(seed);
+		auto uniform = [&rng](const std::vector<double> &nodes) {
+			return std::uniform_real_distribution<double>(nodes.front(), nodes.back())(rng);
+		};
+		std::uniform_real_distribution<double> unit(0, 1);
+
+		double max_error = 0, sum_error = 0;
+		for(unsigned int n = 0; n != samples; n++) {
+
+			double sample_re = re * (0.25 + 0.75 * unit(rng));
+			unsigned int image_size = std::max(16u, (unsigned int)std::ceil(size * sample_re / re));
+			profile_spec profile;
+			profile.name = "sersic";
+			profile.parameters = {
+				{"xcen", profile_parameter::DOUBLE, image_size / 2. + unit(rng)},
+				{"ycen", profile_parameter::DOUBLE, image_size / 2. + unit(rng)},
+				{"re", profile_parameter::DOUBLE, sample_re},
+				{"nser", profile_parameter::DOUBLE, uniform(nser)},
+				{"axrat", profile_parameter::DOUBLE, uniform(axrat)},
+				{"box", profile_parameter::DOUBLE, uniform(box)},
+				{"ang", profile_parameter::DOUBLE, 180 * unit(rng)},
+				{"mag", profile_parameter::DOUBLE, 0}
+			};
+
+			std::vector<double> from_bank(std::size_t(image_size) * image_size);
+			render(profile, 0, image_size, image_size, 1, 1, from_bank);
+
+			model_spec spec;
+			spec.width = spec.height = image_size;
+			_add_subsampling_parameters(profile, subsampling_reference);
+			spec.profiles.push_back(profile);
+			Model m;
+			std::vector<std::string> warnings;
+			_build_model(spec, m, warnings);
+			Point offset;
+			Image direct = m.evaluate(offset);
+
+			double diff = 0, total = 0;
+			for(std::size_t i = 0; i != from_bank.size(); i++) {
+				diff += std::abs(from_bank[i] - direct[i]);
+				total += std::abs(direct[i]);
+			}
+			double error = total > 0 ? diff / total : 0;
+			max_error = std::max(max_error, error);
+			sum_error += error;
+		}
+		return {max_error, samples ? sum_error / samples : 0};
+	}
+
+	std::string serialise() const {
+		spec_writer w;
+		w.buffer.append(PYPROFIT_BANK_MAGIC, sizeof(PYPROFIT_BANK_MAGIC));
+		w.put(PYPROFIT_BANK_VERSION);
+		w.put(size);
+		w.put(re);
+		w.put((unsigned int)nser.size());
+		w.put((unsigned int)axrat.size());
+		w.put((unsigned int)box.size());
+		w.buffer.resize(PYPROFIT_BANK_HEADER_SIZE, '\0');
+		for(auto axis: {&nser, &axrat, &box, &stamps}) {
+			for(auto v: *axis) {
+				w.put(v);
+			}
+		}
+		return std::move(w.buffer);
+	}
+
+	void deserialise(const std::string &data) {
+		if( data.size() < PYPROFIT_BANK_HEADER_SIZE || std::memcmp(data.data(), PYPROFIT_BANK_MAGIC, sizeof(PYPROFIT_BANK_MAGIC)) != 0 ) {
+			throw std::invalid_argument("Not a sersic bank file");
+		}
+		spec_reader header(data.data() + sizeof(PYPROFIT_BANK_MAGIC), PYPROFIT_BANK_HEADER_SIZE - sizeof(PYPROFIT_BANK_MAGIC));
+		if( header.get<unsigned int>() != PYPROFIT_BANK_VERSION ) {
+			throw std::invalid_argument("Unsupported sersic bank version");
+		}
+		size = header.get<unsigned int>();
+		re = header.get<double>();
+		unsigned int n_nser = header.get<unsigned int>();
+		unsigned int n_axrat = header.get<unsigned int>();
+		unsigned int n_box = header.get<unsigned int>();
+		if( size < 4 || !(re > 0) ) {
+			throw std::invalid_argument("Invalid stamp size or re in sersic bank file");
+		}
+
+		/* Sizes come from the file: check them (in double, which can't overflow) before allocating */
+		double n_values = double(n_nser) + n_axrat + n_box + double(n_nser) * n_axrat * n_box * size * size;
+		if( n_values * sizeof(double) != double(data.size() - PYPROFIT_BANK_HEADER_SIZE) ) {
+			throw std::invalid_argument("Sersic bank file has the wrong size for its contents");
+		}
+		nser.resize(n_nser);
+		axrat.resize(n_axrat);
+		box.resize(n_box);
+		stamps.resize(nser.size() * axrat.size() * box.size() * stamp_pixels());
+
+		spec_reader r(data.data() + PYPROFIT_BANK_HEADER_SIZE, data.size() - PYPROFIT_BANK_HEADER_SIZE);
+		for(auto axis: {&nser, &axrat, &box, &stamps}) {
+			for(auto &v: *axis) {
+				v = r.get<double>();
+			}
+		}
+
+		/* Same requirements as nodes given to make_sersic_bank */
+		for(auto axis: {&nser, &axrat, &box}) {
+			if( axis->empty() ) {
+				throw std::invalid_argument("Sersic bank file has no nodes for one of its axes");
+			}
+			for(std::size_t i = 1; i < axis->size(); i++) {
+				if( !((*axis)[i] > (*axis)[i - 1]) ) {
+					throw std::invalid_argument("Sersic bank file nodes are not in increasing order");
+				}
+			}
+		}
+	}
+};
+
+typedef struct {
+	PyObject_HEAD
+	std::shared_ptr<sersic_bank> bank;
+} PySersicBank;
+
+static void sersicbank_dealloc(PySersicBank *self) {
+	self->bank.reset();
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyTypeObject PySersicBank_Type = {
+#if PY_MAJOR_VERSION >= 3
+	PyVarObject_HEAD_INIT(NULL, 0)
+#else
+	PyObject_HEAD_INIT(NULL)
+	0,                             /*ob_size*/
+#endif
+	"pyprofit.sersicbank",         /*tp_name*/
+	sizeof(PySersicBank),          /*tp_basicsize*/
+};
+
+static PyObject *_new_sersicbank(std::shared_ptr<sersic_bank> bank) {
+	PySersicBank *self = PyObject_New(PySersicBank, &PySersicBank_Type);
+	if( !self ) {
+		return NULL;
+	}
+	new (&self->bank) std::shared_ptr<sersic_bank>(std::move(bank));
+	return (PyObject *)self;
+}
+
+/* Reads a sequence of nodes, which must be in strictly increasing order */
+static bool _read_bank_nodes(PyObject *nodes_p, const char *name, std::vector<double> &nodes) {
+	PyObject *seq = PySequence_Fast(nodes_p, "bank nodes must be sequences of numbers");
+	if( !seq ) {
+		return false;
+	}
+	for(Py_ssize_t i = 0; i != PySequence_Fast_GET_SIZE(seq); i++) {
+		nodes.push_back(PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i)));
+	}
+	Py_DECREF(seq);
+	if( PyErr_Occurred() ) {
+		return false;
+	}
+	if( nodes.empty() ) {
+		PyErr_Format(profit_error, "%s nodes can't be empty", name);
+		return false;
+	}
+	for(std::size_t i = 1; i < nodes.size(); i++) {
+		if( !(nodes[i] > nodes[i - 1]) ) {
+			PyErr_Format(profit_error, "%s nodes must be in increasing order", name);
+			return false;
+		}
+	}
+	return true;
+}
+
+static PyObject *pyprofit_make_sersic_bank(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *nser_p = NULL, *axrat_p = NULL, *box_p = NULL;
+	unsigned int size = 96, threads = 0;
+	double re = 6;
+	const char *kwlist[] = {"nser", "axrat", "box", "size", "re", "threads", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOIdI:make_sersic_bank", const_cast<char **>(kwlist),
+	                                 &nser_p, &axrat_p, &box_p, &size, &re, &threads) ) {
+		return NULL;
+	}
+
+	auto bank = std::make_shared<sersic_bank>();
+	bank->size = size;
+	bank->re = re;
+	if( nser_p ) {
+		if( !_read_bank_nodes(nser_p, "nser", bank->nser) ) {
+			return NULL;
+		}
+	}
+	else {
+		/* 0.5 to 8, logarithmically spaced */
+		for(unsigned int i = 0; i != 25; i++) {
+			bank->nser.push_back(0.5 * std::pow(16., i / 24.));
+		}
+	}
+	if( axrat_p ) {
+		if( !_read_bank_nodes(axrat_p, "axrat", bank->axrat) ) {
+			return NULL;
+		}
+	}
+	else {
+		for(unsigned int i = 1; i <= 10; i++) {
+			bank->axrat.push_back(i / 10.);
+		}
+	}
+	if( box_p ) {
+		if( !_read_bank_nodes(box_p, "box", bank->box) ) {
+			return NULL;
+		}
+	}
+	else {
+		bank->box.push_back(0);
+	}
+	if( size < 4 || !(re > 0) ) {
+		PYPROFIT_RAISE("size must be at least 4 and re must be positive");
+	}
+	if( threads == 0 ) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		bank->build(threads);
+	} catch (std::exception &e) {
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS
+
+	if( !error.empty() ) {
+		PYPROFIT_RAISE(error.c_str());
+	}
+	return _new_sersicbank(std::move(bank));
+}
+
+static PyObject *pyprofit_load_sersic_bank(PyObject *self, PyObject *args) {
+
+	const char *path;
+	if( !PyArg_ParseTuple(args, "s:load_sersic_bank", &path) ) {
+		return NULL;
+	}
+
+	auto bank = std::make_shared<sersic_bank>();
+	std::string error;
+	bool io_error = false;
+	Py_BEGIN_ALLOW_THREADS
+	std::FILE *f = std::fopen(path, "rb");
+	if( !f ) {
+		io_error = true;
+	}
+	else {
+		std::string data;
+		char chunk[65536];
+		std::size_t n;
+		while( (n = std::fread(chunk, 1, sizeof(chunk), f)) > 0 ) {
+			data.append(chunk, n);
+		}
+		io_error = std::ferror(f) != 0;
+		std::fclose(f);
+		if( !io_error ) {
+			try {
+				bank->deserialise(data);
+			} catch (std::exception &e) {
+				error = e.what();
+			}
 		}
-		PyTuple_SetItem(image_tuple, i, row_tuple);
 	}
+	Py_END_ALLOW_THREADS
 
-	/* Copy offset into another 2-element tuple */
-	PyTuple_SetItem(offset_tuple, 0, PyFloat_FromDouble(offset.x));
-	PyTuple_SetItem(offset_tuple, 1, PyFloat_FromDouble(offset.y));
+	if( io_error ) {
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+	}
+	if( !error.empty() ) {
+		PYPROFIT_RAISE(error.c_str());
+	}
+	return _new_sersicbank(std::move(bank));
+}
 
-	PyTuple_SetItem(return_tuple, 0, image_tuple);
-	PyTuple_SetItem(return_tuple, 1, offset_tuple);
-	return return_tuple;
+static PyObject *sersicbank_save(PySersicBank *self, PyObject *args) {
+
+	const char *path;
+	if( !PyArg_ParseTuple(args, "s:save", &path) ) {
+		return NULL;
+	}
+
+	auto bank = self->bank;
+	bool io_error = false;
+	Py_BEGIN_ALLOW_THREADS
+	auto data = bank->serialise();
+	std::FILE *f = std::fopen(path, "wb");
+	if( !f ) {
+		io_error = true;
+	}
+	else {
+		io_error = std::fwrite(data.data(), 1, data.size(), f) != data.size();
+		io_error = (std::fclose(f) != 0) || io_error;
+	}
+	Py_END_ALLOW_THREADS
+
+	if( io_error ) {
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+	}
+	Py_RETURN_NONE;
+}
+
+/*
+ * Renders a model made only of sersic profiles from the bank. Returns the
+ * same (image, offset) tuple as make_model.
+ */
+static PyObject *sersicbank_render(PySersicBank *self, PyObject *model_dict) {
+
+	model_spec spec;
+	if( !_read_model_spec(model_dict, spec) ) {
+		return NULL;
+	}
+	if( spec.native_conv ) {
+		PYPROFIT_RAISE("OTF and hybrid convolvers are only supported by make_model and make_models");
+	}
+
+	auto bank = self->bank;
+	std::vector<double> values;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		values = bank->render(spec);
+	} catch (std::exception &e) {
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS
+
+	if( !error.empty() ) {
+		PYPROFIT_RAISE(error.c_str());
+	}
+	Image image(std::move(values), spec.width, spec.height);
+	return _image_to_tuple(image, Point());
+}
+
+/*
+ * Reports the accuracy of the bank by rendering random profiles within its
+ * range both from the bank and directly with libprofit.
+ */
+static PyObject *sersicbank_validate(PySersicBank *self, PyObject *args, PyObject *kwargs) {
+
+	unsigned int samples = 20, seed = 0;
+	const char *kwlist[] = {"samples", "seed", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "|II:validate", const_cast<char **>(kwlist), &samples, &seed) ) {
+		return NULL;
+	}
+
+	auto bank = self->bank;
+	std::pair<double, double> errors;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		errors = bank->validate(samples, seed);
+	} catch (std::exception &e) {
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS
+
+	if( !error.empty() ) {
+		PYPROFIT_RAISE(error.c_str());
+	}
+	return Py_BuildValue("{s:d,s:d,s:I}", "max_error", errors.first, "mean_error", errors.second, "samples", samples);
+}
+
+static PyObject *sersicbank_get_nodes(PySersicBank *self, void *closure) {
+	auto &bank = *self->bank;
+	PyObject *axes[3] = {NULL, NULL, NULL};
+	const std::vector<double> *nodes[3] = {&bank.nser, &bank.axrat, &bank.box};
+	for(int a = 0; a != 3; a++) {
+		axes[a] = PyTuple_New(nodes[a]->size());
+		if( !axes[a] ) {
+			Py_XDECREF(axes[0]);
+			Py_XDECREF(axes[1]);
+			return NULL;
+		}
+		for(std::size_t i = 0; i != nodes[a]->size(); i++) {
+			PyTuple_SET_ITEM(axes[a], i, PyFloat_FromDouble((*nodes[a])[i]));
+		}
+	}
+	return Py_BuildValue("{s:N,s:N,s:N,s:I,s:d}", "nser", axes[0], "axrat", axes[1], "box", axes[2],
+	                     "size", bank.size, "re", bank.re);
+}
+
+static PyMethodDef PySersicBank_methods[] = {
+    {"render",   (PyCFunction)sersicbank_render,   METH_O,       "Renders a model of sersic profiles from the bank."},
+    {"validate", (PyCFunction)sersicbank_validate, METH_VARARGS | METH_KEYWORDS, "Measures the bank's accuracy against direct evaluation."},
+    {"save",     (PyCFunction)sersicbank_save,     METH_VARARGS, "Saves the bank to a file."},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyGetSetDef PySersicBank_getset[] = {
+    {const_cast<char *>("nodes"), (getter)sersicbank_get_nodes, NULL, const_cast<char *>("Nodes and stamp geometry of the bank"), NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+#ifdef PYPROFIT_HAS_SERVE
+
+/*
+ * Evaluation server
+ *
+ * serve() listens on a Unix domain socket and evaluates models on behalf
+ * of other processes, which don't need to embed a python interpreter.
+ * All integers and doubles travel in host byte order.
+ *
+ * Requests are made of a 24 bytes header followed by a payload:
+ *
+ *   uint32 magic ('PPRQ'), uint32 type, uint64 request id, uint64 payload size
+ *
+ * Request types and their payloads are:
+ *
+ *  * PYPROFIT_SERVE_EVALUATE: a model, in the same binary format used to
+ *    pickle compiled models: a uint32 format version followed by the fields
+ *    written by _write_model_spec.
+ *  * PYPROFIT_SERVE_REGISTER: a model, as above. It is compiled and cached
+ *    in the server, and its template id is returned as a uint64.
+ *  * PYPROFIT_SERVE_EVALUATE_TEMPLATE: a uint64 template id, a uint32 number
+ *    of parameter updates and, for each, a uint32 profile index, a uint32
+ *    name length, the parameter name, and a double value. Updates are
+ *    applied to the cached template (and thus persist) before evaluating it.
+ *  * PYPROFIT_SERVE_RELEASE: a uint64 template id to be removed.
+ *
+ * Templates can only be evaluated and released by the connection that
+ * registered them, and are removed when it is closed. Payloads larger than
+ * max_payload bytes close the connection.
+ *
+ * Replies have the same header layout (magic 'PPRP', with the second field
+ * being a status instead of a type) and echo the request id. Successful
+ * evaluations carry a uint32 width and height, two doubles with the image
+ * offset, and the image values; errors carry a UTF-8 message.
+ *
+ * Requests are queued into a bounded queue served by a pool of native
+ * worker threads, which take up to max_batch requests at a time and
+ * evaluate identical models within a batch only once. When the queue is
+ * full the server stops reading from its clients, so backpressure reaches
+ * them through their sockets. The same happens to a single client whose
+ * replies pile up unread beyond PYPROFIT_SERVE_MAX_PENDING bytes, or that
+ * already has enough requests in flight to keep all workers busy.
+ */
+enum serve_request_type {
+	PYPROFIT_SERVE_EVALUATE = 1,
+	PYPROFIT_SERVE_REGISTER = 2,
+	PYPROFIT_SERVE_EVALUATE_TEMPLATE = 3,
+	PYPROFIT_SERVE_RELEASE = 4
+};
+
+enum serve_reply_status {
+	PYPROFIT_SERVE_OK = 0,
+	PYPROFIT_SERVE_ERROR = 1
+};
+
+static const std::uint32_t PYPROFIT_SERVE_REQUEST_MAGIC = 0x51525050; /* "PPRQ" */
+static const std::uint32_t PYPROFIT_SERVE_REPLY_MAGIC = 0x50525050;   /* "PPRP" */
+static const std::size_t PYPROFIT_SERVE_HEADER_SIZE = 24;
+static const std::uint64_t PYPROFIT_SERVE_MAX_PAYLOAD = std::uint64_t(64) << 20;
+static const std::size_t PYPROFIT_SERVE_MAX_PENDING = std::size_t(64) << 20;
+
+struct serve_connection {
+	int fd;
+	std::string in;
+	std::mutex out_lock;
+	std::string out;
+	std::atomic<bool> closed;
+
+	/* Requests queued or being evaluated */
+	std::atomic<std::size_t> in_flight;
+
+	serve_connection(int fd) : fd(fd), closed(false), in_flight(0) {}
+};
+
+typedef std::shared_ptr<serve_connection> serve_connection_ptr;
+
+/* A template registered by a connection, removed with it */
+struct serve_template {
+	std::shared_ptr<compiled_model> compiled;
+	const serve_connection *owner;
+};
+
+struct serve_request {
+	serve_connection_ptr conn;
+	std::uint32_t type;
+	std::uint64_t id;
+	std::string payload;
+};
+
+class evaluation_server {
+public:
+	evaluation_server(unsigned int n_workers, std::size_t max_queue, std::size_t max_batch, std::uint64_t max_payload) :
+		n_workers(n_workers), max_queue(max_queue), max_batch(max_batch), max_payload(max_payload),
+		stopping(false), next_template_id(1), listen_fd(-1)
+	{
+		wake_fds[0] = wake_fds[1] = -1;
+	}
+
+	~evaluation_server() {
+		stop_workers();
+		for(auto &conn: connections) {
+			close(conn->fd);
+		}
+		if( listen_fd != -1 ) {
+			close(listen_fd);
+		}
+		for(auto fd: wake_fds) {
+			if( fd != -1 ) {
+				close(fd);
+			}
+		}
+	}
+
+	/* Binds to @path; returns an error message on failure */
+	std::string listen(const std::string &path, unsigned int mode) {
+
+		struct sockaddr_un addr;
+		if( path.size() >= sizeof(addr.sun_path) ) {
+			return "socket path too long";
+		}
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+		/* Remove stale sockets from previous runs */
+		struct stat st;
+		if( stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode) ) {
+			unlink(path.c_str());
+		}
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if( listen_fd == -1 ||
+		    bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ) {
+			return std::strerror(errno);
+		}
+
+		/* From here on the socket file exists, and is removed on errors */
+		if( chmod(path.c_str(), mode) == -1 ||
+		    ::listen(listen_fd, 64) == -1 ||
+		    pipe(wake_fds) == -1 ) {
+			int err = errno;
+			unlink(path.c_str());
+			return std::strerror(err);
+		}
+		set_nonblocking(listen_fd);
+		set_nonblocking(wake_fds[0]);
+		set_nonblocking(wake_fds[1]);
+		return std::string();
+	}
+
+	/*
+	 * Serves requests until @interrupted returns true. @interrupted is
+	 * called regularly from the calling thread.
+	 */
+	template <typename Callable>
+	void run(Callable interrupted) {
+
+		for(unsigned int i = 0; i != n_workers; i++) {
+			workers.emplace_back(&evaluation_server::work, this);
+		}
+
+		std::vector<struct pollfd> fds;
+		while( !interrupted() ) {
+
+			bool accepting = queue_size() < max_queue;
+			fds.clear();
+			fds.push_back({listen_fd, POLLIN, 0});
+			fds.push_back({wake_fds[0], POLLIN, 0});
+			for(auto &conn: connections) {
+				short events = accepting && !throttled(*conn) ? POLLIN : 0;
+				std::lock_guard<std::mutex> guard(conn->out_lock);
+				if( !conn->out.empty() ) {
+					events |= POLLOUT;
+				}
+				fds.push_back({conn->fd, events, 0});
+			}
+
+			if( poll(fds.data(), fds.size(), 250) <= 0 ) {
+				continue;
+			}
+
+			if( fds[1].revents & POLLIN ) {
+				char buf[256];
+				while( read(wake_fds[0], buf, sizeof(buf)) > 0 );
+			}
+
+			for(std::size_t i = 0; i != connections.size(); i++) {
+				auto &conn = connections[i];
+				auto revents = fds[i + 2].revents;
+				if( revents & (POLLERR | POLLNVAL) ) {
+					conn->closed = true;
+				}
+				if( !conn->closed && (revents & (POLLIN | POLLHUP)) ) {
+					receive(conn);
+				}
+				if( !conn->closed && (revents & POLLOUT) ) {
+					send(conn);
+				}
+			}
+
+			/* Requests might have been left unqueued when the queue was full */
+			for(auto &conn: connections) {
+				if( !conn->closed ) {
+					parse_requests(conn);
+				}
+			}
+
+			auto closed_end = std::remove_if(connections.begin(), connections.end(), [this](const serve_connection_ptr &conn) {
+				if( conn->closed ) {
+					close(conn->fd);
+					drop_templates(conn.get());
+				}
+				return conn->closed.load();
+			});
+			connections.erase(closed_end, connections.end());
+
+			if( fds[0].revents & POLLIN ) {
+				int fd;
+				while( (fd = accept(listen_fd, NULL, NULL)) != -1 ) {
+					set_nonblocking(fd);
+					connections.push_back(std::make_shared<serve_connection>(fd));
+				}
+			}
+		}
+
+		stop_workers();
+	}
+
+private:
+	unsigned int n_workers;
+	std::size_t max_queue;
+	std::size_t max_batch;
+	std::uint64_t max_payload;
+
+	std::mutex queue_lock;
+	std::condition_variable queue_cv;
+	std::deque<serve_request> queue;
+	bool stopping;
+	std::vector<std::thread> workers;
+
+	std::mutex templates_lock;
+	std::map<std::uint64_t, serve_template> templates;
+	std::uint64_t next_template_id;
+
+	int listen_fd;
+	int wake_fds[2];
+	std::vector<serve_connection_ptr> connections;
+
+	static void set_nonblocking(int fd) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	/* Removes the templates registered by @owner, which has been closed */
+	void drop_templates(const serve_connection *owner) {
+		std::lock_guard<std::mutex> guard(templates_lock);
+		for(auto it = templates.begin(); it != templates.end(); ) {
+			if( it->second.owner == owner ) {
+				it = templates.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	/*
+	 * Whether @conn should be left unread until it catches up with its
+	 * replies, so its unread replies stay bounded
+	 */
+	bool throttled(serve_connection &conn) {
+		if( conn.in_flight >= std::size_t(n_workers) * max_batch ) {
+			return true;
+		}
+		std::lock_guard<std::mutex> guard(conn.out_lock);
+		return conn.out.size() >= PYPROFIT_SERVE_MAX_PENDING;
+	}
+
+	std::size_t queue_size() {
+		std::lock_guard<std::mutex> guard(queue_lock);
+		return queue.size();
+	}
+
+	void stop_workers() {
+		{
+			std::lock_guard<std::mutex> guard(queue_lock);
+			stopping = true;
+		}
+		queue_cv.notify_all();
+		for(auto &worker: workers) {
+			worker.join();
+		}
+		workers.clear();
+	}
+
+	void receive(const serve_connection_ptr &conn) {
+		char buf[65536];
+		ssize_t n;
+		while( (n = read(conn->fd, buf, sizeof(buf))) > 0 ) {
+			conn->in.append(buf, n);
+			if( std::size_t(n) < sizeof(buf) ) {
+				break;
+			}
+		}
+		if( n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) {
+			conn->closed = true;
+		}
+	}
+
+	void send(const serve_connection_ptr &conn) {
+		std::lock_guard<std::mutex> guard(conn->out_lock);
+		ssize_t n = write(conn->fd, conn->out.data(), conn->out.size());
+		if( n > 0 ) {
+			conn->out.erase(0, n);
+		}
+		else if( n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+			conn->closed = true;
+		}
+	}
+
+	/* Moves complete requests from the connection into the queue */
+	void parse_requests(const serve_connection_ptr &conn) {
+
+		std::size_t pos = 0;
+		while( conn->in.size() - pos >= PYPROFIT_SERVE_HEADER_SIZE ) {
+
+			spec_reader r(conn->in.data() + pos, PYPROFIT_SERVE_HEADER_SIZE);
+			auto magic = r.get<std::uint32_t>();
+			auto type = r.get<std::uint32_t>();
+			auto id = r.get<std::uint64_t>();
+			auto size = r.get<std::uint64_t>();
+			if( magic != PYPROFIT_SERVE_REQUEST_MAGIC || size > max_payload ) {
+				conn->closed = true;
+				return;
+			}
+			if( conn->in.size() - pos - PYPROFIT_SERVE_HEADER_SIZE < size ) {
+				break;
+			}
+
+			if( throttled(*conn) ) {
+				break;
+			}
+			{
+				std::lock_guard<std::mutex> guard(queue_lock);
+				if( queue.size() >= max_queue ) {
+					break;
+				}
+				conn->in_flight++;
+				auto payload_start = pos + PYPROFIT_SERVE_HEADER_SIZE;
+				queue.push_back({conn, type, id, conn->in.substr(payload_start, size)});
+			}
+			queue_cv.notify_one();
+			pos += PYPROFIT_SERVE_HEADER_SIZE + size;
+		}
+		conn->in.erase(0, pos);
+	}
+
+	void reply(const serve_request &req, std::uint32_t status, const std::string &payload) {
+		spec_writer w;
+		w.put(PYPROFIT_SERVE_REPLY_MAGIC);
+		w.put(status);
+		w.put(req.id);
+		w.put(std::uint64_t(payload.size()));
+		w.buffer.append(payload);
+		{
+			std::lock_guard<std::mutex> guard(req.conn->out_lock);
+			req.conn->out.append(w.buffer);
+		}
+		req.conn->in_flight--;
+		char c = 0;
+		if( write(wake_fds[1], &c, 1) == -1 ) {
+			/* the pipe is full, the IO thread will wake up anyway */
+		}
+	}
+
+	static std::string image_payload(const Image &image, const Point &offset) {
+		spec_writer w;
+		auto dims = image.getDimensions();
+		w.put(std::uint32_t(dims.x));
+		w.put(std::uint32_t(dims.y));
+		w.put(offset.x);
+		w.put(offset.y);
+		w.buffer.reserve(w.buffer.size() + sizeof(double) * dims.x * dims.y);
+		for(std::size_t i = 0; i != std::size_t(dims.x) * dims.y; i++) {
+			w.put(image[i]);
+		}
+		return std::move(w.buffer);
+	}
+
+	static void read_spec(const std::string &payload, model_spec &spec) {
+		spec_reader r(payload.data(), payload.size());
+		if( r.get<unsigned int>() != PYPROFIT_MODEL_STATE_VERSION ) {
+			throw std::invalid_argument("Unsupported model format version");
+		}
+		_read_model_spec(r, spec);
+		if( !r.at_end() ) {
+			throw std::invalid_argument("Unexpected trailing data in model");
+		}
+		if( !spec.calcmask.empty() && spec.calcmask.size() != std::size_t(spec.width) * spec.height ) {
+			throw std::invalid_argument("calcmask must have same dimensions of image");
+		}
+	}
+
+	/* Templates of other connections are reported as unknown */
+	std::map<std::uint64_t, serve_template>::iterator find_template(std::uint64_t id, const serve_connection *owner) {
+		auto it = templates.find(id);
+		if( it == templates.end() || it->second.owner != owner ) {
+			throw std::invalid_argument("Unknown template id");
+		}
+		return it;
+	}
+
+	void work() {
+		while( true ) {
+			std::vector<serve_request> batch;
+			{
+				std::unique_lock<std::mutex> guard(queue_lock);
+				queue_cv.wait(guard, [this]() { return stopping || !queue.empty(); });
+				if( stopping ) {
+					return;
+				}
+				while( !queue.empty() && batch.size() < max_batch ) {
+					batch.push_back(std::move(queue.front()));
+					queue.pop_front();
+				}
+			}
+
+			/* The queue has room now */
+			char c = 0;
+			if( write(wake_fds[1], &c, 1) == -1 ) {
+				/* the pipe is full, the IO thread will wake up anyway */
+			}
+
+			process(batch);
+		}
+	}
+
+	void process(std::vector<serve_request> &batch) {
+
+		/* Identical models within the batch are evaluated only once */
+		std::unordered_map<std::string, std::pair<Image, Point>> evaluated;
+
+		for(auto &req: batch) {
+			if( req.conn->closed ) {
+				continue;
+			}
+			try {
+				switch(req.type) {
+				case PYPROFIT_SERVE_EVALUATE: {
+					model_spec spec;
+					read_spec(req.payload, spec);
+					auto key = _model_spec_key(spec);
+					auto it = evaluated.find(key);
+					if( it == evaluated.end() ) {
+						Image image;
+						Point offset;
+						std::vector<std::string> warnings;
+						auto error = _evaluate_spec(spec, image, offset, warnings);
+						if( !error.empty() ) {
+							throw std::runtime_error(error);
+						}
+						it = evaluated.emplace(std::move(key), std::make_pair(std::move(image), offset)).first;
+					}
+					reply(req, PYPROFIT_SERVE_OK, image_payload(it->second.first, it->second.second));
+					break;
+				}
+				case PYPROFIT_SERVE_REGISTER: {
+					auto compiled = std::make_shared<compiled_model>();
+					read_spec(req.payload, compiled->spec);
+					compiled->build();
+					std::uint64_t id;
+					{
+						std::lock_guard<std::mutex> guard(templates_lock);
+						id = next_template_id++;
+						templates[id] = {compiled, req.conn.get()};
+
+						/* The connection might have been dropped (with its templates) already */
+						if( req.conn->closed ) {
+							templates.erase(id);
+						}
+					}
+					spec_writer w;
+					w.put(id);
+					reply(req, PYPROFIT_SERVE_OK, w.buffer);
+					break;
+				}
+				case PYPROFIT_SERVE_EVALUATE_TEMPLATE: {
+					spec_reader r(req.payload.data(), req.payload.size());
+					auto id = r.get<std::uint64_t>();
+					std::shared_ptr<compiled_model> compiled;
+					{
+						std::lock_guard<std::mutex> guard(templates_lock);
+						compiled = find_template(id, req.conn.get())->second.compiled;
+					}
+					Image image;
+					Point offset;
+					{
+						std::lock_guard<std::mutex> guard(compiled->lock);
+						auto n_updates = r.get<std::uint32_t>();
+						for(std::uint32_t i = 0; i != n_updates; i++) {
+							auto profile_idx = r.get<std::uint32_t>();
+							auto name = r.get_string();
+							compiled->set_parameter(profile_idx, name, r.get<double>());
+						}
+						image = compiled->evaluate(offset);
+					}
+					reply(req, PYPROFIT_SERVE_OK, image_payload(image, offset));
+					break;
+				}
+				case PYPROFIT_SERVE_RELEASE: {
+					spec_reader r(req.payload.data(), req.payload.size());
+					auto id = r.get<std::uint64_t>();
+					std::lock_guard<std::mutex> guard(templates_lock);
+					templates.erase(find_template(id, req.conn.get()));
+					reply(req, PYPROFIT_SERVE_OK, std::string());
+					break;
+				}
+				default:
+					throw std::invalid_argument("Unknown request type");
+				}
+			} catch (std::exception &e) {
+				reply(req, PYPROFIT_SERVE_ERROR, e.what());
+			}
+		}
+	}
+};
+
+static PyObject *pyprofit_serve(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	const char *path;
+	unsigned int workers = std::max(1u, std::thread::hardware_concurrency());
+	unsigned int max_queue = 0;
+	unsigned int max_batch = 16;
+	unsigned int mode = 0600;
+	unsigned long long max_payload = PYPROFIT_SERVE_MAX_PAYLOAD;
+
+	const char *kwlist[] = {"path", "workers", "max_queue", "max_batch", "mode", "max_payload", NULL};
+	if( !PyArg_ParseTupleAndKeywords(args, kwargs, "s|IIIIK:serve", const_cast<char **>(kwlist),
+	                                 &path, &workers, &max_queue, &max_batch, &mode, &max_payload) ) {
+		return NULL;
+	}
+	if( workers == 0 || max_batch == 0 || max_payload == 0 ) {
+		PYPROFIT_RAISE("workers, max_batch and max_payload must be positive");
+	}
+	if( max_queue == 0 ) {
+		max_queue = 4 * workers * max_batch;
+	}
+
+	evaluation_server server(workers, max_queue, max_batch, max_payload);
+	auto error = server.listen(path, mode);
+	if( !error.empty() ) {
+		std::ostringstream os;
+		os << "Error while listening on " << path << ": " << error;
+		PYPROFIT_RAISE(os.str().c_str());
+	}
+
+	/* Serve until interrupted by a signal (e.g., Ctrl-C) */
+	bool interrupted = false;
+	Py_BEGIN_ALLOW_THREADS
+	server.run([&]() {
+		Py_BLOCK_THREADS
+		interrupted = PyErr_CheckSignals() != 0;
+		Py_UNBLOCK_THREADS
+		return interrupted;
+	});
+	Py_END_ALLOW_THREADS
+
+	unlink(path);
+	if( interrupted ) {
+		return NULL;
+	}
+	Py_RETURN_NONE;
 }
 
+#endif // PYPROFIT_HAS_SERVE
+
 /*
  * Methods in the pyprofit module
  */
 static PyMethodDef pyprofit_methods[] = {
-    {"make_model",     pyprofit_make_model,     METH_VARARGS, "Creates a profit model."},
+    {"make_model",     (PyCFunction)pyprofit_make_model, METH_VARARGS | METH_KEYWORDS, "Creates a profit model."},
+    {"make_models",    (PyCFunction)pyprofit_make_models, METH_VARARGS | METH_KEYWORDS, "Creates a batch of profit models, evaluating duplicates only once."},
     {"make_convolver", (PyCFunction)pyprofit_make_convolver, METH_VARARGS | METH_KEYWORDS, "Creates a reusable convolver."},
+    {"compile_model",  (PyCFunction)pyprofit_compile_model, METH_VARARGS | METH_KEYWORDS, "Compiles a profit model for repeated evaluation."},
+    {"fit_batch",      (PyCFunction)pyprofit_fit_batch, METH_VARARGS | METH_KEYWORDS, "Fits a batch of independent problems in parallel."},
+    {"group_sources",  (PyCFunction)pyprofit_group_sources, METH_VARARGS | METH_KEYWORDS, "Splits a model into groups of overlapping sources."},
+    {"register_profile", pyprofit_register_profile, METH_O, "Registers a profile type implemented by another extension."},
+    {"make_sersic_bank", (PyCFunction)pyprofit_make_sersic_bank, METH_VARARGS | METH_KEYWORDS, "Builds a bank of sersic stamps."},
+    {"load_sersic_bank", pyprofit_load_sersic_bank, METH_VARARGS, "Loads a bank of sersic stamps from a file."},
     {"opencl_info",    pyprofit_opencl_info,    METH_NOARGS,  "Gets OpenCL environment information."},
+#ifdef PYPROFIT_HAS_SERVE
+    {"serve",          (PyCFunction)pyprofit_serve, METH_VARARGS | METH_KEYWORDS, "Serves model evaluations over a Unix domain socket."},
+#endif // PYPROFIT_HAS_SERVE
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -823,6 +8095,12 @@ MOD_INIT(pyprofit)
 	}
 #endif
 	Py_AtExit(_pyprofit_finish);
+#ifdef PYPROFIT_HAS_ATFORK
+	static bool atfork_registered = false;
+	if( !atfork_registered ) {
+		atfork_registered = pthread_atfork(_fork_prepare, _fork_release, _fork_release) == 0;
+	}
+#endif // PYPROFIT_HAS_ATFORK
 
 	MOD_DEF(m, "pyprofit", "libprofit wrapper for python", pyprofit_methods);
 	if( m == NULL ) {
@@ -844,17 +8122,86 @@ MOD_INIT(pyprofit)
 	PyConvolver_Type.tp_new = PyType_GenericNew;
 	PyConvolver_Type.tp_dealloc = (destructor)convolverptr_dealloc;
 	PyConvolver_Type.tp_init = (initproc)NULL;
+	PyConvolver_Type.tp_methods = PyConvolver_methods;
+	PyConvolver_Type.tp_getset = PyConvolver_getset;
 	if( PyType_Ready(&PyConvolver_Type) < 0 ) {
 		return MOD_VAL(NULL);
 	}
 	Py_INCREF(&PyConvolver_Type);
 
+	PyModel_Type.tp_flags = Py_TPFLAGS_DEFAULT;
+	PyModel_Type.tp_doc = "A compiled profit model";
+	PyModel_Type.tp_new = PyType_GenericNew;
+	PyModel_Type.tp_dealloc = (destructor)model_dealloc;
+	PyModel_Type.tp_init = (initproc)NULL;
+	PyModel_Type.tp_methods = PyModel_methods;
+	PyModel_Type.tp_getset = PyModel_getset;
+	if( PyType_Ready(&PyModel_Type) < 0 ) {
+		return MOD_VAL(NULL);
+	}
+	Py_INCREF(&PyModel_Type);
+	PyModule_AddObject(m, "model", (PyObject *)&PyModel_Type);
+
+	PySersicBank_Type.tp_flags = Py_TPFLAGS_DEFAULT;
+	PySersicBank_Type.tp_doc = "A bank of sersic stamps";
+	PySersicBank_Type.tp_dealloc = (destructor)sersicbank_dealloc;
+	PySersicBank_Type.tp_methods = PySersicBank_methods;
+	PySersicBank_Type.tp_getset = PySersicBank_getset;
+	if( PyType_Ready(&PySersicBank_Type) < 0 ) {
+		return MOD_VAL(NULL);
+	}
+	Py_INCREF(&PySersicBank_Type);
+	PyModule_AddObject(m, "sersicbank", (PyObject *)&PySersicBank_Type);
+
+	PyImage_Type.tp_flags = Py_TPFLAGS_DEFAULT
+#if PY_MAJOR_VERSION < 3
+	    | Py_TPFLAGS_HAVE_NEWBUFFER
+#endif
+	    ;
+	PyImage_Type.tp_doc = "An evaluated image";
+	PyImage_Type.tp_dealloc = (destructor)image_dealloc;
+	PyImage_Type.tp_methods = PyImage_methods;
+	PyImage_Type.tp_getset = PyImage_getset;
+	PyImage_Type.tp_as_buffer = &image_as_buffer;
+	if( PyType_Ready(&PyImage_Type) < 0 ) {
+		return MOD_VAL(NULL);
+	}
+	Py_INCREF(&PyImage_Type);
+	PyModule_AddObject(m, "image", (PyObject *)&PyImage_Type);
+
+	PyObject *c_api = PyCapsule_New(const_cast<pyprofit_C_API *>(&pyprofit_c_api), PYPROFIT_C_API_CAPSULE, NULL);
+	if( c_api == NULL || PyModule_AddObject(m, "_C_API", c_api) == -1 ) {
+		Py_XDECREF(c_api);
+		return MOD_VAL(NULL);
+	}
+
+#ifdef PYPROFIT_HAS_SHM
+	PySharedBuffer_Type.tp_flags = Py_TPFLAGS_DEFAULT
+#if PY_MAJOR_VERSION < 3
+	    | Py_TPFLAGS_HAVE_NEWBUFFER
+#endif
+	    ;
+	PySharedBuffer_Type.tp_doc = "A matrix stored in POSIX shared memory";
+	PySharedBuffer_Type.tp_new = PyType_GenericNew;
+	PySharedBuffer_Type.tp_dealloc = (destructor)sharedbuffer_dealloc;
+	PySharedBuffer_Type.tp_init = (initproc)sharedbuffer_init;
+	PySharedBuffer_Type.tp_methods = PySharedBuffer_methods;
+	PySharedBuffer_Type.tp_getset = PySharedBuffer_getset;
+	PySharedBuffer_Type.tp_as_buffer = &sharedbuffer_as_buffer;
+	if( PyType_Ready(&PySharedBuffer_Type) < 0 ) {
+		return MOD_VAL(NULL);
+	}
+	Py_INCREF(&PySharedBuffer_Type);
+	PyModule_AddObject(m, "sharedbuffer", (PyObject *)&PySharedBuffer_Type);
+#endif // PYPROFIT_HAS_SHM
+
 	if (profit::has_opencl()) {
 		PyOpenCLEnv_Type.tp_flags = Py_TPFLAGS_DEFAULT;
 		PyOpenCLEnv_Type.tp_doc = "An OpenCL environment";
 		PyOpenCLEnv_Type.tp_new = PyType_GenericNew;
 		PyOpenCLEnv_Type.tp_dealloc = (destructor)openclenv_dealloc;
 		PyOpenCLEnv_Type.tp_init = (initproc)openclenv_init;
+		PyOpenCLEnv_Type.tp_methods = PyOpenCLEnv_methods;
 		if( PyType_Ready(&PyOpenCLEnv_Type) < 0 ) {
 			return MOD_VAL(NULL);
 		}
@@ -0,0 +1,180 @@
+/**
+ * Public C API of pyprofit
+ *
+ * ICRAR - International Centre for Radio Astronomy Research
+ * (c) UWA - The University of Western Australia, 2016
+ * Copyright by UWA (in the framework of the ICRAR)
+ * All rights reserved
+ *
+ * This file is part of pyprofit.
+ *
+ * libprofit is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libprofit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libprofit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PYPROFIT_H
+#define PYPROFIT_H
+
+#include <Python.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Custom profile types
+ *
+ * Other extensions can add radial profile types to pyprofit. A type is
+ * described by a pyprofit_profile_type, wrapped in a capsule named
+ * PYPROFIT_PROFILE_TYPE_CAPSULE and given to pyprofit.register_profile()
+ * (or registered directly with pyprofit_register_profile below). From then
+ * on profiles of that type can be given in the profiles dictionary of
+ * models under the type's name, and are evaluated natively by pyprofit.
+ *
+ * Besides their own parameters, profiles of these types take xcen, ycen,
+ * mag, ang, axrat, box, convolve, and the rough, resolution, max_recursions
+ * and acc subsampling parameters, with the same meaning as for libprofit's
+ * radial profiles. The surface brightness is normalised so that the total
+ * flux corresponds to mag.
+ *
+ * The functions of a type are called without holding the GIL, and possibly
+ * from several threads at once, so they must be thread-safe and must not
+ * touch any python object. The description, and everything it points to,
+ * must remain valid for the life of the process.
+ */
+#define PYPROFIT_PROFILE_TYPE_VERSION 1
+#define PYPROFIT_PROFILE_TYPE_CAPSULE "pyprofit.profile_type"
+
+typedef struct {
+
+	/* Must be PYPROFIT_PROFILE_TYPE_VERSION */
+	unsigned int version;
+
+	/* The name of the type, as used in the profiles dictionary */
+	const char *name;
+
+	/* NULL-terminated names of the type's own parameters, and their defaults */
+	const char *const *parameters;
+	const double *defaults;
+
+	/*
+	 * Surface brightness at boxy elliptical radius @r (in image coordinates),
+	 * given the values of the type's own parameters in the order above
+	 */
+	double (*evaluate)(double r, const double *parameters, void *user_data);
+
+	/* Total flux of a circular profile: the integral of 2 pi r I(r) dr */
+	double (*flux)(const double *parameters, void *user_data);
+
+	/* Radius beyond which the surface brightness can be neglected */
+	double (*extent)(const double *parameters, void *user_data);
+
+	/* Passed to all functions above */
+	void *user_data;
+
+} pyprofit_profile_type;
+
+/*
+ * Registers @type with pyprofit. Returns 0 on success, and -1 with a python
+ * exception set on error. Must be called holding the GIL.
+ */
+static inline int pyprofit_register_profile(pyprofit_profile_type *type)
+{
+	PyObject *pyprofit, *capsule, *result;
+
+	pyprofit = PyImport_ImportModule("pyprofit");
+	if (pyprofit == NULL) {
+		return -1;
+	}
+	capsule = PyCapsule_New(type, PYPROFIT_PROFILE_TYPE_CAPSULE, NULL);
+	if (capsule == NULL) {
+		Py_DECREF(pyprofit);
+		return -1;
+	}
+	result = PyObject_CallMethod(pyprofit, (char *)"register_profile", (char *)"O", capsule);
+	Py_DECREF(capsule);
+	Py_DECREF(pyprofit);
+	if (result == NULL) {
+		return -1;
+	}
+	Py_DECREF(result);
+	return 0;
+}
+
+/*
+ * C-API
+ *
+ * pyprofit exports a pyprofit_C_API in the pyprofit._C_API capsule, which
+ * other compiled extensions (Cython, numba, C/C++) can use to evaluate
+ * compiled models without going through python objects. It is obtained
+ * with pyprofit_import_C_API below.
+ *
+ * A template binds a pyprofit.model, created with pyprofit.compile_model,
+ * to a list of free parameters given like for model.jacobian, as
+ * (profile, index, name) tuples. Templates are evaluated at a vector of
+ * values of those parameters, which are kept in the model afterwards.
+ * Creating a template needs the GIL; all other functions can be called
+ * without it. Calls on templates of the same model are serialised. Calls
+ * returning int return 0 on success and -1 on error, in which case
+ * template_error returns the reason.
+ */
+#define PYPROFIT_C_API_VERSION 1
+#define PYPROFIT_C_API_CAPSULE "pyprofit._C_API"
+
+typedef struct pyprofit_template pyprofit_template;
+
+typedef struct {
+
+	/* PYPROFIT_C_API_VERSION of the exporting pyprofit */
+	unsigned int version;
+
+	/* Returns a new template, or NULL with a python exception set */
+	pyprofit_template *(*template_new)(PyObject *model, PyObject *parameters);
+	void (*template_free)(pyprofit_template *t);
+
+	/* Number of free parameters of the template */
+	unsigned int (*template_parameters)(const pyprofit_template *t);
+
+	/* Dimensions of the images written by evaluate */
+	int (*template_shape)(pyprofit_template *t, unsigned int *width, unsigned int *height);
+
+	/* Evaluates the model into @image, a row-major width x height array */
+	int (*evaluate)(pyprofit_template *t, const double *parameters, double *image);
+
+	/* Gaussian log-likelihood of the data set on the model (see model.set_data) */
+	int (*likelihood)(pyprofit_template *t, const double *parameters, double *loglike);
+
+	/* The reason of the last error of @t */
+	const char *(*template_error)(const pyprofit_template *t);
+
+} pyprofit_C_API;
+
+/*
+ * Imports pyprofit's C-API. Returns NULL with a python exception set on
+ * error. Must be called holding the GIL.
+ */
+static inline const pyprofit_C_API *pyprofit_import_C_API(void)
+{
+	const pyprofit_C_API *api = (const pyprofit_C_API *)PyCapsule_Import(PYPROFIT_C_API_CAPSULE, 0);
+	if (api != NULL && api->version != PYPROFIT_C_API_VERSION) {
+		PyErr_SetString(PyExc_ImportError, "pyprofit C-API version mismatch");
+		return NULL;
+	}
+	return api;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PYPROFIT_H */
@@ -239,6 +239,15 @@ def has_libprofit(user_incdirs, user_libdirs, extra_compile_args):
 
     return incdir, libdir
 
+def has_fftw(incdir, extra_compile_args):
+
+    # pyprofit uses FFTW itself only if libprofit does already
+    with open(os.path.join(incdir, 'profit', 'config.h'), 'rt') as h:
+        if not re.search(r'#define\WPROFIT_FFTW\b', h.read()):
+            return False
+    code = '#include <fftw3.h>\nint main() { fftw_free(fftw_alloc_real(1)); }'
+    return compiles(code=code, include_dirs=[incdir], extra_preargs=extra_compile_args)
+
 class configure(setuptools.Command):
     """Configure command to enrich the pyprofit extension"""
 
@@ -300,10 +309,19 @@ class configure(setuptools.Command):
         distutils.log.info("-- Found libprofit headers/lib")
 
         pyprofit_ext.libraries = ['profit']
+        # shm_open/shm_unlink live in librt in older glibc versions
+        if sys.platform.startswith('linux'):
+            pyprofit_ext.libraries.append('rt')
         pyprofit_ext.include_dirs = [info[0]]
         pyprofit_ext.library_dirs = [info[1]]
         pyprofit_ext.extra_compile_args = extra_compile_args
 
+        # FFTW is needed to convolve with PSFs given in Fourier space
+        if has_fftw(info[0], extra_compile_args):
+            distutils.log.info("-- Found FFTW, enabling OTF PSFs")
+            pyprofit_ext.libraries.append('fftw3')
+            pyprofit_ext.define_macros.append(('PYPROFIT_HAS_FFTW', None))
+
 class _build_ext(build_ext):
     """Custom build_ext command that includes the configure command"""
 
@@ -325,7 +343,7 @@ class _build_ext(build_ext):
 
 # The initial definition of the pyprofit module
 # It is enriched during the 'configure' step
-pyprofit_ext = Extension('pyprofit', language='c++', sources = ['pyprofit.cpp'])
+pyprofit_ext = Extension('pyprofit', language='c++', sources = ['pyprofit.cpp'], depends = ['pyprofit.h'])
 
 this_dir = os.path.dirname(__file__)
 with open(os.path.join(this_dir, 'README.rst'), 'rt') as f:
@@ -356,6 +374,8 @@ setup(
           "Topic :: Scientific/Engineering :: Astronomy"
       ],
       ext_modules = [pyprofit_ext],
+      headers = ['pyprofit.h'],
+      scripts = ['scripts/pyprofit-serve'],
       cmdclass = {
         'configure': configure,
         'build_ext': _build_ext,